@@ -0,0 +1,417 @@
+#include "archive.h"
+#include "waterfallcompression.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <tuple>
+
+#include <boost/interprocess/file_mapping.hpp>
+
+namespace bip = boost::interprocess;
+
+static constexpr uint32_t SEGMENT_MAGIC = 0x41465757; // "WWFA"
+static constexpr uint32_t SEGMENT_VERSION = 1;
+static constexpr uint32_t RECORD_MAGIC = 0x52465757; // "WWFR"
+
+static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+bool ArchiveSegment::map(bool writable) {
+    try {
+        bip::mode_t mode = writable ? bip::read_write : bip::read_only;
+        bip::file_mapping file(filename.c_str(), mode);
+        region = std::make_shared<bip::mapped_region>(file, mode);
+    } catch (const bip::interprocess_exception &e) {
+        std::cout << "Cannot map " << filename << ": " << e.what()
+                  << std::endl;
+        return false;
+    }
+    base = (uint8_t *)region->get_address();
+    mapped = region->get_size();
+    this->writable = writable;
+    return true;
+}
+
+std::unique_ptr<ArchiveSegment>
+ArchiveSegment::open(const std::string &filename,
+                     const archive_segment_header &expected) {
+    std::unique_ptr<ArchiveSegment> segment(new ArchiveSegment());
+    segment->filename = filename;
+    if (std::filesystem::file_size(filename) < sizeof(expected) ||
+        !segment->map(false)) {
+        return nullptr;
+    }
+    archive_segment_header header;
+    memcpy(&header, segment->base, sizeof(header));
+    if (header.magic != expected.magic || header.version != expected.version ||
+        header.first_level != expected.first_level ||
+        header.levels != expected.levels || header.size != expected.size) {
+        return nullptr;
+    }
+
+    // A segment that was not finished ends in zeros
+    size_t offset = sizeof(header);
+    while (offset + sizeof(archive_record) <= segment->mapped) {
+        archive_record record;
+        memcpy(&record, segment->base + offset, sizeof(record));
+        if (record.magic != RECORD_MAGIC ||
+            offset + sizeof(record) + record.bytes > segment->mapped) {
+            break;
+        }
+        segment->index.push_back({record.time_ms, offset});
+        offset += sizeof(record) + record.bytes;
+    }
+    segment->used = offset;
+    return segment;
+}
+
+std::unique_ptr<ArchiveSegment>
+ArchiveSegment::create(const std::string &filename,
+                       const archive_segment_header &header, size_t capacity) {
+    std::unique_ptr<ArchiveSegment> segment(new ArchiveSegment());
+    segment->filename = filename;
+    {
+        std::ofstream file(filename, std::ios::out | std::ios::binary |
+                                         std::ios::trunc);
+        if (!file) {
+            return nullptr;
+        }
+    }
+    // Sparse until written
+    std::error_code ec;
+    std::filesystem::resize_file(filename, capacity, ec);
+    if (ec || !segment->map(true)) {
+        return nullptr;
+    }
+    memcpy(segment->base, &header, sizeof(header));
+    segment->used = sizeof(header);
+    return segment;
+}
+
+ArchiveSegment::~ArchiveSegment() {}
+
+uint8_t *ArchiveSegment::append_space(size_t bytes) {
+    if (!writable || used + bytes > mapped) {
+        return nullptr;
+    }
+    return base + used;
+}
+
+void ArchiveSegment::commit(int64_t time_ms, size_t bytes) {
+    index.push_back({time_ms, used});
+    used += bytes;
+}
+
+void ArchiveSegment::finish() {
+    if (!writable) {
+        return;
+    }
+    region->flush();
+    region.reset();
+    base = nullptr;
+    std::error_code ec;
+    std::filesystem::resize_file(filename, used, ec);
+    map(false);
+}
+
+void ArchiveSegment::remove() {
+    region.reset();
+    base = nullptr;
+    std::error_code ec;
+    std::filesystem::remove(filename, ec);
+}
+
+int64_t ArchiveSegment::first_time() const {
+    return index.empty() ? std::numeric_limits<int64_t>::max()
+                         : index.front().time_ms;
+}
+
+int64_t ArchiveSegment::last_time() const {
+    return index.empty() ? std::numeric_limits<int64_t>::min()
+                         : index.back().time_ms;
+}
+
+// Slots hold the frame number and time followed by the levels
+static constexpr size_t SLOT_HEADER = 16;
+
+static size_t archived_bytes(int first_level, int levels, int size) {
+    size_t bytes = 0;
+    for (int i = first_level; i < first_level + levels; i++) {
+        bytes += size >> i;
+    }
+    return bytes;
+}
+
+WaterfallArchive::WaterfallArchive(const std::string &directory,
+                                   int first_level, int levels, int size,
+                                   int interval_ms, size_t segment_bytes,
+                                   int64_t retention_ms)
+    : directory{directory}, first_level{first_level}, levels{levels},
+      size{size}, interval_ms{interval_ms}, segment_bytes{segment_bytes},
+      retention_ms{retention_ms},
+      row_bytes{archived_bytes(first_level, levels, size)},
+      last_push_ms{std::numeric_limits<int64_t>::min()}, dropped{0},
+      ring(
+          16, [&]() -> void * { return new uint8_t[SLOT_HEADER + row_bytes]; },
+          [](void *slot) { delete[] (uint8_t *)slot; }),
+      writable{false} {
+    header = {SEGMENT_MAGIC, SEGMENT_VERSION, first_level, levels, size, 0};
+    size_t offset = 0;
+    for (int i = 0; i < first_level + levels; i++) {
+        if (i >= first_level) {
+            level_offsets.push_back(offset);
+        }
+        offset += size >> i;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    for (auto &entry : std::filesystem::directory_iterator(directory, ec)) {
+        if (entry.path().extension() != ".wfa") {
+            continue;
+        }
+        auto segment = ArchiveSegment::open(entry.path().string(), header);
+        if (segment && !segment->get_index().empty()) {
+            segments.push_back(std::move(segment));
+        }
+    }
+    std::sort(segments.begin(), segments.end(), [](auto &a, auto &b) {
+        return a->first_time() < b->first_time();
+    });
+    std::cout << "Waterfall archive in " << directory << " has "
+              << segments.size() << " segments" << std::endl;
+
+    {
+        std::scoped_lock lk(mtx);
+        writable = rotate(now_ms());
+    }
+    writer_thread = std::thread(&WaterfallArchive::writer, this);
+}
+
+WaterfallArchive::~WaterfallArchive() {
+    ring.close();
+    writer_thread.join();
+    std::scoped_lock lk(mtx);
+    if (!segments.empty()) {
+        segments.back()->finish();
+    }
+}
+
+std::string WaterfallArchive::segment_name(int64_t time_ms) const {
+    // Zero padded so the files list in time order
+    std::string name = std::to_string(time_ms);
+    name.insert(0, std::max(0, 16 - (int)name.size()), '0');
+    return (std::filesystem::path(directory) / (name + ".wfa")).string();
+}
+
+void WaterfallArchive::push(uint64_t frame_num, const int8_t *pyramid,
+                            uint32_t pyramid_mask) {
+    int64_t time_ms = now_ms();
+    uint32_t archived = ((1u << levels) - 1) << first_level;
+    if (time_ms - last_push_ms < interval_ms ||
+        (pyramid_mask & archived) != archived) {
+        return;
+    }
+    uint8_t *slot = (uint8_t *)ring.try_acquire_write();
+    if (!slot) {
+        // Reported every thousand rows so a slow disk shows in the log
+        if (++dropped % 1000 == 1) {
+            std::cout << "Waterfall archive is behind, " << dropped
+                      << " rows dropped" << std::endl;
+        }
+        return;
+    }
+    memcpy(slot, &frame_num, sizeof(frame_num));
+    memcpy(slot + 8, &time_ms, sizeof(time_ms));
+    size_t pos = SLOT_HEADER;
+    for (int i = 0; i < levels; i++) {
+        size_t width = size >> (first_level + i);
+        memcpy(slot + pos, pyramid + level_offsets[i], width);
+        pos += width;
+    }
+    ring.commit_write();
+    last_push_ms = time_ms;
+}
+
+void WaterfallArchive::writer() {
+    std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(
+        ZSTD_createCCtx(), ZSTD_freeCCtx);
+    while (ring.wait_readable(1)) {
+        write_row(cctx.get(), (const uint8_t *)ring.read_slot(0));
+        ring.release_read();
+    }
+}
+
+void WaterfallArchive::write_row(ZSTD_CCtx *cctx, const uint8_t *slot) {
+    archive_record record;
+    record.magic = RECORD_MAGIC;
+    memcpy(&record.frame_num, slot, sizeof(record.frame_num));
+    memcpy(&record.time_ms, slot + 8, sizeof(record.time_ms));
+
+    size_t sizes_bytes = sizeof(uint32_t) * levels;
+    size_t bound = sizeof(record) + sizes_bytes;
+    for (int i = 0; i < levels; i++) {
+        bound += ZSTD_compressBound(size >> (first_level + i));
+    }
+
+    std::scoped_lock lk(mtx);
+    if (!writable) {
+        return;
+    }
+    uint8_t *dst = segments.back()->append_space(bound);
+    if (!dst) {
+        writable = rotate(record.time_ms);
+        if (!writable || !(dst = segments.back()->append_space(bound))) {
+            return;
+        }
+    }
+
+    // Compressed straight into the mapped file
+    size_t pos = sizeof(record) + sizes_bytes;
+    const uint8_t *src = slot + SLOT_HEADER;
+    for (int i = 0; i < levels; i++) {
+        size_t width = size >> (first_level + i);
+        size_t compressed = ZSTD_compressCCtx(cctx, dst + pos, bound - pos,
+                                              src, width, ZSTD_CLEVEL_DEFAULT);
+        if (ZSTD_isError(compressed)) {
+            return;
+        }
+        uint32_t compressed_u32 = compressed;
+        memcpy(dst + sizeof(record) + sizeof(uint32_t) * i, &compressed_u32,
+               sizeof(compressed_u32));
+        pos += compressed;
+        src += width;
+    }
+    record.bytes = pos - sizeof(record);
+    memcpy(dst, &record, sizeof(record));
+    segments.back()->commit(record.time_ms, pos);
+}
+
+bool WaterfallArchive::rotate(int64_t time_ms) {
+    if (!segments.empty()) {
+        segments.back()->finish();
+    }
+    while (!segments.empty() &&
+           segments.front()->last_time() < time_ms - retention_ms) {
+        segments.front()->remove();
+        segments.erase(segments.begin());
+    }
+    auto segment =
+        ArchiveSegment::create(segment_name(time_ms), header, segment_bytes);
+    if (!segment) {
+        std::cout << "Cannot create a waterfall archive segment in "
+                  << directory << ", archiving stops" << std::endl;
+        return false;
+    }
+    segments.push_back(std::move(segment));
+    return true;
+}
+
+std::string WaterfallArchive::query(int64_t from_ms, int64_t to_ms, int level,
+                                    size_t max_rows) {
+    int idx = level - first_level;
+    if (idx < 0 || idx >= levels || from_ms > to_ms || !max_rows) {
+        return "";
+    }
+    int width = size >> level;
+
+    // Where the picked rows are, copied under the lock since appending
+    // grows the index and rotating unmaps the segments
+    struct span {
+        std::shared_ptr<const bip::mapped_region> region;
+        std::vector<size_t> offsets;
+    };
+    std::vector<span> spans;
+    {
+        std::scoped_lock lk(mtx);
+        // Rows in range of each segment, found by binary search on the
+        // segments and then on their index
+        std::vector<std::tuple<const ArchiveSegment *, size_t, size_t>> found;
+        size_t total = 0;
+        auto it = std::upper_bound(
+            segments.begin(), segments.end(), from_ms,
+            [](int64_t t, auto &segment) { return t < segment->first_time(); });
+        if (it != segments.begin()) {
+            --it;
+        }
+        for (; it != segments.end() && (*it)->first_time() <= to_ms; ++it) {
+            auto &index = (*it)->get_index();
+            auto begin = std::lower_bound(
+                index.begin(), index.end(), from_ms,
+                [](auto &entry, int64_t t) { return entry.time_ms < t; });
+            auto end = std::upper_bound(
+                begin, index.end(), to_ms,
+                [](int64_t t, auto &entry) { return t < entry.time_ms; });
+            if (begin != end) {
+                found.emplace_back(it->get(), begin - index.begin(),
+                                   end - index.begin());
+                total += end - begin;
+            }
+        }
+
+        // Every step-th row so long ranges stay within max_rows
+        size_t step = std::max<size_t>(1, (total + max_rows - 1) / max_rows);
+        // Position of the first row of the span among all rows in range
+        size_t position = 0;
+        for (auto &[segment, begin, end] : found) {
+            auto &index = segment->get_index();
+            span &picked = spans.emplace_back();
+            picked.region = segment->get_region();
+            for (size_t i = begin + (step - position % step) % step; i < end;
+                 i += step) {
+                picked.offsets.push_back(index[i].offset);
+            }
+            position += end - begin;
+        }
+    }
+
+    std::string body;
+    waterfall_history_header start = {~0ULL, 0, 0, 0};
+    body.append((const char *)&start, sizeof(start));
+    for (auto &span : spans) {
+        // The file could not be mapped again once it was finished
+        if (!span.region) {
+            continue;
+        }
+        const uint8_t *data = (const uint8_t *)span.region->get_address();
+        for (size_t offset : span.offsets) {
+            const uint8_t *record_ptr = data + offset;
+            archive_record record;
+            memcpy(&record, record_ptr, sizeof(record));
+            size_t level_offset = sizeof(record) + sizeof(uint32_t) * levels;
+            uint32_t compressed = 0;
+            for (int j = 0; j <= idx; j++) {
+                memcpy(&compressed,
+                       record_ptr + sizeof(record) + sizeof(uint32_t) * j,
+                       sizeof(compressed));
+                if (j < idx) {
+                    level_offset += compressed;
+                }
+            }
+
+            waterfall_archive_row row;
+            row.header.frame_num = record.frame_num;
+            row.header.m = 0;
+            row.header.l = 0;
+            row.header.r = width << level;
+            row.header.pwr = 0;
+            row.header.bytes = width;
+            row.payload = compressed;
+            row.reserved = 0;
+            row.time_ms = record.time_ms;
+            body.append((const char *)&row, sizeof(row));
+            body.append((const char *)record_ptr + level_offset, compressed);
+            start.rows++;
+        }
+    }
+    memcpy(body.data(), &start, sizeof(start));
+    return body;
+}
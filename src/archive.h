@@ -0,0 +1,156 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/interprocess/mapped_region.hpp>
+#include <zstd.h>
+
+#include "ringbuffer.h"
+
+// Days of waterfall rows of the coarser levels kept on disk. Rows are
+// zstd compressed, level by level, into segment files that are memory
+// mapped for both appending and serving, each with an in memory time index
+
+// Starts each segment file
+struct archive_segment_header {
+    uint32_t magic;
+    uint32_t version;
+    // Archived levels and the width of level 0
+    int32_t first_level;
+    int32_t levels;
+    int32_t size;
+    int32_t reserved;
+};
+
+// Starts each row in a segment, followed by one uint32_t compressed size
+// per level and then the levels, each an independent zstd frame
+struct archive_record {
+    uint32_t magic;
+    // Bytes after this header, the sizes included
+    uint32_t bytes;
+    uint64_t frame_num;
+    // Milliseconds since the epoch
+    int64_t time_ms;
+};
+
+// One segment file, mapped for its whole life
+class ArchiveSegment {
+  public:
+    struct index_entry {
+        int64_t time_ms;
+        // Where the record starts in the file
+        size_t offset;
+    };
+
+    // Maps an existing segment and indexes its records, returns null if it
+    // cannot be read or holds other levels
+    static std::unique_ptr<ArchiveSegment>
+    open(const std::string &filename, const archive_segment_header &expected);
+    // Creates a segment that records are appended to until capacity bytes
+    static std::unique_ptr<ArchiveSegment>
+    create(const std::string &filename, const archive_segment_header &header,
+           size_t capacity);
+    ArchiveSegment(const ArchiveSegment &) = delete;
+    ArchiveSegment &operator=(const ArchiveSegment &) = delete;
+    ~ArchiveSegment();
+
+    // Space left to append, nullptr if bytes do not fit
+    uint8_t *append_space(size_t bytes);
+    // Makes the bytes written at append_space part of the segment
+    void commit(int64_t time_ms, size_t bytes);
+    // Shrinks the file to what was written and maps it read only
+    void finish();
+    // Unmaps and deletes the file, the segment may only be destroyed after
+    void remove();
+
+    const uint8_t *data() const { return base; }
+    // Keeps the current mapping alive past finish and remove, for reading
+    // records outside the archive's lock
+    std::shared_ptr<const boost::interprocess::mapped_region>
+    get_region() const {
+        return region;
+    }
+    const std::vector<index_entry> &get_index() const { return index; }
+    // Empty segments sort last
+    int64_t first_time() const;
+    int64_t last_time() const;
+
+  protected:
+    ArchiveSegment() = default;
+    // Maps the whole file, writable or read only
+    bool map(bool writable);
+
+    std::string filename;
+    // Replaced rather than remapped, so readers holding it keep their view
+    std::shared_ptr<boost::interprocess::mapped_region> region;
+    uint8_t *base = nullptr;
+    size_t mapped = 0;
+    size_t used = 0;
+    bool writable = false;
+    std::vector<index_entry> index;
+};
+
+class WaterfallArchive {
+  public:
+    // Archives the levels [first_level, first_level + levels) of a pyramid
+    // whose level 0 is size wide, at most one row every interval_ms
+    WaterfallArchive(const std::string &directory, int first_level,
+                     int levels, int size, int interval_ms,
+                     size_t segment_bytes, int64_t retention_ms);
+    WaterfallArchive(const WaterfallArchive &) = delete;
+    WaterfallArchive &operator=(const WaterfallArchive &) = delete;
+    ~WaterfallArchive();
+
+    int get_first_level() const { return first_level; }
+    int get_levels() const { return levels; }
+    // Copies the archived levels of the pyramid for the writer thread, the
+    // row is dropped rather than waited for if the writer is behind
+    // Called from the FFT thread only
+    void push(uint64_t frame_num, const int8_t *pyramid, uint32_t pyramid_mask);
+    // Rows of the level between from_ms and to_ms, thinned out evenly to at
+    // most max_rows, as a waterfall history message with
+    // waterfall_archive_row rows
+    std::string query(int64_t from_ms, int64_t to_ms, int level,
+                      size_t max_rows);
+
+  protected:
+    void writer();
+    void write_row(ZSTD_CCtx *cctx, const uint8_t *slot);
+    // Finishes the open segment and starts a new one, dropping the
+    // segments past the retention
+    bool rotate(int64_t time_ms);
+    std::string segment_name(int64_t time_ms) const;
+
+    std::string directory;
+    int first_level;
+    int levels;
+    int size;
+    int interval_ms;
+    size_t segment_bytes;
+    int64_t retention_ms;
+    archive_segment_header header;
+    // Offset of each archived level in the pyramid and the slots
+    std::vector<size_t> level_offsets;
+    size_t row_bytes;
+    int64_t last_push_ms;
+    uint64_t dropped;
+
+    SampleRingBuffer ring;
+    std::thread writer_thread;
+
+    // Guards the segments, held while appending and by queries only to
+    // pick their rows
+    std::mutex mtx;
+    // Oldest first, the last one is appended to
+    std::vector<std::unique_ptr<ArchiveSegment>> segments;
+    bool writable;
+};
+
+#endif
@@ -3,9 +3,12 @@
 #include <boost/container/small_vector.hpp>
 #include <iostream>
 
+static std::atomic<uint64_t> next_stream_id{1};
+
 AudioEncoder::AudioEncoder(websocketpp::connection_hdl hdl,
                            PacketSender &sender)
-    : hdl{hdl}, sender{sender} {
+    : hdl{hdl}, followers{nullptr}, sender{sender},
+      stream_id{next_stream_id++}, framing{FRAMING_CBOR} {
     set_data(0, 0, 0, 0, 0);
     stream = ZSTD_createCStream();
 }
@@ -16,6 +19,14 @@ AudioEncoder::~AudioEncoder() {
 
 void AudioEncoder::set_data(uint64_t frame_num, int l, double m, int r,
                             double pwr) {
+    header.frame_num = frame_num;
+    header.m = m;
+    header.l = l;
+    header.r = r;
+    header.pwr = pwr;
+    if (framing == FRAMING_BINARY) {
+        return;
+    }
     packet["frame_num"] = frame_num;
     packet["l"] = l;
     packet["m"] = m;
@@ -23,21 +34,69 @@ void AudioEncoder::set_data(uint64_t frame_num, int l, double m, int r,
     packet["pwr"] = pwr;
 }
 
+void AudioEncoder::set_followers(
+    const std::vector<websocketpp::connection_hdl> *followers) {
+    this->followers = followers;
+}
+
+void AudioEncoder::send_to_listeners(packet_buffers_t bufs) {
+    sender.send_binary_packet(hdl, bufs);
+    if (followers) {
+        for (auto &follower : *followers) {
+            // A follower disconnecting must not stop the encoder
+            try {
+                sender.send_binary_packet(follower, bufs);
+            } catch (...) {
+            }
+        }
+    }
+}
+
+template <typename F>
+void AudioEncoder::send_framed(const void *buffer, size_t bytes, F send_fn) {
+    if (framing == FRAMING_BINARY) {
+        // The encoded audio goes out as is behind the header
+        header.bytes = bytes;
+        std::pair<const void *, size_t> bufs[] = {{&header, sizeof(header)},
+                                                  {buffer, bytes}};
+        send_fn(bufs);
+        return;
+    }
+    packet["data"] = json::binary(
+        std::vector<uint8_t>((uint8_t *)buffer, (uint8_t *)buffer + bytes));
+    auto cbor = json::to_cbor(packet);
+    std::pair<const void *, size_t> bufs[] = {{cbor.data(), cbor.size()}};
+    send_fn(bufs);
+}
+
 int AudioEncoder::send(const void *buffer, size_t bytes, unsigned) {
     try {
-        packet["data"] = json::binary(
-            std::vector<uint8_t>((uint8_t *)buffer, (uint8_t *)buffer + bytes));
-        auto cbor = json::to_cbor(packet);
-        sender.send_binary_packet(hdl, cbor.data(), cbor.size());
+        send_framed(buffer, bytes,
+                    [this](packet_buffers_t bufs) { send_to_listeners(bufs); });
         return 0;
     } catch (...) {
         return 1;
     }
 }
 
+void AudioEncoder::send_stream_header(websocketpp::connection_hdl hdl) {
+    for (auto &part : stream_header) {
+        send_framed(part.data(), part.size(), [&](packet_buffers_t bufs) {
+            sender.send_binary_packet(hdl, bufs);
+        });
+    }
+}
+
 FLAC__StreamEncoderWriteStatus
-FlacEncoder::write_callback(const FLAC__byte buffer[], size_t bytes, unsigned,
-                            unsigned current_frame) {
+FlacEncoder::write_callback(const FLAC__byte buffer[], size_t bytes,
+                            unsigned samples, unsigned current_frame) {
+    if (!stream_started) {
+        if (samples == 0) {
+            stream_header.emplace_back(buffer, buffer + bytes);
+            return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+        }
+        stream_started = true;
+    }
     return send(buffer, bytes, current_frame)
                ? FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR
                : FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
@@ -1,6 +1,7 @@
 #ifndef AUDIO_H
 #define AUDIO_H
 
+#include <atomic>
 #include <string>
 #include <vector>
 
@@ -24,16 +25,38 @@ class AudioEncoder {
   public:
     AudioEncoder(websocketpp::connection_hdl hdl, PacketSender& sender);
     void set_data(uint64_t frame_num, int l, double m, int r, double pwr);
+    // Other listeners that also receive everything this encoder sends
+    void set_followers(
+        const std::vector<websocketpp::connection_hdl> *followers);
+    void set_framing(packet_framing framing) { this->framing = framing; }
+    packet_framing get_framing() const { return framing; }
+    // Identifies the stream of this encoder among all of them
+    uint64_t get_stream_id() const { return stream_id; }
+    // Sends what the codec wrote ahead of the first audio to one listener,
+    // whose decoder then starts over on this encoder's stream
+    void send_stream_header(websocketpp::connection_hdl hdl);
     virtual int process(int32_t *data, size_t size) = 0;
     virtual int finish_encoder() = 0;
     virtual ~AudioEncoder();
 
   protected:
     int send(const void *buffer, size_t bytes, unsigned current_frame);
+    // Frames the payload and hands the pieces to send_fn
+    template <typename F>
+    void send_framed(const void *buffer, size_t bytes, F send_fn);
+    // Sends the same message to the client and its followers
+    void send_to_listeners(packet_buffers_t bufs);
     websocketpp::connection_hdl hdl;
+    const std::vector<websocketpp::connection_hdl> *followers;
     PacketSender& sender;
 
+    uint64_t stream_id;
+    // Kept instead of sent, it is sent whenever a listener starts on it
+    std::vector<std::vector<uint8_t>> stream_header;
+
+    std::atomic<packet_framing> framing;
     json packet;
+    binary_packet_header header;
     ZSTD_CStream *stream;
 };
 
@@ -49,6 +72,10 @@ class FlacEncoder : public AudioEncoder, public FLAC::Encoder::Stream {
                    unsigned current_frame);
     int finish_encoder();
     int process(int32_t *data, size_t size);
+
+    // Set once the first audio frame is written, the metadata written
+    // before it is the stream header
+    bool stream_started = false;
 };
 
 #ifdef HAS_LIBOPUS
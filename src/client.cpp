@@ -3,7 +3,14 @@
 #include "glaze/glaze.hpp"
 
 Client::Client(connection_hdl hdl, PacketSender &sender, conn_type type)
-    : type{type}, hdl{hdl}, sender{sender}, frame_num{0}, mute{false} {}
+    : type{type}, hdl{hdl}, busy{false}, sender{sender}, frame_num{0},
+      mute{false} {}
+
+void PacketSender::send_binary_packet(
+    connection_hdl hdl,
+    const std::initializer_list<std::pair<const void *, size_t>> &bufs) {
+    send_binary_packet(hdl, packet_buffers_t(bufs.begin(), bufs.size()));
+}
 
 void PacketSender::send_binary_packet(connection_hdl hdl, const void *data,
                                       size_t size) {
@@ -21,6 +28,8 @@ struct window_cmd {
     int r;
     std::optional<double> m;
     std::optional<int> level;
+    std::optional<std::string> tier;
+    std::optional<bool> tiles;
 };
 
 template <> 
@@ -31,7 +40,9 @@ struct glz::meta<window_cmd>
         "l", &T::l,
         "r", &T::r,
         "m", &T::m,
-        "level", &T::level
+        "level", &T::level,
+        "tier", &T::tier,
+        "tiles", &T::tiles
     );
 };
 
@@ -61,6 +72,47 @@ struct glz::meta<userid_cmd>
     );
 };
 
+struct framing_cmd {
+    std::string framing;
+};
+
+template <>
+struct glz::meta<framing_cmd>
+{
+    using T = framing_cmd;
+    static constexpr auto value = object(
+        "framing", &T::framing
+    );
+};
+
+struct coding_cmd {
+    std::optional<bool> delta;
+    std::optional<bool> dictionary;
+};
+
+template <>
+struct glz::meta<coding_cmd>
+{
+    using T = coding_cmd;
+    static constexpr auto value = object(
+        "delta", &T::delta,
+        "dictionary", &T::dictionary
+    );
+};
+
+struct history_cmd {
+    bool history;
+};
+
+template <>
+struct glz::meta<history_cmd>
+{
+    using T = history_cmd;
+    static constexpr auto value = object(
+        "history", &T::history
+    );
+};
+
 struct mute_cmd {
     bool mute;
 };
@@ -74,7 +126,7 @@ struct glz::meta<mute_cmd>
     );
 };
 
-using msg_variant = std::variant<window_cmd, demodulation_cmd, userid_cmd, mute_cmd>;
+using msg_variant = std::variant<window_cmd, demodulation_cmd, userid_cmd, mute_cmd, framing_cmd, coding_cmd, history_cmd>;
 
 template <>
 struct glz::meta<msg_variant>
@@ -84,7 +136,10 @@ struct glz::meta<msg_variant>
         "window",
         "demodulation",
         "userid",
-        "mute"
+        "mute",
+        "framing",
+        "coding",
+        "history"
     };
 };
 
@@ -107,17 +162,38 @@ void Client::on_message(std::string &msg) {
 
     std::visit(
         overloaded{[&](window_cmd &cmd) {
+                       if (cmd.tier.has_value()) {
+                           on_tier_message(cmd.tier.value());
+                       }
+                       if (cmd.tiles.has_value()) {
+                           on_tiles_message(cmd.tiles.value());
+                       }
                        on_window_message(cmd.l, cmd.m, cmd.r, cmd.level);
                    },
                    [&](demodulation_cmd &cmd) {
                        on_demodulation_message(cmd.demodulation);
                    },
                    [&](userid_cmd &cmd) { on_userid_message(cmd.userid); },
-                   [&](mute_cmd &cmd) { on_mute(cmd.mute); }},
+                   [&](mute_cmd &cmd) { on_mute(cmd.mute); },
+                   [&](framing_cmd &cmd) {
+                       on_framing_message(cmd.framing == "binary"
+                                              ? FRAMING_BINARY
+                                              : FRAMING_CBOR);
+                   },
+                   [&](coding_cmd &cmd) {
+                       on_coding_message(cmd.delta.value_or(false),
+                                         cmd.dictionary.value_or(false));
+                   },
+                   [&](history_cmd &cmd) { on_history_message(cmd.history); }},
         msg_parsed);
 }
 void Client::on_window_message(int, std::optional<double> &, int,
                                std::optional<int> &) {}
+void Client::on_tier_message(std::string &) {}
+void Client::on_tiles_message(bool) {}
+void Client::on_framing_message(packet_framing) {}
+void Client::on_coding_message(bool, bool) {}
+void Client::on_history_message(bool) {}
 void Client::on_demodulation_message(std::string &) {}
 void Client::on_userid_message(std::string &userid) {
     // Used for correlating between signal and waterfall sockets
@@ -1,14 +1,19 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include <atomic>
+#include <cstdint>
 #include <mutex>
 #include <optional>
+#include <span>
 #include <string>
 #include <vector>
 
 #include <fftw3.h>
 #include <websocketpp/connection.hpp>
 
+#include "websocket.h"
+
 using websocketpp::connection_hdl;
 
 enum conn_type {
@@ -46,6 +51,23 @@ enum waterfall_compressor { WATERFALL_ZSTD, WATERFALL_AV1 };
 
 enum audio_compressor { AUDIO_FLAC, AUDIO_OPUS };
 
+// How waterfall and audio packets are framed, clients that understand the
+// binary header ask for it after the basic info
+enum packet_framing { FRAMING_CBOR, FRAMING_BINARY };
+
+// Sent in front of the payload of binary framed packets, in host order which
+// is little endian on every supported platform
+struct binary_packet_header {
+    uint64_t frame_num;
+    double m;
+    int32_t l;
+    int32_t r;
+    float pwr;
+    // Size of the payload once decompressed
+    uint32_t bytes;
+};
+static_assert(sizeof(binary_packet_header) == 32);
+
 class WaterfallClient;
 class AudioClient;
 typedef std::vector<
@@ -54,13 +76,17 @@ typedef std::vector<
 typedef std::deque<std::mutex> waterfall_mutexes_t;
 typedef std::multimap<std::pair<int, int>, std::shared_ptr<AudioClient>>
     signal_slices_t;
+// Pieces sent back to back as one binary message
+typedef std::span<const std::pair<const void *, size_t>> packet_buffers_t;
 
 class PacketSender {
   public:
     PacketSender() {}
+    virtual void send_binary_packet(connection_hdl hdl,
+                                    packet_buffers_t bufs) = 0;
     virtual void send_binary_packet(
         connection_hdl hdl,
-        const std::initializer_list<std::pair<const void *, size_t>> &bufs) = 0;
+        const std::initializer_list<std::pair<const void *, size_t>> &bufs);
     virtual void send_binary_packet(connection_hdl hdl, const void *data,
                                     size_t size);
     virtual void
@@ -68,6 +94,8 @@ class PacketSender {
                      const std::initializer_list<std::string> &data) = 0;
     virtual void send_text_packet(connection_hdl hdl, const std::string &data);
     virtual std::string ip_from_hdl(connection_hdl hdl) = 0;
+    // Bytes queued on the connection and not sent yet
+    virtual size_t get_buffered_amount(connection_hdl hdl) = 0;
     virtual void log(connection_hdl hdl, const std::string &msg) = 0;
 
     virtual waterfall_slices_t &get_waterfall_slices() = 0;
@@ -88,6 +116,16 @@ class Client {
 
     virtual void on_window_message(int l, std::optional<double> &m, int r,
                                    std::optional<int> &level);
+    // Waterfall tier, "high" from the main FFT or "fast" from the small one
+    virtual void on_tier_message(std::string &tier);
+    // Whether the client takes the waterfall as shared tiles
+    virtual void on_tiles_message(bool tiles);
+    virtual void on_framing_message(packet_framing framing);
+    // Waterfall rows predicted from the previous row and compressed with the
+    // advertised dictionary
+    virtual void on_coding_message(bool delta, bool dictionary);
+    // Waterfall rows of the last seconds sent whenever the view changes
+    virtual void on_history_message(bool history);
     virtual void on_demodulation_message(std::string &demodulation);
     virtual void on_userid_message(std::string &userid);
     virtual void on_mute(bool mute);
@@ -103,6 +141,11 @@ class Client {
 
     // Connection handle
     connection_hdl hdl;
+    // Cached so the frame loops avoid looking up the handle, cleared on close
+    server::connection_ptr con;
+    // Set while an io thread is sending a frame to this client, newer frames
+    // skip the client instead of waiting for it
+    std::atomic<bool> busy;
     PacketSender &sender;
 
     // 0 frequency of the downconverted signal
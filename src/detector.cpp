@@ -0,0 +1,321 @@
+#include "detector.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DETECTOR_X86
+#include <immintrin.h>
+#endif
+
+// Bins per noise floor estimate
+static constexpr int SEGMENT_BINS = 128;
+// The noise floor of a segment is its 20th percentile
+static constexpr int NOISE_FLOOR_PERCENT = 20;
+// Busy bins this close together are one channel
+static constexpr int MERGE_GAP = 2;
+// Rows in a row a channel is seen in before it is reported
+static constexpr int CONFIRM_ROWS = 3;
+// dB the SNR has to move by to be sent again
+static constexpr float SNR_REPORT_STEP = 3;
+
+static void average_row_generic(const int8_t *row, float *average,
+                                size_t len, float alpha) {
+    for (size_t i = 0; i < len; i++) {
+        average[i] += alpha * (row[i] - average[i]);
+    }
+}
+static void mark_busy_generic(const float *average, const float *busy_level,
+                              uint8_t *busy, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        busy[i] = average[i] > busy_level[i];
+    }
+}
+
+#ifdef DETECTOR_X86
+__attribute__((target("avx2"))) static void
+average_row_avx2(const int8_t *row, float *average, size_t len, float alpha) {
+    const __m256 a = _mm256_set1_ps(alpha);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m256 value = _mm256_cvtepi32_ps(
+            _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(row + i))));
+        __m256 avg = _mm256_loadu_ps(average + i);
+        avg = _mm256_add_ps(avg,
+                            _mm256_mul_ps(a, _mm256_sub_ps(value, avg)));
+        _mm256_storeu_ps(average + i, avg);
+    }
+    average_row_generic(row + i, average + i, len - i, alpha);
+}
+// 32 bins at a time, the packs interleave the 128 bit lanes so the dwords
+// are put back in order at the end
+__attribute__((target("avx2"))) static void
+mark_busy_avx2(const float *average, const float *busy_level, uint8_t *busy,
+               size_t len) {
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i c[4];
+        for (int j = 0; j < 4; j++) {
+            c[j] = _mm256_castps_si256(
+                _mm256_cmp_ps(_mm256_loadu_ps(average + i + j * 8),
+                              _mm256_loadu_ps(busy_level + i + j * 8),
+                              _CMP_GT_OQ));
+        }
+        __m256i bytes = _mm256_packs_epi16(_mm256_packs_epi32(c[0], c[1]),
+                                           _mm256_packs_epi32(c[2], c[3]));
+        bytes = _mm256_permutevar8x32_epi32(bytes, order);
+        _mm256_storeu_si256((__m256i *)(busy + i),
+                            _mm256_and_si256(bytes, _mm256_set1_epi8(1)));
+    }
+    mark_busy_generic(average + i, busy_level + i, busy + i, len - i);
+}
+#endif
+
+static bool has_avx2() {
+#ifdef DETECTOR_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+SignalDetector::SignalDetector(int level, int size, double rows_per_second,
+                               int threshold, double hold_seconds,
+                               size_t max_signals)
+    : level{level}, bins{size >> level}, offset{0}, threshold{threshold},
+      hold_ms{(int64_t)(hold_seconds * 1000)}, max_signals{max_signals},
+      average(bins), segment_floor((bins + SEGMENT_BINS - 1) / SEGMENT_BINS),
+      busy_level(bins), busy(bins), segment_histogram(256), frames{0},
+      next_id{1} {
+    average_row = average_row_generic;
+    mark_busy = mark_busy_generic;
+#ifdef DETECTOR_X86
+    if (has_avx2()) {
+        average_row = average_row_avx2;
+        mark_busy = mark_busy_avx2;
+    }
+#endif
+    for (int i = 0; i < level; i++) {
+        offset += size >> i;
+    }
+    // Averages over about a second
+    alpha = 1 - std::exp(-1. / std::max(1., rows_per_second));
+    // Every other bin can be a channel at most
+    detections.reserve(bins / 2 + 1);
+    tracks.reserve(max_signals);
+    removed.reserve(max_signals);
+}
+
+void SignalDetector::update(const int8_t *pyramid, uint32_t pyramid_mask) {
+    if (!(pyramid_mask >> level & 1)) {
+        return;
+    }
+    const int8_t *row = pyramid + offset;
+    if (frames++ == 0) {
+        std::copy(row, row + bins, average.begin());
+    }
+    average_row(row, average.data(), bins, alpha);
+    estimate_noise_floor();
+
+    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+    find_channels(now);
+
+    std::unique_lock lk(mtx, std::try_to_lock);
+    if (lk.owns_lock()) {
+        match_tracks(now);
+    }
+}
+
+void SignalDetector::estimate_noise_floor() {
+    int segments = segment_floor.size();
+    for (int s = 0; s < segments; s++) {
+        int start = s * SEGMENT_BINS;
+        int end = std::min(bins, start + SEGMENT_BINS);
+        std::fill(segment_histogram.begin(), segment_histogram.end(), 0);
+        for (int i = start; i < end; i++) {
+            segment_histogram[std::clamp((int)average[i], -128, 127) + 128]++;
+        }
+        int floor = 0;
+        for (int count = 0, target = (end - start) * NOISE_FLOOR_PERCENT / 100;
+             floor < 255 && count + (int)segment_histogram[floor] <= target;
+             floor++) {
+            count += segment_histogram[floor];
+        }
+        segment_floor[s] = floor - 128;
+    }
+
+    // A wide signal raises the floor of its segments, the quieter
+    // neighbour is closer to the real floor
+    for (int s = 0; s < segments; s++) {
+        float floor = segment_floor[s];
+        if (s > 0) {
+            floor = std::min(floor, segment_floor[s - 1]);
+        }
+        if (s + 1 < segments) {
+            floor = std::min(floor, segment_floor[s + 1]);
+        }
+        int start = s * SEGMENT_BINS;
+        int end = std::min(bins, start + SEGMENT_BINS);
+        std::fill(busy_level.begin() + start, busy_level.begin() + end,
+                  floor + threshold);
+    }
+    mark_busy(average.data(), busy_level.data(), busy.data(), bins);
+}
+
+void SignalDetector::find_channels(int64_t now) {
+    detections.clear();
+    for (int i = 0; i < bins; i++) {
+        if (!busy[i]) {
+            continue;
+        }
+        int start = i;
+        int end = i;
+        for (int j = i + 1; j < bins && j - end <= MERGE_GAP + 1; j++) {
+            if (busy[j]) {
+                end = j;
+            }
+        }
+        i = end;
+
+        float peak = std::numeric_limits<float>::lowest();
+        float peak_floor = 0;
+        double weight = 0;
+        double moment = 0;
+        for (int j = start; j <= end; j++) {
+            float floor = busy_level[j] - threshold;
+            float above = std::max(0.f, average[j] - floor);
+            weight += above;
+            moment += above * (j + 0.5);
+            if (average[j] > peak) {
+                peak = average[j];
+                peak_floor = floor;
+            }
+        }
+        if (detections.size() == detections.capacity()) {
+            break;
+        }
+        double center = weight > 0 ? moment / weight : (start + end + 1) / 2.;
+        detections.push_back({0, start << level, (end + 1) << level,
+                              center * (1 << level), peak - peak_floor, now,
+                              now});
+    }
+}
+
+void SignalDetector::match_tracks(int64_t now) {
+    for (auto &t : tracks) {
+        t.matched = false;
+    }
+    // Both are sorted by l, so each detection only looks at the tracks
+    // from the first one that ends after it starts
+    size_t first = 0;
+    for (auto &detection : detections) {
+        while (first < tracks.size() &&
+               tracks[first].signal.r <= detection.l) {
+            first++;
+        }
+        auto overlaps = [&](const track &t) {
+            return t.signal.l < detection.r && t.signal.r > detection.l;
+        };
+        size_t k = first;
+        while (k < tracks.size() && tracks[k].signal.l < detection.r &&
+               (tracks[k].matched || tracks[k].merged ||
+                !overlaps(tracks[k]))) {
+            k++;
+        }
+        if (k == tracks.size() || !overlaps(tracks[k])) {
+            // New, added once all detections are matched
+            continue;
+        }
+        track &t = tracks[k];
+        // Channels that merged into one keep the oldest track, the others
+        // are removed below and no later detection may take them
+        for (size_t m = k + 1;
+             m < tracks.size() && tracks[m].signal.l < detection.r; m++) {
+            if (!tracks[m].matched && !tracks[m].merged &&
+                overlaps(tracks[m])) {
+                t.signal.first_seen =
+                    std::min(t.signal.first_seen, tracks[m].signal.first_seen);
+                tracks[m].merged = true;
+            }
+        }
+        detection.id = t.signal.id;
+        bool moved = t.signal.l != detection.l || t.signal.r != detection.r;
+        t.signal.l = detection.l;
+        t.signal.r = detection.r;
+        t.signal.center = detection.center;
+        t.signal.snr = detection.snr;
+        t.signal.last_seen = now;
+        t.matched = true;
+        if (!t.confirmed) {
+            if (++t.seen >= CONFIRM_ROWS) {
+                t.confirmed = true;
+                t.changed = true;
+            }
+        } else if (moved ||
+                   std::abs(t.signal.snr - t.reported_snr) >= SNR_REPORT_STEP) {
+            t.changed = true;
+        }
+    }
+
+    // Channels that have to be seen again in a row before they count are
+    // dropped at once, the others after the hold time or once merged
+    tracks.erase(std::remove_if(tracks.begin(), tracks.end(),
+                                [&](const track &t) {
+                                    if (t.matched) {
+                                        return false;
+                                    }
+                                    if (!t.confirmed) {
+                                        return true;
+                                    }
+                                    if (t.merged ||
+                                        now - t.signal.last_seen > hold_ms) {
+                                        removed.push_back(t.signal.id);
+                                        return true;
+                                    }
+                                    return false;
+                                }),
+                 tracks.end());
+
+    for (auto &detection : detections) {
+        if (detection.id || tracks.size() == max_signals) {
+            continue;
+        }
+        detection.id = next_id++;
+        tracks.push_back(
+            {detection, 1, false, false, true, false, detection.snr});
+    }
+    std::sort(tracks.begin(), tracks.end(),
+              [](const track &a, const track &b) {
+                  return a.signal.l < b.signal.l;
+              });
+}
+
+bool SignalDetector::get_changes(std::vector<detected_signal> &changed,
+                                 std::vector<uint32_t> &removed) {
+    std::scoped_lock lk(mtx);
+    for (auto &t : tracks) {
+        if (t.confirmed && t.changed) {
+            changed.push_back(t.signal);
+            t.reported_snr = t.signal.snr;
+            t.changed = false;
+        }
+    }
+    removed.insert(removed.end(), this->removed.begin(), this->removed.end());
+    this->removed.clear();
+    return !changed.empty() || !removed.empty();
+}
+
+void SignalDetector::get_signals(std::vector<detected_signal> &signals) {
+    std::scoped_lock lk(mtx);
+    for (auto &t : tracks) {
+        if (t.confirmed) {
+            signals.push_back(t.signal);
+        }
+    }
+}
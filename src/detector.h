@@ -0,0 +1,97 @@
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Finds the occupied channels of one waterfall level and follows them over
+// time, so clients can jump to activity without scanning the waterfall
+// Each update is O(bins), the per bin average and threshold have an AVX2
+// path, and nothing is allocated after construction
+
+// Bins are those of level 0
+struct detected_signal {
+    uint32_t id;
+    int l;
+    int r;
+    // Weighted by the power above the noise floor
+    double center;
+    // Peak above the noise floor, in dB
+    float snr;
+    // Milliseconds since the epoch
+    int64_t first_seen;
+    int64_t last_seen;
+};
+
+class SignalDetector {
+  public:
+    // Searches a level of a pyramid whose level 0 is size wide, updated
+    // rows_per_second times a second. Signals need threshold dB over the
+    // noise floor and are dropped hold_seconds after they were last seen
+    SignalDetector(int level, int size, double rows_per_second,
+                   int threshold, double hold_seconds, size_t max_signals);
+    SignalDetector(const SignalDetector &) = delete;
+    SignalDetector &operator=(const SignalDetector &) = delete;
+
+    int get_level() const { return level; }
+    // Skipped rather than waited for if the signals are being read
+    // Called from the FFT thread only
+    void update(const int8_t *pyramid, uint32_t pyramid_mask);
+    // Signals that appeared or changed and the ids of those that went away
+    // since the last call, returns false if there are none
+    bool get_changes(std::vector<detected_signal> &changed,
+                     std::vector<uint32_t> &removed);
+    void get_signals(std::vector<detected_signal> &signals);
+
+  protected:
+    struct track {
+        detected_signal signal;
+        // Consecutive rows it was seen in, until confirmed
+        int seen;
+        bool confirmed;
+        bool changed;
+        bool matched;
+        // Taken over by an overlapping track this row
+        bool merged;
+        // SNR last sent, small changes are not sent
+        float reported_snr;
+    };
+
+    void estimate_noise_floor();
+    void find_channels(int64_t now);
+    void match_tracks(int64_t now);
+
+    int level;
+    int bins;
+    // Of the level in the pyramid
+    size_t offset;
+    int threshold;
+    int64_t hold_ms;
+    size_t max_signals;
+    // Of the running average
+    float alpha;
+    // AVX2 or generic, picked once
+    void (*average_row)(const int8_t *, float *, size_t, float);
+    void (*mark_busy)(const float *, const float *, uint8_t *, size_t);
+
+    // Running average of the level, in dB
+    std::vector<float> average;
+    // Noise floor per segment and the busy threshold per bin
+    std::vector<float> segment_floor;
+    std::vector<float> busy_level;
+    std::vector<uint8_t> busy;
+    std::vector<uint32_t> segment_histogram;
+    // Channels found in the current row
+    std::vector<detected_signal> detections;
+    uint64_t frames;
+
+    // Guards the tracks and removed
+    std::mutex mtx;
+    // Sorted by l
+    std::vector<track> tracks;
+    std::vector<uint32_t> removed;
+    uint32_t next_id;
+};
+
+#endif
@@ -3,10 +3,28 @@
 #include "glaze/glaze.hpp"
 
 /* clang-format off */
+template <>
+struct glz::meta<detected_signal>
+{
+    using T = detected_signal;
+    static constexpr auto value = object(
+        "id", &T::id,
+        "l", &T::l,
+        "r", &T::r,
+        "center", &T::center,
+        "snr", &T::snr,
+        "first_seen", &T::first_seen,
+        "last_seen", &T::last_seen
+    );
+};
+
 struct event_info {
     size_t waterfall_clients;
     size_t signal_clients;
     std::unordered_map<std::string, std::tuple<int, double, int>> signal_changes;
+    // Active signals that appeared or changed and the ids of those gone
+    std::vector<detected_signal> signals;
+    std::vector<uint32_t> signals_removed;
 };
 
 template <> 
@@ -16,16 +34,21 @@ struct glz::meta<event_info>
     static constexpr auto value = object(
         "waterfall_clients", &T::waterfall_clients,
         "signal_clients", &T::signal_clients,
-        "signal_changes", &T::signal_changes
+        "signal_changes", &T::signal_changes,
+        "signals", &T::signals,
+        "signals_removed", &T::signals_removed
     );
 };
 /* clang-format on */
 
 std::string broadcast_server::get_event_info() {
-    if (!signal_changes.size()) {
+    event_info info;
+    bool signals_changed =
+        signal_detector &&
+        signal_detector->get_changes(info.signals, info.signals_removed);
+    if (!signal_changes.size() && !signals_changed) {
         return "";
     }
-    event_info info;
     // Put in the number of clients connected
     info.waterfall_clients = std::accumulate(
         waterfall_slices.begin(), waterfall_slices.end(), 0,
@@ -55,6 +78,9 @@ std::string broadcast_server::get_initial_state_info() {
                                             data->l, data->audio_mid, data->r});
         }
     }
+    if (signal_detector) {
+        signal_detector->get_signals(info.signals);
+    }
     return glz::write_json(info);
 }
 void broadcast_server::broadcast_signal_changes(const std::string &unique_id,
@@ -105,6 +131,15 @@ void broadcast_server::on_timer(websocketpp::lib::error_code const &ec) {
             }
         }
     }
+    // Snapshot the statistics now and then so a restart keeps them
+    if (spectrum_statistics && !statistics_file.empty() &&
+        ++statistics_save_timer >= statistics_save_interval) {
+        statistics_save_timer = 0;
+        if (!spectrum_statistics->save(statistics_file)) {
+            std::cout << "Cannot save the statistics to " << statistics_file
+                      << std::endl;
+        }
+    }
     // Send info every second
     if (running) {
         set_event_timer();
@@ -1,109 +1,313 @@
 #include "fft.h"
+#include "ringbuffer.h"
 #include "spectrumserver.h"
 #include "utils.h"
+#include "utils/threadpool.h"
+#include "wisdom.h"
 
+#include <bit>
+#include <filesystem>
 #include <numeric>
 
 #include <fftw3.h>
 
+std::unique_ptr<FFT> broadcast_server::make_fftw_engine() {
+    if (polyphase_taps > 1) {
+        return std::make_unique<PolyphaseFFTW>(
+            fft_size, fft_threads, downsample_levels, brightness_offset,
+            fft_window_type, polyphase_taps);
+    }
+    return std::make_unique<FFTW>(fft_size, fft_threads, downsample_levels,
+                                  brightness_offset, fft_window_type);
+}
+
 // Main FFT loop to process input samples
 void broadcast_server::fft_task() {
 
-    // This is the buffer where it converts to a float
+    // Consecutive frames go round robin to independent engines, each with its
+    // own plan and buffers, and are handed to the clients in order
+    std::vector<std::unique_ptr<FFT>> engines;
+    engines.push_back(std::move(this->fft));
+    for (int i = 1; i < fft_engines; i++) {
+        engines.push_back(make_fftw_engine());
+        engines.back()->set_output_additional_size(audio_max_fft_size);
+        engines.back()->set_hop(fft_hop);
+    }
+    size_t num_engines = engines.size();
+    // Released once the engine has finished its frame
+    std::deque<CountdownLatch> engine_done(num_engines);
+    // Set when the engine's last frame failed, the frame is not published
+    std::vector<uint8_t> engine_failed(num_engines, 0);
 
-    std::unique_ptr<FFT> fft = std::move(this->fft);
+    // Preallocated blocks of raw samples, one hop each, filled by the reader
+    // thread. Twice as many values if it is complex
+    int input_buffer_size = fft_hop * (2 - is_real);
+    size_t input_buffer_bytes = reader->sample_size() * input_buffer_size;
+    SampleRingBuffer input_ring(
+        ring_slots,
+        [&]() -> void * {
+            return new (std::align_val_t(64)) uint8_t[input_buffer_bytes];
+        },
+        [](void *buf) { operator delete[](buf, std::align_val_t(64)); });
 
-    // Twice as many floats if it is complex
-    float *input_buffers[3];
-    int input_buffer_size = fft_size / 2 * (2 - is_real);
-    int input_buffer_idx = 0;
-    input_buffers[0] = fft->malloc(input_buffer_size);
-    input_buffers[1] = fft->malloc(input_buffer_size);
-    input_buffers[2] = fft->malloc(input_buffer_size);
+    // Each output frame is handed to the clients while the next is computed
+    // Engine e computes the frames whose index is e modulo the engine count
+    int num_frames = 0;
+    for (auto &engine : engines) {
+        num_frames = engine->set_output_frames(fft_frames / num_engines) *
+                     num_engines;
+    }
+    std::cout << "Keeping " << num_frames << " FFT output frames in flight";
+    if (num_engines > 1) {
+        std::cout << " across " << num_engines << " FFT engines";
+    }
+    std::cout << std::endl;
 
     // FFT planning
-    if (is_real) {
-        fft->plan_r2c(FFTW_MEASURE | FFTW_DESTROY_INPUT);
-    } else {
-        fft->plan_c2c(FFT::FORWARD, FFTW_MEASURE | FFTW_DESTROY_INPUT);
+    for (auto &engine : engines) {
+        if (is_real) {
+            engine->plan_r2c(FFTW_MEASURE | FFTW_DESTROY_INPUT);
+        } else {
+            engine->plan_c2c(FFT::FORWARD, FFTW_MEASURE | FFTW_DESTROY_INPUT);
+        }
     }
-    fft_buffer = reinterpret_cast<std::complex<float>*>(fft->get_output_buffer());
 
-    // Target fps is 10, *2 since 50% overlap
-    int skip_num = std::max(1, (int)floor(((float)sps / fft_size) / 10.) * 2);
+    if (fast_fft) {
+        fast_fft->set_output_frames(fast_output_frames.size());
+        if (is_real) {
+            fast_fft->plan_r2c(FFTW_MEASURE | FFTW_DESTROY_INPUT);
+        } else {
+            fast_fft->plan_c2c(FFT::FORWARD,
+                               FFTW_MEASURE | FFTW_DESTROY_INPUT);
+        }
+    }
+
+    int skip_num = waterfall_skip;
     std::cout << "Waterfall is sent every " << skip_num << " FFTs" << std::endl;
 
     MovingAverage<double> sps_measured(60);
     auto prev_data = std::chrono::steady_clock::now();
 
-    auto signal_loop_fn = std::bind(&broadcast_server::signal_loop, this);
-    auto waterfall_loop_fn = std::bind(&broadcast_server::waterfall_loop, this,
-                                       fft->get_quantized_buffer());
+    // Long lived reader thread, avoids spawning a thread for every block
+    std::thread reader_thread([&] {
+        while (running) {
+            void *buf = input_ring.acquire_write();
+            if (!buf) {
+                break;
+            }
+            reader->read_raw(buf, input_buffer_size);
+            input_ring.commit_write();
+        }
+        input_ring.close();
+    });
+
+    uint64_t reported_stalls = 0;
+    uint32_t reported_levels = (1u << downsample_levels) - 1;
+    auto prev_report = std::chrono::steady_clock::now();
 
-    std::future<void> buffer_read = std::async(std::launch::async, [] {});
-    std::vector<std::future<void>> signal_futures;
-    std::vector<std::future<void>> waterfall_futures;
+    // The fast tier reads the same input block on the DSP pool, the block
+    // stays in the ring until it is done
+    CountdownLatch fast_done;
+    bool fast_holding = false;
+
+    // Frames still being computed, oldest first
+    std::deque<FFTFrame *> in_flight;
+    size_t next_engine = 0;
+    // The archive, statistics and detector follow the band whether anyone
+    // is connected or not
+    bool always_run = waterfall_archive || spectrum_statistics ||
+                      signal_detector;
+    // Levels they read whether anyone is on them or not
+    uint32_t always_levels = 0;
+    auto level_range = [](int first_level, int levels) {
+        return ((1u << levels) - 1) << first_level;
+    };
+    // The history only while a client reads it
+    uint32_t history_levels = 0;
+    if (waterfall_history) {
+        history_levels = level_range(waterfall_history->get_first_level(),
+                                     waterfall_history->get_levels());
+    }
+    if (waterfall_archive) {
+        always_levels |= level_range(waterfall_archive->get_first_level(),
+                                     waterfall_archive->get_levels());
+    }
+    if (spectrum_statistics) {
+        always_levels |= level_range(spectrum_statistics->get_level(), 1);
+    }
+    if (signal_detector) {
+        always_levels |= level_range(signal_detector->get_level(), 1);
+    }
+    auto publish = [&]() {
+        FFTFrame &frame = *in_flight.front();
+        in_flight.pop_front();
+        engine_done[frame.frame_num % num_engines].wait();
+        if (engine_failed[frame.frame_num % num_engines]) {
+            return;
+        }
+        // Enqueue tasks once the fft is ready
+        signal_loop(frame);
+        zoom_loop(frame);
+        if (frame.waterfall) {
+            waterfall_loop(frame, 0, fft_result_size);
+            if (waterfall_archive) {
+                waterfall_archive->push(frame.frame_num,
+                                        frame.fft_power_quantized,
+                                        frame.pyramid_mask);
+            }
+            if (spectrum_statistics) {
+                spectrum_statistics->update(frame.fft_power_quantized,
+                                            frame.pyramid_mask);
+            }
+            if (signal_detector) {
+                signal_detector->update(frame.fft_power_quantized,
+                                        frame.pyramid_mask);
+            }
+        }
+    };
 
     while (running) {
-        // Read, convert and scale the input
-        // 50% overlap is hardcoded for favourable downconverter properties
-        buffer_read.wait();
-        float *buf0 = input_buffers[input_buffer_idx];
-        float *buf1 = input_buffers[(input_buffer_idx + 1) % 3];
-        float *buf2 = input_buffers[(input_buffer_idx + 2) % 3];
-        if (is_real) {
-            // Read into buf2 asynchronously
-            buffer_read = std::async(std::launch::async,
-                                     [buf2, fft_size = fft_size, this] {
-                                         reader->read(buf2, fft_size / 2);
-                                     });
+        // Hand out the frames that finished while waiting for the input
+        while (!in_flight.empty() &&
+               engine_done[in_flight.front()->frame_num % num_engines]
+                   .ready()) {
+            publish();
+        }
 
-            fft->load_real_input(buf0, buf1);
+        // The overlap is kept converted by the FFT, so each frame only
+        // converts and windows the newest block straight into the input
+        if (!input_ring.wait_readable(fast_holding ? 2 : 1)) {
+            break;
+        }
+        FFT &engine = *engines[next_engine];
+        void *raw = input_ring.read_slot(fast_holding ? 1 : 0);
+        engine.load_raw_input(*reader, raw);
+        if (fast_holding) {
+            fast_done.wait();
+            input_ring.release_read();
+            fast_holding = false;
+        }
+        if (fast_fft &&
+            waterfall_levels_needed(downsample_levels + 1, fast_levels)) {
+            fast_done.add(1);
+            dsp_pool()->post([this, raw, &fast_done]() {
+                try {
+                    fast_fft_task(raw);
+                } catch (const std::exception &e) {
+                    std::cout << "Fast FFT failed: " << e.what() << std::endl;
+                } catch (...) {
+                    std::cout << "Fast FFT failed" << std::endl;
+                }
+                fast_done.count_down();
+            });
+            fast_holding = true;
         } else {
-            // IQ data has twice as many floats
-            buffer_read = std::async(std::launch::async,
-                                     [buf2, fft_size = fft_size, this] {
-                                         reader->read(buf2, fft_size);
-                                     });
-            fft->load_complex_input(buf0, buf1);
-        }
-
-        input_buffer_idx = (input_buffer_idx + 1) % 3;
-        // If no users skip the FFT
-        if (signal_slices.size() + std::accumulate(waterfall_slices.begin(),
-                                                   waterfall_slices.end(), 0,
-                                                   [](int val, auto &l) {
+            input_ring.release_read();
+        }
+
+        // Report when the reader had to wait for the FFT to catch up
+        auto now = std::chrono::steady_clock::now();
+        if (now - prev_report > std::chrono::seconds(10)) {
+            uint64_t stalls = input_ring.producer_stalls();
+            if (stalls != reported_stalls) {
+                std::cout << "Input ring: " << input_ring.occupancy() << "/"
+                          << input_ring.capacity() << " slots filled, peak "
+                          << input_ring.peak_occupancy() << ", "
+                          << stalls - reported_stalls << " reader stalls"
+                          << std::endl;
+                reported_stalls = stalls;
+            }
+            prev_report = now;
+        }
+
+        // If no users skip the FFT, the fast tier has its own
+        if (!always_run &&
+            signal_slices.size() + std::accumulate(waterfall_slices.begin(),
+                                                   waterfall_slices.begin() +
+                                                       downsample_levels + 1,
+                                                   0, [](int val, auto &l) {
                                                        return val + l.size();
                                                    }) ==
             0) {
             continue;
         }
 
-        // Wait for all the signal and waterfall clients to finish
-        for (auto &f : signal_futures) {
-            f.wait();
+        // Only waits when clients are still reading every frame in the ring
+        FFTFrame &frame = output_frames[frame_num % num_frames];
+        frame.done.wait();
+
+        // Only build the waterfall levels that will actually be read
+        bool waterfall_frame = frame_num % skip_num == 0;
+        uint32_t levels = 0;
+        if (waterfall_frame) {
+            levels = always_levels |
+                     waterfall_levels_needed(0, downsample_levels);
+            if (waterfall_history && waterfall_history->has_subscribers()) {
+                levels |= history_levels;
+            }
         }
-        for (auto &f : waterfall_futures) {
-            f.wait();
+        engine.set_pyramid_mask(levels);
+        engine.select_output_frame((frame_num % num_frames) / num_engines);
+        frame.frame_num = frame_num;
+        frame.waterfall = waterfall_frame;
+        frame.fft_buffer = reinterpret_cast<std::complex<float> *>(
+            engine.get_output_buffer());
+        frame.fft_power_quantized = engine.get_quantized_buffer();
+        frame.pyramid_mask = engine.get_pyramid_mask();
+        if (waterfall_frame && frame.pyramid_mask != reported_levels) {
+            std::cout << "Building " << std::popcount(frame.pyramid_mask)
+                      << " of " << downsample_levels << " waterfall levels"
+                      << std::endl;
+            reported_levels = frame.pyramid_mask;
         }
 
-        fft->execute();
-        if (!is_real) {
-
-            // If the user requested a range near the 0 frequency,
-            // the data will wrap around, copy the front to the back to make
-            // it contiguous
-            memcpy(&fft_buffer[fft_result_size], &fft_buffer[0],
-                   sizeof(fftwf_complex) * audio_max_fft_size);
+        auto compute = [this, &engine, &frame]() {
+            engine.execute();
+            if (!is_real) {
+                // If the user requested a range near the 0 frequency,
+                // the data will wrap around, copy the front to the back to
+                // make it contiguous
+                memcpy(&frame.fft_buffer[fft_result_size],
+                       &frame.fft_buffer[0],
+                       sizeof(fftwf_complex) * audio_max_fft_size);
+            }
+        };
+        CountdownLatch &done = engine_done[next_engine];
+        uint8_t &failed = engine_failed[next_engine];
+        failed = 0;
+        done.add(1);
+        if (num_engines == 1) {
+            compute();
+            done.count_down();
+        } else {
+            // Ahead of the demodulation and the waterfall of the earlier
+            // frames, everything after this frame waits on it
+            dsp_pool()->post_front([compute, &done, &failed]() {
+                try {
+                    compute();
+                } catch (const std::exception &e) {
+                    std::cout << "FFT failed: " << e.what() << std::endl;
+                    failed = 1;
+                } catch (...) {
+                    std::cout << "FFT failed" << std::endl;
+                    failed = 1;
+                }
+                done.count_down();
+            });
         }
+        in_flight.push_back(&frame);
 
-        // Enqueue tasks once the fft is ready
-        signal_futures = signal_loop_fn();
-        if (frame_num % skip_num == 0) {
-            waterfall_futures = waterfall_loop_fn();
-        }
+        // The next engine continues the overlap from this frame's input
+        size_t following = (next_engine + 1) % num_engines;
+        engine.swap_input_cache(*engines[following]);
+        next_engine = following;
         frame_num++;
 
+        // The next engine can only be loaded once its last frame is out
+        while (in_flight.size() >= num_engines) {
+            publish();
+        }
+
         /*auto cur_data = std::chrono::steady_clock::now();
         std::chrono::duration<double> diff_time = cur_data - prev_data;
         sps_measured.insert(diff_time.count());
@@ -113,7 +317,163 @@ void broadcast_server::fft_task() {
             // sps_measured.getAverage()<<std::endl;
         }*/
     }
-    fft->free(input_buffers[0]);
-    fft->free(input_buffers[1]);
-    fft->free(input_buffers[2]);
+    fast_done.wait();
+    input_ring.close();
+    reader_thread.join();
+    // The engines must be idle before they are destroyed
+    for (auto &done : engine_done) {
+        done.wait();
+    }
+}
+
+void broadcast_server::fast_fft_task(const void *raw) {
+    // Each input block holds several fast hops
+    size_t hop_bytes = reader->sample_size() * fast_hop * (2 - is_real);
+    uint32_t levels =
+        waterfall_levels_needed(downsample_levels + 1, fast_levels);
+    for (int i = 0; i < fft_hop / fast_hop; i++) {
+        fast_fft->load_raw_input(*reader,
+                                 (const uint8_t *)raw + hop_bytes * i);
+        size_t num = fast_frame_num++;
+        if (num % fast_skip != 0) {
+            continue;
+        }
+        // Clients still sending this frame, drop the row rather than block a
+        // DSP thread on them. Only every fast_skip-th hop is a row, so the
+        // rows and not the hops go round the ring
+        size_t idx = (num / fast_skip) % fast_output_frames.size();
+        FFTFrame &frame = fast_output_frames[idx];
+        if (!frame.done.ready()) {
+            continue;
+        }
+        fast_fft->set_pyramid_mask(levels);
+        fast_fft->select_output_frame(idx);
+        fast_fft->execute();
+        frame.frame_num = num;
+        frame.waterfall = true;
+        frame.fft_buffer = reinterpret_cast<std::complex<float> *>(
+            fast_fft->get_output_buffer());
+        frame.fft_power_quantized = fast_fft->get_quantized_buffer();
+        frame.pyramid_mask = fast_fft->get_pyramid_mask();
+        waterfall_loop(frame, downsample_levels + 1, fast_result_size);
+    }
+}
+
+void broadcast_server::tune_fft(unsigned flags) {
+    if (dynamic_cast<FFTW *>(fft.get())) {
+        std::cout << "Tuning " << (is_real ? "real" : "complex")
+                  << " FFT of size " << fft_size << " with " << fft_threads
+                  << " threads" << std::endl;
+        if (is_real) {
+            fft->plan_r2c(flags | FFTW_DESTROY_INPUT);
+        } else {
+            fft->plan_c2c(FFT::FORWARD, flags | FFTW_DESTROY_INPUT);
+        }
+    } else {
+        std::cout << "Accelerator does not use FFTW, skipping the main FFT"
+                  << std::endl;
+    }
+
+    if (fast_fft) {
+        std::cout << "Tuning fast FFT of size " << fast_fft_size << std::endl;
+        if (is_real) {
+            fast_fft->plan_r2c(flags | FFTW_DESTROY_INPUT);
+        } else {
+            fast_fft->plan_c2c(FFT::FORWARD, flags | FFTW_DESTROY_INPUT);
+        }
+    }
+
+    std::scoped_lock lk(fftwf_planner_mutex);
+    // Batched the same way as the plan cache prepares them
+    std::cout << "Tuning audio IFFTs of size " << audio_max_fft_size
+              << " in batches of up to " << audio_batch << std::endl;
+    for (int howmany = 1; howmany <= audio_batch; howmany *= 2) {
+        fftw_wisdom_tune(PLAN_C2C_BACKWARD, audio_max_fft_size, howmany, flags);
+        fftw_wisdom_tune(PLAN_C2R, audio_max_fft_size, howmany, flags);
+    }
+
+    // Zoomed waterfall views turn bins of the main FFT back into a baseband
+    // and run a zoom times longer FFT over it
+    if (zoom_config.max_zoom > 1) {
+        std::cout << "Tuning waterfall zoom FFTs up to " << zoom_config.max_zoom
+                  << " times" << std::endl;
+        WaterfallZoom::for_each_plan(
+            zoom_config, min_waterfall_fft,
+            [flags](fftw_plan_kind kind, int size) {
+                fftw_wisdom_tune(kind, size, 1, flags);
+            });
+    }
+    std::cout << "Wisdom stored in "
+              << std::filesystem::path(
+                     fftw_wisdom_filename(PLAN_C2R, audio_max_fft_size, 1))
+                     .parent_path()
+                     .string()
+              << std::endl;
+}
+
+void broadcast_server::train_waterfall_dictionary(const std::string &filename) {
+    // Trained on what the clients are sent, delta coded rows of every level
+    // cut into waterfall_size wide views, about 100 times the dictionary
+    size_t dictionary_size = 65536;
+    size_t samples_wanted = dictionary_size * 100;
+
+    fft->set_output_frames(1);
+    if (is_real) {
+        fft->plan_r2c(FFTW_MEASURE | FFTW_DESTROY_INPUT);
+    } else {
+        fft->plan_c2c(FFT::FORWARD, FFTW_MEASURE | FFTW_DESTROY_INPUT);
+    }
+    fft->select_output_frame(0);
+
+    int input_buffer_size = fft_hop * (2 - is_real);
+    std::unique_ptr<uint8_t[]> raw(
+        new uint8_t[reader->sample_size() * input_buffer_size]);
+    int skip_num = waterfall_skip;
+    int pyramid_size = 0;
+    for (int i = 0; i < downsample_levels; i++) {
+        pyramid_size += fft_result_size >> i;
+    }
+
+    std::vector<int8_t> previous(pyramid_size);
+    std::vector<uint8_t> samples;
+    std::vector<size_t> sample_sizes;
+    samples.reserve(samples_wanted + min_waterfall_fft);
+    std::cout << "Collecting " << samples_wanted / 1024
+              << " KiB of waterfall rows" << std::endl;
+    for (size_t frame = 0; samples.size() < samples_wanted; frame++) {
+        if (reader->read_raw(raw.get(), input_buffer_size) <
+            input_buffer_size) {
+            std::cout << "Input ended early" << std::endl;
+            break;
+        }
+        fft->load_raw_input(*reader, raw.get());
+        if (frame % skip_num) {
+            continue;
+        }
+        fft->set_pyramid_mask((1u << downsample_levels) - 1);
+        fft->execute();
+        const int8_t *rows = fft->get_quantized_buffer();
+        // One view per level, moving across the level from row to row
+        if (frame) {
+            size_t row = frame / skip_num;
+            int offset = 0;
+            for (int i = 0; i < downsample_levels; i++) {
+                int views = (fft_result_size >> i) / min_waterfall_fft;
+                int start = offset + row % views * min_waterfall_fft;
+                size_t pos = samples.size();
+                samples.resize(pos + min_waterfall_fft);
+                waterfall_delta_encode((int8_t *)&samples[pos], rows + start,
+                                       &previous[start], min_waterfall_fft);
+                sample_sizes.push_back(min_waterfall_fft);
+                offset += fft_result_size >> i;
+            }
+        }
+        std::copy(rows, rows + pyramid_size, previous.begin());
+    }
+
+    if (WaterfallDictionary::train(filename, samples, sample_sizes,
+                                   dictionary_size)) {
+        std::cout << "Waterfall dictionary stored in " << filename
+                  << std::endl;
+    }
 }
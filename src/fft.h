@@ -3,6 +3,7 @@
 
 #include <functional>
 #include <mutex>
+#include <vector>
 
 #ifdef CUFFT
 #include <cufft.h>
@@ -23,6 +24,8 @@
 // Global lock for FFTW planner
 extern std::mutex fftwf_planner_mutex;
 
+class SampleConverterBase;
+
 enum fft_accelerator {
     CPU_FFTW,
     GPU_cuFFT,
@@ -30,26 +33,67 @@ enum fft_accelerator {
     CPU_mklFFT,
 };
 
+enum fft_window {
+    WINDOW_HANN,
+    WINDOW_BLACKMAN_HARRIS,
+};
+
+// Fills arr with num points of the window
+void build_fft_window(float *arr, int num, fft_window window);
+// Fills arr with the size * taps point lowpass of a polyphase filterbank with
+// size channels, a sinc one channel wide shaped by the window. Scaled to the
+// same sum as the plain window so the levels match
+void build_polyphase_prototype(float *arr, int size, int taps,
+                               fft_window window);
+
 class FFT {
   public:
     enum direction { FORWARD, BACKWARD };
-    FFT(size_t size, int nthreads, int downsample_levels, int brightness_offset);
+    FFT(size_t size, int nthreads, int downsample_levels, int brightness_offset,
+        fft_window window);
     virtual float *malloc(size_t size) = 0;
     virtual void free(float *buf) = 0;
     virtual int plan_c2c(direction d, int options) = 0;
     virtual int plan_r2c(int options) = 0;
     virtual void set_output_additional_size(size_t size);
     virtual void set_size(size_t size);
+    // New samples per frame, the rest of the frame overlaps the previous one
+    // Defaults to half of the FFT size
+    void set_hop(size_t hop);
     virtual float *get_input_buffer();
     virtual float *get_output_buffer();
     virtual int8_t *get_quantized_buffer();
+    // Requests num output frames so clients can keep reading older frames
+    // while the next one is computed, called before planning
+    // Returns the number of frames the backend actually allocates
+    virtual int set_output_frames(int num);
+    // Makes the frame the target of the next execute and the get_*_buffer
+    virtual void select_output_frame(int frame);
+    // Waterfall levels the next execute should build, bit k for level k, 0
+    // skips the power and quantization entirely. Backends may build more
+    // than requested
+    virtual void set_pyramid_mask(uint32_t mask);
+    // Waterfall levels the last execute actually built
+    virtual uint32_t get_pyramid_mask();
     virtual int load_real_input(float *a1, float *a2) = 0;
     virtual int load_complex_input(float *a1, float *a2) = 0;
+    // Converts the newest hop of raw samples and loads it after the
+    // overlapping part, which is kept converted from the last calls
+    virtual int load_raw_input(SampleConverterBase &converter, const void *raw);
+    // Blocks until the buffers handed to load_*_input may be reused, for
+    // backends that read them asynchronously
+    virtual void wait_input();
+    // Hands the converted overlap to another engine of the same kind
+    // so it can compute the next overlapped frame
+    virtual void swap_input_cache(FFT &other);
     virtual int execute() = 0;
     virtual ~FFT();
 
   protected:
+    void free_input_cache();
+
     size_t size;
+    size_t hop;
     int size_log2;
     int nthreads;
     int downsample_levels;
@@ -60,11 +104,16 @@ class FFT {
     float *outbuf;
     float *powerbuf;
     int8_t *quantizedbuf;
+    // Converted samples of the frame, the overlap is kept at the front
+    float *input_cache;
+    // Copies of both halves of the frame for load_*_input, from malloc
+    float *input_halves[2];
 };
 
 class noFFT : public FFT {
   public:
-    noFFT(size_t size, int nthreads) : FFT(size, nthreads, 1, 0) {}
+    noFFT(size_t size, int nthreads)
+        : FFT(size, nthreads, 1, 0, WINDOW_HANN) {}
     virtual float *malloc(size_t size) {
         return (float *)::malloc(sizeof(float) * size);
     }
@@ -92,24 +141,60 @@ class noFFT : public FFT {
 
 class FFTW : public FFT {
   public:
-    FFTW(size_t size, int nthreads, int downsample_levels, int brightness_offset);
+    FFTW(size_t size, int nthreads, int downsample_levels, int brightness_offset,
+         fft_window window);
     virtual float *malloc(size_t size);
     virtual void free(float *buf);
     virtual int plan_c2c(direction d, int options);
     virtual int plan_r2c(int options);
     virtual int load_real_input(float *a1, float *a2);
     virtual int load_complex_input(float *a1, float *a2);
+    virtual int load_raw_input(SampleConverterBase &converter, const void *raw);
+    virtual int set_output_frames(int num);
+    virtual void select_output_frame(int frame);
+    virtual void set_pyramid_mask(uint32_t mask);
+    virtual uint32_t get_pyramid_mask();
     virtual int execute();
     virtual ~FFTW();
 
   protected:
     fftwf_plan p;
+    int output_frames;
+    uint32_t pyramid_mask;
+    // Output and quantized buffers of each frame, outbuf and quantizedbuf
+    // point at the selected one
+    std::vector<float *> outbufs;
+    std::vector<int8_t *> quantizedbufs;
+};
+
+// Weighted overlap-add filterbank, each frame is taps * size samples weighted
+// by a long lowpass prototype and folded into size samples before the FFT
+// Much less leakage between bins than a plain window of the same size
+class PolyphaseFFTW : public FFTW {
+  public:
+    PolyphaseFFTW(size_t size, int nthreads, int downsample_levels,
+                  int brightness_offset, fft_window window, int taps);
+    virtual int plan_c2c(direction d, int options);
+    virtual int plan_r2c(int options);
+    virtual int load_raw_input(SampleConverterBase &converter, const void *raw);
+    virtual void swap_input_cache(FFT &other);
+    virtual ~PolyphaseFFTW();
+
+  protected:
+    void alloc_history();
+
+    int taps;
+    float *prototype;
+    // input_cache holds the converted history as a ring of taps * size
+    // samples, history_head is where the oldest sample of the frame is
+    size_t history_head;
 };
 
 #ifdef MKL
 class mklFFT : public FFT {
   public:
-    mklFFT(size_t size, int nthreads, int downsample_levels, int brightness_offset);
+    mklFFT(size_t size, int nthreads, int downsample_levels, int brightness_offset,
+           fft_window window);
     virtual float *malloc(size_t size);
     virtual void free(float *buf);
     virtual int plan_c2c(direction d, int options);
@@ -127,13 +212,15 @@ class mklFFT : public FFT {
 #ifdef CUFFT
 class cuFFT : public FFT {
   public:
-    cuFFT(size_t size, int nthreads, int downsample_levels, int brightness_offset);
+    cuFFT(size_t size, int nthreads, int downsample_levels, int brightness_offset,
+          fft_window window);
     virtual float *malloc(size_t size);
     virtual void free(float *buf);
     virtual int plan_c2c(direction d, int options);
     virtual int plan_r2c(int options);
     virtual int load_real_input(float *a1, float *a2);
     virtual int load_complex_input(float *a1, float *a2);
+    virtual void wait_input();
     virtual int execute();
     virtual ~cuFFT();
 
@@ -153,13 +240,15 @@ class cuFFT : public FFT {
 #ifdef CLFFT
 class clFFT : public FFT {
   public:
-    clFFT(size_t size, int nthreads, int downsample_levels, int brightness_offset);
+    clFFT(size_t size, int nthreads, int downsample_levels, int brightness_offset,
+          fft_window window);
     virtual float *malloc(size_t size);
     virtual void free(float *buf);
     virtual int plan_c2c(direction d, int options);
     virtual int plan_r2c(int options);
     virtual int load_real_input(float *a1, float *a2);
     virtual int load_complex_input(float *a1, float *a2);
+    virtual void wait_input();
     virtual int execute();
     virtual ~clFFT();
 
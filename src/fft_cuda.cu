@@ -3,8 +3,10 @@
 
 #include "fft.h"
 
-cuFFT::cuFFT(size_t size, int nthreads, int downsample_levels, int brightness_offset)
-    : FFT(size, nthreads, downsample_levels, brightness_offset), plan{0} {
+cuFFT::cuFFT(size_t size, int nthreads, int downsample_levels,
+             int brightness_offset, fft_window window)
+    : FFT(size, nthreads, downsample_levels, brightness_offset, window),
+      plan{0} {
     int count;
     cudaGetDeviceCount(&count);
     if (!count) {
@@ -98,6 +100,8 @@ int cuFFT::load_complex_input(float *a1, float *a2) {
     return 0;
 }
 
+void cuFFT::wait_input() { cudaDeviceSynchronize(); }
+
 __device__ inline int log_power(float power, int power_offset) {
     return max(-128, __float2int_rz(20 * log10f(power) +
                                     power_offset * 6.020599913279624 + 127));
@@ -176,6 +180,7 @@ int cuFFT::execute() {
     return 0;
 }
 cuFFT::~cuFFT() {
+    free_input_cache();
     if (plan) {
         cufftDestroy(plan);
         cudaFree(cuda_inbuf);
@@ -1,84 +1,125 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <mutex>
+#include <numeric>
 #include <stdexcept>
 
 #include "fft.h"
+#include "samplereader.h"
 #include "utils.h"
 #include "utils/dsp.h"
+#include "utils/pyramid.h"
+#include "wisdom.h"
 
 std::mutex fftwf_planner_mutex;
 
-// Compiler autovectorization
-static inline float vec_log2(float val, int power_offset) {
-    uint32_t *bit_exponent = (uint32_t *)&val;
-    float log_val =
-        (float)((int)((*bit_exponent >> 23) & 0xFF) - 128) + power_offset;
-    // Set exponent to 0
-    *bit_exponent &= ~(255 << 23);
-    *bit_exponent += 127 << 23;
-    log_val += ((-0.34484843f) * val + 2.02466578f) * val - 0.67487759f;
-    return log_val;
-}
-static inline void power_and_quantize(float *complexbuf, float *powerbuf,
-                                      int8_t *quantizedbuf, float normalize,
-                                      size_t outbuf_len, int power_offset) {
-/*complexbuf = (float *)__builtin_assume_aligned(complexbuf, 32);
-powerbuf = (float *)__builtin_assume_aligned(powerbuf, 32);
-quantizedbuf = (int8_t *)__builtin_assume_aligned(quantizedbuf, 32);
-// Get the compiler to auto-vectorize*
-outbuf_len -= outbuf_len & 15;*/
-#pragma omp parallel for simd
-    for (size_t i = 0; i < outbuf_len; i++) {
-        complexbuf[i * 2] /= normalize;
-        complexbuf[i * 2 + 1] /= normalize;
-        float re = complexbuf[i * 2];
-        float im = complexbuf[i * 2 + 1];
-        float power = re * re + im * im;
-        powerbuf[i] = power;
-        quantizedbuf[i] = std::max(
-            -128.f,
-            vec_log2(power, power_offset) * 0.3010299956639812f * 20.f + 127.f);
+void build_fft_window(float *arr, int num, fft_window window) {
+    if (window == WINDOW_BLACKMAN_HARRIS) {
+        build_blackman_harris_window(arr, num);
+    } else {
+        build_hann_window(arr, num);
     }
 }
-static inline void half_and_quantize(float *powerbuf, float *halfbuf,
-                                     int8_t *quantizedbuf, size_t outbuf_len,
-                                     int power_offset) {
-    powerbuf = (float *)__builtin_assume_aligned(powerbuf, 32);
-    halfbuf = (float *)__builtin_assume_aligned(halfbuf, 32);
-    quantizedbuf = (int8_t *)__builtin_assume_aligned(quantizedbuf, 32);
-// Get the compiler to auto-vectorize
-// outbuf_len -= outbuf_len & 15;
-#pragma omp parallel for simd
-    for (size_t i = 0; i < outbuf_len; i++) {
-        float power = powerbuf[i * 2] + powerbuf[i * 2 + 1];
-        halfbuf[i] = power;
-        quantizedbuf[i] = std::max(
-            -128.f,
-            vec_log2(power, power_offset) * 0.3010299956639812f * 20.f + 127.f);
+
+void build_polyphase_prototype(float *arr, int size, int taps,
+                               fft_window window) {
+    int len = size * taps;
+    build_fft_window(arr, len, window);
+    double sum = 0;
+    for (int i = 0; i < len; i++) {
+        double x = (double)(i - len / 2) / size;
+        arr[i] *= x == 0 ? 1. : sin(M_PI * x) / (M_PI * x);
+        sum += arr[i];
+    }
+    std::vector<float> plain(size);
+    build_fft_window(plain.data(), size, window);
+    double plain_sum = std::accumulate(plain.begin(), plain.end(), 0.);
+    for (int i = 0; i < len; i++) {
+        arr[i] *= plain_sum / sum;
     }
 }
 
 FFT::FFT(size_t size, int nthreads, int downsample_levels,
-         int brightness_offset)
-    : size{size}, nthreads{nthreads}, downsample_levels{downsample_levels},
-      inbuf{0}, outbuf{0} {
+         int brightness_offset, fft_window window)
+    : size{size}, hop{size / 2}, nthreads{nthreads},
+      downsample_levels{downsample_levels}, inbuf{0}, outbuf{0},
+      input_cache{0}, input_halves{0, 0} {
     windowbuf = new (std::align_val_t(32)) float[size];
     size_log2 = (int)round(log2(size)) + brightness_offset;
-    build_hann_window(windowbuf, size);
+    build_fft_window(windowbuf, size, window);
 }
 FFT::~FFT() { operator delete[](windowbuf, std::align_val_t(32)); }
 
 void FFT::set_size(size_t size) { this->size = size; }
 void FFT::set_output_additional_size(size_t size) { additional_size = size; }
+void FFT::set_hop(size_t hop) { this->hop = hop; }
 
 float *FFT::get_input_buffer() { return inbuf; }
 float *FFT::get_output_buffer() { return outbuf; }
 int8_t *FFT::get_quantized_buffer() { return quantizedbuf; }
 
-FFTW::FFTW(size_t size, int nthreads, int downsample_levels, int brightness_offset)
-    : FFT(size, nthreads, downsample_levels, brightness_offset), p{0} {}
+// Backends only keep a single output frame unless they support more
+int FFT::set_output_frames(int) { return 1; }
+void FFT::select_output_frame(int) {}
+// Backends build every level unless they support skipping them
+void FFT::set_pyramid_mask(uint32_t) {}
+uint32_t FFT::get_pyramid_mask() { return (1u << downsample_levels) - 1; }
+
+int FFT::load_raw_input(SampleConverterBase &converter, const void *raw) {
+    // Backends that window on the device are handed both halves of the
+    // converted frame, copied into buffers of their own malloc so the
+    // overlap can slide while the device reads them
+    bool is_complex = outbuf_len == size;
+    int frame_len = is_complex ? size * 2 : size;
+    int half_len = frame_len / 2;
+    int hop_len = is_complex ? hop * 2 : hop;
+    if (!input_cache) {
+        input_cache = this->malloc(frame_len);
+        std::fill(input_cache, input_cache + frame_len, 0.f);
+    }
+    for (auto &half : input_halves) {
+        if (!half) {
+            half = this->malloc(half_len);
+        }
+    }
+    converter.convert(input_cache + frame_len - hop_len, raw, hop_len);
+    // The device may still be reading the halves of the last frame
+    wait_input();
+    std::memcpy(input_halves[0], input_cache, sizeof(float) * half_len);
+    std::memcpy(input_halves[1], input_cache + half_len,
+                sizeof(float) * half_len);
+    int ret = is_complex
+                  ? load_complex_input(input_halves[0], input_halves[1])
+                  : load_real_input(input_halves[0], input_halves[1]);
+    // Slide the overlap to the front for the next frame
+    std::memmove(input_cache, input_cache + hop_len,
+                 sizeof(float) * (frame_len - hop_len));
+    return ret;
+}
+void FFT::wait_input() {}
+void FFT::swap_input_cache(FFT &other) {
+    std::swap(input_cache, other.input_cache);
+}
+void FFT::free_input_cache() {
+    if (input_cache) {
+        this->free(input_cache);
+        input_cache = 0;
+    }
+    for (auto &half : input_halves) {
+        if (half) {
+            this->free(half);
+            half = 0;
+        }
+    }
+}
+
+FFTW::FFTW(size_t size, int nthreads, int downsample_levels,
+           int brightness_offset, fft_window window)
+    : FFT(size, nthreads, downsample_levels, brightness_offset, window), p{0},
+      output_frames{1}, pyramid_mask{(1u << downsample_levels) - 1} {}
 
 float *FFTW::malloc(size_t size) {
     return (float *)fftwf_malloc(sizeof(float) * size);
@@ -90,44 +131,47 @@ int FFTW::plan_c2c(direction d, int options) {
     assert(!p);
 
     inbuf = this->malloc(size * 2);
-    outbuf = this->malloc(size * 2 + additional_size * 2);
+    for (int i = 0; i < output_frames; i++) {
+        outbufs.push_back(this->malloc(size * 2 + additional_size * 2));
+        quantizedbufs.push_back(new (std::align_val_t(32)) int8_t[size * 2]);
+    }
+    select_output_frame(0);
     outbuf_len = size;
     powerbuf = new (std::align_val_t(32)) float[size * 2];
-    quantizedbuf = new (std::align_val_t(32)) int8_t[size * 2];
+    input_cache = this->malloc(size * 2);
+    std::fill(input_cache, input_cache + size * 2, 0.f);
 
+    fftw_plan_kind kind = d == FORWARD ? PLAN_C2C_FORWARD : PLAN_C2C_BACKWARD;
     std::scoped_lock lk(fftwf_planner_mutex);
+    fftw_wisdom_import(kind, size, nthreads);
     fftwf_plan_with_nthreads(nthreads);
     p = fftwf_plan_dft_1d(size, (fftwf_complex *)inbuf, (fftwf_complex *)outbuf,
                           d == FORWARD ? FFTW_FORWARD : FFTW_BACKWARD, options);
+    fftw_wisdom_export(kind, size, nthreads);
     return 0;
 }
 int FFTW::plan_r2c(int options) {
     assert(!p);
 
     inbuf = this->malloc(size);
-    outbuf = this->malloc(size + 2);
+    for (int i = 0; i < output_frames; i++) {
+        outbufs.push_back(this->malloc(size + 2));
+        quantizedbufs.push_back(new (std::align_val_t(32)) int8_t[size]);
+    }
+    select_output_frame(0);
     outbuf_len = size / 2;
     powerbuf = new (std::align_val_t(32)) float[size];
-    quantizedbuf = new (std::align_val_t(32)) int8_t[size];
+    input_cache = this->malloc(size);
+    std::fill(input_cache, input_cache + size, 0.f);
 
     std::scoped_lock lk(fftwf_planner_mutex);
+    fftw_wisdom_import(PLAN_R2C, size, nthreads);
     fftwf_plan_with_nthreads(nthreads);
     p = fftwf_plan_dft_r2c_1d(size, inbuf, (fftwf_complex *)outbuf, options);
+    fftw_wisdom_export(PLAN_R2C, size, nthreads);
     return 0;
 }
 
-void dsp_multiply_float(float *arr1, float *arr2, float *arr3, size_t len) {
-    for (size_t i = 0; i < len; i++) {
-        arr1[i] = arr2[i] * arr3[i];
-    }
-}
-void dsp_multiply_complex(std::complex<float> *arr1, std::complex<float> *arr2,
-                          float *arr3, size_t len) {
-    for (size_t i = 0; i < len; i++) {
-        arr1[i] = arr2[i] * arr3[i];
-    }
-}
-
 int FFTW::load_real_input(float *a1, float *a2) {
     dsp_multiply_float(inbuf, a1, windowbuf, size / 2);
     dsp_multiply_float(&inbuf[size / 2], a2, &windowbuf[size / 2], size / 2);
@@ -141,8 +185,47 @@ int FFTW::load_complex_input(float *a1, float *a2) {
                          size / 2);
     return 0;
 }
+int FFTW::load_raw_input(SampleConverterBase &converter, const void *raw) {
+    bool is_complex = outbuf_len == size;
+    int values = is_complex ? 2 : 1;
+    size_t overlap = size - hop;
+    // The overlap was converted in earlier frames, it only needs the window
+    if (is_complex) {
+        dsp_multiply_complex((std::complex<float> *)inbuf,
+                             (std::complex<float> *)input_cache, windowbuf,
+                             overlap);
+    } else {
+        dsp_multiply_float(inbuf, input_cache, windowbuf, overlap);
+    }
+    // Convert and window the new samples in one pass, keeping them for the
+    // next frames
+    converter.convert_window(&inbuf[overlap * values],
+                             &input_cache[overlap * values], raw,
+                             &windowbuf[overlap], hop * values, is_complex);
+    std::memmove(input_cache, input_cache + hop * values,
+                 sizeof(float) * overlap * values);
+    return 0;
+}
+int FFTW::set_output_frames(int num) {
+    assert(!p);
+    output_frames = std::max(1, num);
+    return output_frames;
+}
+void FFTW::select_output_frame(int frame) {
+    outbuf = outbufs[frame];
+    quantizedbuf = quantizedbufs[frame];
+}
+void FFTW::set_pyramid_mask(uint32_t mask) {
+    pyramid_mask = mask & ((1u << downsample_levels) - 1);
+}
+uint32_t FFTW::get_pyramid_mask() { return pyramid_mask; }
 int FFTW::execute() {
-    fftwf_execute(p);
+    // The plan was made for the first frame, the others share its alignment
+    if (outbuf_len == size) {
+        fftwf_execute_dft(p, (fftwf_complex *)inbuf, (fftwf_complex *)outbuf);
+    } else {
+        fftwf_execute_dft_r2c(p, inbuf, (fftwf_complex *)outbuf);
+    }
     // Calculate the waterfall buffers
 
     int base_idx = 0;
@@ -151,35 +234,108 @@ int FFTW::execute() {
     if (!is_real) {
         base_idx = size / 2 + 1;
     }
-    // outbuf is complex so we need to multiply by 2
-    // Also normalize the power by the number of bins
-    power_and_quantize(&outbuf[base_idx * 2], powerbuf, quantizedbuf, size,
-                       outbuf_len - base_idx, size_log2);
-    power_and_quantize(outbuf, &powerbuf[outbuf_len - base_idx],
-                       &quantizedbuf[outbuf_len - base_idx], size, base_idx,
-                       size_log2);
-
-    int out_len = outbuf_len;
-    int8_t *quantized_offset_buf = quantizedbuf;
-    float *power_offset_buf = powerbuf;
-    for (int i = 0; i < downsample_levels - 1; i++) {
-        half_and_quantize(power_offset_buf, power_offset_buf + out_len,
-                          quantized_offset_buf + out_len, out_len / 2,
-                          size_log2 - i - 1);
-        power_offset_buf += out_len;
-        quantized_offset_buf += out_len;
-        out_len /= 2;
-    }
+    // Normalize by the number of bins and build the requested waterfall
+    // levels, with none only the normalization runs
+    dsp_power_pyramid(outbuf, powerbuf, quantizedbuf, outbuf_len, base_idx,
+                      pyramid_mask, size, size_log2);
     return 0;
 }
 FFTW::~FFTW() {
     if (p) {
         fftwf_destroy_plan(p);
     }
+    free_input_cache();
     this->free(inbuf);
-    this->free(outbuf);
+    for (auto buf : outbufs) {
+        this->free(buf);
+    }
+    for (auto buf : quantizedbufs) {
+        operator delete[](buf, std::align_val_t(32));
+    }
     operator delete[](powerbuf, std::align_val_t(32));
-    operator delete[](quantizedbuf, std::align_val_t(32));
+}
+
+PolyphaseFFTW::PolyphaseFFTW(size_t size, int nthreads, int downsample_levels,
+                             int brightness_offset, fft_window window,
+                             int taps)
+    : FFTW(size, nthreads, downsample_levels, brightness_offset, window),
+      taps{taps}, history_head{0} {
+    prototype = new (std::align_val_t(32)) float[size * taps];
+    build_polyphase_prototype(prototype, size, taps, window);
+}
+void PolyphaseFFTW::alloc_history() {
+    // Replaces the single frame cache FFTW allocates
+    bool is_complex = outbuf_len == size;
+    size_t len = size * taps * (is_complex ? 2 : 1);
+    free_input_cache();
+    input_cache = this->malloc(len);
+    std::fill(input_cache, input_cache + len, 0.f);
+    history_head = 0;
+}
+int PolyphaseFFTW::plan_c2c(direction d, int options) {
+    int ret = FFTW::plan_c2c(d, options);
+    alloc_history();
+    return ret;
+}
+int PolyphaseFFTW::plan_r2c(int options) {
+    int ret = FFTW::plan_r2c(options);
+    alloc_history();
+    return ret;
+}
+int PolyphaseFFTW::load_raw_input(SampleConverterBase &converter,
+                                  const void *raw) {
+    bool is_complex = outbuf_len == size;
+    int values = is_complex ? 2 : 1;
+    size_t history_len = size * taps;
+
+    // The new hop replaces the oldest samples of the ring, it may wrap
+    history_head = (history_head + hop) % history_len;
+    size_t write = (history_head + history_len - hop) % history_len;
+    size_t first = std::min(hop, history_len - write);
+    converter.convert(&input_cache[write * values], raw, first * values);
+    if (first < hop) {
+        converter.convert(input_cache,
+                          (const uint8_t *)raw +
+                              converter.sample_size() * first * values,
+                          (hop - first) * values);
+    }
+
+    // Weight the history with the prototype and fold it into one frame
+    for (int t = 0; t < taps; t++) {
+        size_t start = (history_head + t * size) % history_len;
+        size_t len = std::min(size, history_len - start);
+        const float *coeffs = &prototype[t * size];
+        for (size_t offset = 0; offset < size;) {
+            float *in = &input_cache[(start + offset) % history_len * values];
+            size_t n = offset ? size - offset : len;
+            if (is_complex) {
+                auto *dst = (std::complex<float> *)&inbuf[offset * 2];
+                auto *src = (std::complex<float> *)in;
+                if (t == 0) {
+                    dsp_multiply_complex(dst, src, &coeffs[offset], n);
+                } else {
+                    dsp_multiply_add_complex(dst, src, &coeffs[offset], n);
+                }
+            } else {
+                if (t == 0) {
+                    dsp_multiply_float(&inbuf[offset], in, &coeffs[offset], n);
+                } else {
+                    dsp_multiply_add_float(&inbuf[offset], in, &coeffs[offset],
+                                           n);
+                }
+            }
+            offset += n;
+        }
+    }
+    return 0;
+}
+void PolyphaseFFTW::swap_input_cache(FFT &other) {
+    FFT::swap_input_cache(other);
+    std::swap(history_head,
+              static_cast<PolyphaseFFTW &>(other).history_head);
+}
+PolyphaseFFTW::~PolyphaseFFTW() {
+    operator delete[](prototype, std::align_val_t(32));
 }
 
 #ifdef CLFFT
@@ -230,8 +386,10 @@ std::string kernel_window_real = R"<rawliteral>(
         throw std::runtime_error("OpenCL error");                              \
     }
 
-clFFT::clFFT(size_t size, int nthreads, int downsample_levels, int brightness_offset)
-    : FFT(size, nthreads, downsample_levels, brightness_offset), window_real{cl::Kernel()},
+clFFT::clFFT(size_t size, int nthreads, int downsample_levels,
+             int brightness_offset, fft_window window)
+    : FFT(size, nthreads, downsample_levels, brightness_offset, window),
+      window_real{cl::Kernel()},
       window_complex{cl::Kernel()}, power_and_quantize{cl::Kernel()},
       half_and_quantize{cl::Kernel()}, dim{CLFFT_1D}, clLengths{size} {
     std::vector<cl::Platform> all_platforms;
@@ -384,6 +542,7 @@ int clFFT::load_complex_input(float *a1, float *a2) {
                    size / 2, buf_a2, cl_windowbuf);
     return 0;
 }
+void clFFT::wait_input() { queue.finish(); }
 int clFFT::execute() {
     int err;
     /* Execute the plan. */
@@ -423,6 +582,8 @@ int clFFT::execute() {
 }
 
 clFFT::~clFFT() {
+    free_input_cache();
+
     /* Release the plan. */
     clfftDestroyPlan(&planHandle);
 
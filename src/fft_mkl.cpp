@@ -1,7 +1,9 @@
 #include "fft.h"
+#include "utils/pyramid.h"
 
-mklFFT::mklFFT(size_t size, int nthreads, int downsample_levels)
-    : FFT(size, nthreads, downsample_levels) {}
+mklFFT::mklFFT(size_t size, int nthreads, int downsample_levels,
+               int brightness_offset, fft_window window)
+    : FFT(size, nthreads, downsample_levels, brightness_offset, window) {}
 
 float *mklFFT::malloc(size_t size) {
     return (float *)fftwf_malloc(sizeof(float) * size);
@@ -64,28 +66,13 @@ int mklFFT::execute() {
     if (!is_real) {
         base_idx = size / 2 + 1;
     }
-    // outbuf is complex so we need to multiply by 2
-    // Also normalize the power by the number of bins
-    power_and_quantize(&outbuf[base_idx * 2], powerbuf, quantizedbuf, size,
-                       outbuf_len - base_idx, size_log2);
-    power_and_quantize(outbuf, &powerbuf[outbuf_len - base_idx],
-                       &quantizedbuf[outbuf_len - base_idx], size, base_idx,
-                       size_log2);
-
-    int out_len = outbuf_len;
-    int8_t *quantized_offset_buf = quantizedbuf;
-    float *power_offset_buf = powerbuf;
-    for (int i = 0; i < downsample_levels - 1; i++) {
-        half_and_quantize(power_offset_buf, power_offset_buf + out_len,
-                          quantized_offset_buf + out_len, out_len / 2,
-                          size_log2 - i - 1);
-        power_offset_buf += out_len;
-        quantized_offset_buf += out_len;
-        out_len /= 2;
-    }
+    // Normalize by the number of bins and build every waterfall level
+    dsp_power_pyramid(outbuf, powerbuf, quantizedbuf, outbuf_len, base_idx,
+                      (1u << downsample_levels) - 1, size, size_log2);
     return 0;
 }
 mklFFT::~mklFFT() {
+    free_input_cache();
     DftiFreeDescriptor(&descriptor); // Free the descriptor
     this->free(inbuf);
     this->free(outbuf);
@@ -1,8 +1,12 @@
 #include "compression.h"
 #include "spectrumserver.h"
 
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <limits>
+#include <stdexcept>
 
 #include <boost/algorithm/string.hpp>
 
@@ -24,6 +28,36 @@ std::string get_mime_type(std::string &extension) {
     return mime_type;
 }
 
+// Splits the key=value pairs after the ? of a request
+static std::map<std::string, std::string>
+get_query_params(const std::string &resource) {
+    std::map<std::string, std::string> params;
+    size_t start = resource.find("?");
+    if (start == std::string::npos) {
+        return params;
+    }
+    std::vector<std::string> pairs;
+    boost::algorithm::split(pairs, resource.substr(start + 1),
+                            boost::is_any_of("&"));
+    for (auto &pair : pairs) {
+        size_t eq = pair.find("=");
+        if (eq != std::string::npos) {
+            params[pair.substr(0, eq)] = pair.substr(eq + 1);
+        }
+    }
+    return params;
+}
+
+// Whole query values only, std::stoll alone stops at the first bad character
+static int64_t parse_int64(const std::string &value) {
+    size_t pos;
+    int64_t result = std::stoll(value, &pos);
+    if (pos != value.size()) {
+        throw std::invalid_argument(value);
+    }
+    return result;
+}
+
 void broadcast_server::on_http(connection_hdl hdl) {
     // Upgrade our connection handle to a full connection_ptr
     server::connection_ptr con = m_server.get_con_from_hdl(hdl);
@@ -37,6 +71,94 @@ void broadcast_server::on_http(connection_hdl hdl) {
     std::string response;
 
     filename = filename.substr(0, filename.find("?"));
+    // The waterfall dictionary is kept in memory rather than the html root
+    std::string resource = con->get_resource();
+    if (waterfall_dictionary &&
+        resource.substr(0, resource.find("?")) == "/waterfall.dict") {
+        con->append_header("content-type", "application/octet-stream");
+        con->append_header("Connection", "close");
+        con->append_header("Cache-Control", "max-age=86400");
+        con->set_body(waterfall_dictionary->content());
+        con->set_status(websocketpp::http::status_code::ok);
+        return;
+    }
+    // Archived rows between from and to, milliseconds since the epoch,
+    // the last hour by default
+    if (waterfall_archive &&
+        resource.substr(0, resource.find("?")) == "/archive") {
+        auto params = get_query_params(resource);
+        int64_t to, from, level;
+        try {
+            to = params.count("to")
+                     ? parse_int64(params["to"])
+                     : std::chrono::duration_cast<std::chrono::milliseconds>(
+                           std::chrono::system_clock::now().time_since_epoch())
+                           .count();
+            from = params.count("from") ? parse_int64(params["from"])
+                                        : to - 3600 * 1000;
+            level = params.count("level")
+                        ? parse_int64(params["level"])
+                        : waterfall_archive->get_first_level();
+            if (level < 0 || level > std::numeric_limits<int>::max()) {
+                throw std::out_of_range(params["level"]);
+            }
+        } catch (...) {
+            con->set_status(websocketpp::http::status_code::bad_request);
+            return;
+        }
+        // Thinned out so a day of rows stays a reasonable download
+        std::string body =
+            waterfall_archive->query(from, to, (int)level, 4096);
+        if (body.empty()) {
+            con->set_status(websocketpp::http::status_code::bad_request);
+            return;
+        }
+        con->append_header("content-type", "application/octet-stream");
+        con->append_header("Connection", "close");
+        con->set_body(body);
+        con->set_status(websocketpp::http::status_code::ok);
+        return;
+    }
+    // Per bin statistics with up to 16 percentiles given as p=10,50,90
+    if (spectrum_statistics &&
+        resource.substr(0, resource.find("?")) == "/statistics") {
+        auto params = get_query_params(resource);
+        std::vector<int> percentiles;
+        try {
+            std::vector<std::string> values;
+            boost::algorithm::split(values,
+                                    params.count("p") ? params["p"]
+                                                      : std::string("10,50,90"),
+                                    boost::is_any_of(","));
+            // Each percentile adds a row of bins to the response
+            if (values.size() > 16) {
+                throw std::out_of_range("p");
+            }
+            for (auto &value : values) {
+                percentiles.push_back(
+                    std::clamp<int64_t>(parse_int64(value), 0, 100));
+            }
+        } catch (...) {
+            con->set_status(websocketpp::http::status_code::bad_request);
+            return;
+        }
+        std::string body = spectrum_statistics->get(percentiles);
+        // Mostly runs of similar values
+        std::set<std::string> encodings;
+        boost::algorithm::split(encodings,
+                                con->get_request_header("accept-encoding"),
+                                boost::is_any_of(", "),
+                                boost::token_compress_on);
+        if (encodings.find("gzip") != encodings.end()) {
+            body = Gzip::compress(body);
+            con->append_header("Content-Encoding", "gzip");
+        }
+        con->append_header("content-type", "application/octet-stream");
+        con->append_header("Connection", "close");
+        con->set_body(body);
+        con->set_status(websocketpp::http::status_code::ok);
+        return;
+    }
     // All the files are under the html root folder
     if (filename == "/" || filename == "\\\\") {
 #ifdef _WIN32
@@ -0,0 +1,71 @@
+#include "plancache.h"
+#include "fft.h"
+
+#include <future>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+// Plans made on SIMD aligned buffers are faster but can only be used with
+// other aligned buffers, anything else gets an FFTW_UNALIGNED plan
+typedef std::tuple<fftw_plan_kind, int, int, bool> plan_key_t;
+
+// Only guards the map, the planning itself happens outside of it
+static std::mutex plan_cache_mtx;
+static std::map<plan_key_t, std::shared_future<fftwf_plan>> plan_cache;
+
+static fftwf_plan create_plan(fftw_plan_kind kind, int size, int howmany,
+                              bool aligned) {
+    fftwf_complex *in =
+        (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * size * howmany);
+    fftwf_complex *out =
+        (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * size * howmany);
+
+    // Planning happens once per process, so it can afford to measure
+    unsigned flags = FFTW_MEASURE | (aligned ? 0 : FFTW_UNALIGNED);
+    fftwf_plan p;
+    {
+        std::scoped_lock lk(fftwf_planner_mutex);
+        p = fftw_wisdom_plan_rows(kind, size, howmany, in, out, flags);
+    }
+
+    // The plan never touches the buffers it was made with again
+    fftwf_free(in);
+    fftwf_free(out);
+    return p;
+}
+
+static fftwf_plan get_plan(fftw_plan_kind kind, int size, int howmany,
+                           bool aligned) {
+    plan_key_t key{kind, size, howmany, aligned};
+    std::promise<fftwf_plan> promise;
+    std::shared_future<fftwf_plan> plan;
+    {
+        std::scoped_lock lk(plan_cache_mtx);
+        auto it = plan_cache.find(key);
+        if (it != plan_cache.end()) {
+            plan = it->second;
+        } else {
+            plan_cache.emplace(key, promise.get_future().share());
+        }
+    }
+    // Measuring a plan takes a while, only callers of the same transform
+    // wait for it while everyone else keeps using the cache
+    if (plan.valid()) {
+        return plan.get();
+    }
+    fftwf_plan p = create_plan(kind, size, howmany, aligned);
+    promise.set_value(p);
+    return p;
+}
+
+void fftw_plan_cache_prepare(fftw_plan_kind kind, int size, int howmany) {
+    get_plan(kind, size, howmany, true);
+}
+
+fftwf_plan fftw_plan_cache_get(fftw_plan_kind kind, int size, const void *in,
+                               const void *out, int howmany) {
+    bool aligned = fftwf_alignment_of((float *)in) == 0 &&
+                   fftwf_alignment_of((float *)out) == 0;
+    return get_plan(kind, size, howmany, aligned);
+}
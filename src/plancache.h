@@ -0,0 +1,23 @@
+#ifndef PLANCACHE_H
+#define PLANCACHE_H
+
+#include <fftw3.h>
+
+#include "wisdom.h"
+
+// Process wide cache of FFTW plans shared between clients
+// Plans are only used through the new-array execute functions
+// (fftwf_execute_dft, fftwf_execute_dft_c2r), which are thread safe, so every
+// client runs the same plan on its own buffers. Plans live until exit.
+
+// A howmany above 1 makes a batched plan over contiguous rows of size elements
+
+// Plans the transform ahead of time so clients never wait on the planner
+void fftw_plan_cache_prepare(fftw_plan_kind kind, int size, int howmany = 1);
+
+// Returns a plan for the transform that is valid for buffers aligned like
+// in and out, planning it first if it was not prepared
+fftwf_plan fftw_plan_cache_get(fftw_plan_kind kind, int size, const void *in,
+                               const void *out, int howmany = 1);
+
+#endif
@@ -0,0 +1,104 @@
+#include "ringbuffer.h"
+
+SampleRingBuffer::SampleRingBuffer(size_t num_slots,
+                                   std::function<void *()> alloc_slot,
+                                   std::function<void(void *)> free_slot)
+    : free_slot{std::move(free_slot)}, head{0}, tail{0}, peak{0}, stalls{0},
+      closed{false} {
+    slots.resize(num_slots);
+    for (auto &slot : slots) {
+        slot = alloc_slot();
+    }
+}
+
+SampleRingBuffer::~SampleRingBuffer() {
+    for (auto &slot : slots) {
+        free_slot(slot);
+    }
+}
+
+void *SampleRingBuffer::acquire_write() {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == slots.size()) {
+        // The consumer is behind, wait for a slot to free up
+        stalls.fetch_add(1, std::memory_order_relaxed);
+        std::unique_lock lk(mtx);
+        cv.wait(lk, [&] {
+            return closed.load() ||
+                   h - tail.load(std::memory_order_acquire) < slots.size();
+        });
+    }
+    if (closed.load()) {
+        return nullptr;
+    }
+    return slots[h % slots.size()];
+}
+
+void *SampleRingBuffer::try_acquire_write() {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (closed.load() ||
+        h - tail.load(std::memory_order_acquire) == slots.size()) {
+        return nullptr;
+    }
+    return slots[h % slots.size()];
+}
+
+void SampleRingBuffer::commit_write() {
+    size_t h = head.load(std::memory_order_relaxed) + 1;
+    head.store(h, std::memory_order_release);
+
+    size_t filled = h - tail.load(std::memory_order_acquire);
+    if (filled > peak.load(std::memory_order_relaxed)) {
+        peak.store(filled, std::memory_order_relaxed);
+    }
+    {
+        // Pairs with the predicate check in the waiting thread
+        std::scoped_lock lk(mtx);
+    }
+    cv.notify_all();
+}
+
+bool SampleRingBuffer::wait_readable(size_t count) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (head.load(std::memory_order_acquire) - t < count) {
+        std::unique_lock lk(mtx);
+        cv.wait(lk, [&] {
+            return closed.load() ||
+                   head.load(std::memory_order_acquire) - t >= count;
+        });
+    }
+    return !closed.load();
+}
+
+void *SampleRingBuffer::read_slot(size_t offset) {
+    return slots[(tail.load(std::memory_order_relaxed) + offset) %
+                 slots.size()];
+}
+
+void SampleRingBuffer::release_read() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+    {
+        std::scoped_lock lk(mtx);
+    }
+    cv.notify_all();
+}
+
+void SampleRingBuffer::close() {
+    {
+        std::scoped_lock lk(mtx);
+        closed = true;
+    }
+    cv.notify_all();
+}
+
+size_t SampleRingBuffer::occupancy() const {
+    return head.load(std::memory_order_acquire) -
+           tail.load(std::memory_order_acquire);
+}
+size_t SampleRingBuffer::peak_occupancy() const {
+    return peak.load(std::memory_order_relaxed);
+}
+uint64_t SampleRingBuffer::producer_stalls() const {
+    return stalls.load(std::memory_order_relaxed);
+}
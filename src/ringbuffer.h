@@ -0,0 +1,62 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Single producer, single consumer ring of preallocated sample blocks
+// The reader thread fills slots at the head while the FFT thread consumes
+// them by index from the tail, no allocation happens after construction
+class SampleRingBuffer {
+  public:
+    SampleRingBuffer(size_t num_slots, std::function<void *()> alloc_slot,
+                     std::function<void(void *)> free_slot);
+    SampleRingBuffer(const SampleRingBuffer &) = delete;
+    SampleRingBuffer &operator=(const SampleRingBuffer &) = delete;
+    ~SampleRingBuffer();
+
+    // Producer side, returns the next free slot or nullptr once closed
+    // Blocks while the ring is full, which is counted as a producer stall
+    void *acquire_write();
+    // Returns nullptr instead of waiting when the ring is full, for
+    // producers that would rather drop the block than stall
+    void *try_acquire_write();
+    void commit_write();
+
+    // Consumer side, blocks until count slots are filled
+    // Returns false once the ring is closed
+    bool wait_readable(size_t count);
+    // Slot at offset from the oldest unconsumed slot
+    void *read_slot(size_t offset);
+    void release_read();
+
+    // Wakes up both sides so they can exit
+    void close();
+
+    size_t capacity() const { return slots.size(); }
+    size_t occupancy() const;
+    size_t peak_occupancy() const;
+    uint64_t producer_stalls() const;
+
+  protected:
+    std::vector<void *> slots;
+    std::function<void(void *)> free_slot;
+
+    // Head and tail are on separate cache lines to avoid false sharing
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    alignas(64) std::atomic<size_t> peak;
+    std::atomic<uint64_t> stalls;
+
+    // Only used to sleep when the ring is full or empty
+    std::atomic<bool> closed;
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+#endif
@@ -1,10 +1,9 @@
 #include "samplereader.h"
 #include "utils.h"
+#include "utils/dsp.h"
 
+#include <algorithm>
 #include <iostream>
-#include <limits>
-#include <type_traits>
-#include <vector>
 
 FileSampleReader::FileSampleReader(FILE *f) : f{f} {}
 int FileSampleReader::read(void *arr, int num) {
@@ -18,54 +17,54 @@ int FileSampleReader::read(void *arr, int num) {
 SampleConverterBase::SampleConverterBase(std::unique_ptr<SampleReader> reader)
     : reader(std::move(reader)) {}
 
+int SampleConverterBase::read_raw(void *raw, int num) {
+    return reader->read(raw, sample_size() * num) / sample_size();
+}
+
 template <typename T>
 SampleConverter<T>::SampleConverter(std::unique_ptr<SampleReader> reader)
-    : SampleConverterBase(std::move(reader)) {}
-
-template <typename T> struct type_ {
-    using type = T;
-};
-
-template <typename T, typename T_signed> void convert(float *arr, T_signed *scratch, float scale, size_t num) {
-    arr = std::assume_aligned<64>(arr);
-    scratch = std::assume_aligned<64>(scratch);
-    //[[assume(num % (64 / sizeof(T)) == 0)]];
-    [[assume(num > 0)]];
-    for (size_t i = 0; i < num; i++) {
-        if constexpr (std::is_unsigned<T>::value) {
-            scratch[i] = scratch[i] ^ ((T)1 << (sizeof(T) * 8 - 1));
-        }
-        arr[i] = ((float)scratch[i]) / scale;
-    }
-}
+    : SampleConverterBase(std::move(reader)),
+      convert_kernel{select_convert_fn<T>()} {}
 
 template <typename T> void SampleConverter<T>::read(float *arr, int num) {
-    // Use the last part of the array as a scratch buffer
-    T *scratch;
+    T *samples;
     if constexpr (sizeof(T) > sizeof(float)) {
-        scratch = new T[num];
+        // Only grows, so the steady state does not allocate
+        if (scratch.size() < (size_t)num) {
+            scratch.resize(num);
+        }
+        samples = scratch.data();
     } else {
-        scratch = ((T *)&arr[num]) - num;
+        // Use the last part of the array as a scratch buffer
+        samples = ((T *)&arr[num]) - num;
     }
-    reader->read(scratch, sizeof(T) * num);
-    auto constexpr static unsigned_type = []() {
-        if constexpr (std::is_unsigned<T>::value) {
-            return type_<typename std::make_signed<T>::type>{};
-        } else {
-            return type_<T>{};
-        }
-    };
-    typedef typename decltype(unsigned_type())::type T_signed;
-    constexpr float scale = []() {
-        if constexpr (std::is_integral<T>::value) {
-            return (float)std::numeric_limits<T_signed>::max() + 1.;
+    reader->read(samples, sizeof(T) * num);
+    convert_kernel(arr, samples, num);
+}
+
+template <typename T>
+void SampleConverter<T>::convert(float *arr, const void *raw, int num) {
+    convert_kernel(arr, (const T *)raw, num);
+}
+
+template <typename T>
+void SampleConverter<T>::convert_window(float *arr, float *cache,
+                                        const void *raw, const float *window,
+                                        int num, bool is_complex) {
+    const T *samples = (const T *)raw;
+    // Work in blocks small enough to stay in L1, so the converted samples are
+    // still hot when they are read back for the window multiply
+    constexpr int block = 4096;
+    for (int i = 0; i < num; i += block) {
+        int len = std::min(block, num - i);
+        convert_kernel(&cache[i], &samples[i], len);
+        if (is_complex) {
+            dsp_multiply_complex((std::complex<float> *)&arr[i],
+                                 (std::complex<float> *)&cache[i],
+                                 &window[i / 2], len / 2);
         } else {
-            return 1.;
+            dsp_multiply_float(&arr[i], &cache[i], &window[i], len);
         }
-    }();
-    convert<T, T_signed>(arr, (T_signed*)scratch, scale, num);
-    if constexpr (sizeof(T) > sizeof(float)) {
-        delete[] scratch;
     }
 }
 
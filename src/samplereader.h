@@ -3,6 +3,10 @@
 
 #include <cstdio>
 #include <memory>
+#include <vector>
+
+#include "utils/convert.h"
+
 class SampleReader {
   public:
     virtual int read(void *arr, int num) = 0;
@@ -25,6 +29,18 @@ class SampleConverterBase {
   public:
     SampleConverterBase(std::unique_ptr<SampleReader> reader);
     virtual void read(float *arr, int num) = 0;
+
+    // Size in bytes of a single raw sample
+    virtual size_t sample_size() = 0;
+    // Reads num raw samples without converting them, returns the number of
+    // whole samples read
+    int read_raw(void *raw, int num);
+    virtual void convert(float *arr, const void *raw, int num) = 0;
+    // Converts raw samples into cache and writes them multiplied by the window
+    // into arr in the same pass, for IQ input a window value spans a pair
+    virtual void convert_window(float *arr, float *cache, const void *raw,
+                                const float *window, int num,
+                                bool is_complex) = 0;
     virtual ~SampleConverterBase() {}
 };
 
@@ -32,7 +48,17 @@ template <typename T> class SampleConverter : public SampleConverterBase {
   public:
     SampleConverter(std::unique_ptr<SampleReader> reader);
     virtual void read(float *arr, int num);
+    virtual size_t sample_size() { return sizeof(T); }
+    virtual void convert(float *arr, const void *raw, int num);
+    virtual void convert_window(float *arr, float *cache, const void *raw,
+                                const float *window, int num, bool is_complex);
     virtual ~SampleConverter() {}
+
+  protected:
+    // Conversion kernel picked at runtime for the CPU
+    convert_fn_t<T> convert_kernel;
+    // Samples wider than a float cannot be converted in place, reused
+    std::vector<T> scratch;
 };
 
 #endif
@@ -2,16 +2,18 @@
 #include <complex.h>
 
 #include "fft.h"
+#include "plancache.h"
 #include "signal.h"
 #include "utils/dsp.h"
 
 AudioClient::AudioClient(connection_hdl hdl, PacketSender &sender,
                          audio_compressor audio_compression, bool is_real,
                          int audio_fft_size, int audio_max_sps,
-                         int fft_result_size)
+                         int fft_result_size, const audio_overlap &overlap)
     : Client(hdl, sender, AUDIO), is_real{is_real},
       audio_fft_size{audio_fft_size}, fft_result_size{fft_result_size},
-      audio_rate{audio_max_sps}, signal_slices{sender.get_signal_slices()},
+      audio_rate{audio_max_sps}, overlap{overlap},
+      audio_hop{overlap.audio_hop}, signal_slices{sender.get_signal_slices()},
       signal_slice_mtx{sender.get_signal_slice_mtx()} {
 
     if (audio_compression == AUDIO_FLAC) {
@@ -34,21 +36,27 @@ AudioClient::AudioClient(connection_hdl hdl, PacketSender &sender,
 
     unique_id = generate_unique_id();
     frame_num = 0;
+    last_frame_num = 0;
+    stream_source = 0;
+    l = 0;
+    r = 0;
+    audio_mid = 0;
+    demodulation = USB;
+    pending_demodulation = USB;
 
-    // Audio demodulation scratch data structures
-    audio_fft_input =
-        fftwf_malloc_unique_ptr<std::complex<float>>(audio_fft_size);
-    audio_complex_baseband =
-        fftwf_malloc_unique_ptr<std::complex<float>>(audio_fft_size);
+    // Running overlap-add sums, filterbank frames unfold to taps times the
+    // IFFT size
+    int extended_size = audio_fft_size * overlap.taps;
     audio_complex_baseband_prev =
-        fftwf_malloc_unique_ptr<std::complex<float>>(audio_fft_size);
-    audio_complex_baseband_carrier =
-        fftwf_malloc_unique_ptr<std::complex<float>>(audio_fft_size);
+        fftwf_malloc_unique_ptr<std::complex<float>>(extended_size);
     audio_complex_baseband_carrier_prev =
-        fftwf_malloc_unique_ptr<std::complex<float>>(audio_fft_size);
+        fftwf_malloc_unique_ptr<std::complex<float>>(extended_size);
+    audio_complex_extended =
+        fftwf_malloc_unique_ptr<std::complex<float>>(extended_size);
 
     audio_real.resize(audio_fft_size);
-    audio_real_prev.resize(audio_fft_size);
+    audio_real_prev.resize(extended_size);
+    audio_real_extended.resize(extended_size);
     audio_real_int16.resize(audio_fft_size);
 
     dc = DCBlocker<float>(audio_max_sps / 750 * 2);
@@ -60,32 +68,16 @@ AudioClient::AudioClient(connection_hdl hdl, PacketSender &sender,
     mixer = nco_crcf_create(LIQUID_NCO);
     nco_crcf_pll_set_bandwidth(mixer, 0.001f);
 #endif
-
-    {
-        std::scoped_lock lg(fftwf_planner_mutex);
-        fftwf_plan_with_nthreads(1);
-        p_complex = fftwf_plan_dft_1d(
-            audio_fft_size, (fftwf_complex *)audio_fft_input.get(),
-            (fftwf_complex *)audio_complex_baseband.get(), FFTW_BACKWARD,
-            FFTW_ESTIMATE);
-        p_complex_carrier = fftwf_plan_dft_1d(
-            audio_fft_size, (fftwf_complex *)audio_fft_input.get(),
-            (fftwf_complex *)audio_complex_baseband_carrier.get(),
-            FFTW_BACKWARD, FFTW_ESTIMATE);
-        p_real = fftwf_plan_dft_c2r_1d(audio_fft_size,
-                                       (fftwf_complex *)audio_fft_input.get(),
-                                       audio_real.data(), FFTW_ESTIMATE);
-    }
+    last_baseband = 0;
 }
 
 void AudioClient::set_audio_range(int l, double m, int r) {
-    audio_mid = m;
-    this->l = l;
-    this->r = r;
-
     // Change the data structures to reflect the changes
     {
         std::scoped_lock lk(signal_slice_mtx);
+        audio_mid = m;
+        this->l = l;
+        this->r = r;
         auto node = signal_slices.extract(it);
         node.key() = {l, r};
         it = signal_slices.insert(std::move(node));
@@ -93,87 +85,172 @@ void AudioClient::set_audio_range(int l, double m, int r) {
     sender.broadcast_signal_changes(unique_id, l, m, r);
 }
 void AudioClient::set_audio_demodulation(demodulation_mode demodulation) {
+    std::scoped_lock lk(signal_slice_mtx);
     this->demodulation = demodulation;
 }
 const std::string &AudioClient::get_unique_id() { return unique_id; }
+audio_tuning AudioClient::get_tuning() const {
+    return {l, r, audio_mid, demodulation};
+}
+bool AudioClient::same_tuning(const AudioClient &other) const {
+    // Raw IQ is sent before demodulation, so only audio can be shared
+    return type == AUDIO && other.type == AUDIO &&
+           get_tuning() == other.get_tuning() &&
+           encoder->get_framing() == other.encoder->get_framing();
+}
+
+void audio_ifft_rows::reserve(int size, size_t rows) {
+    size_t needed = (size_t)size * rows;
+    if (needed > (size_t)this->size * capacity) {
+        in = fftwf_malloc_unique_ptr<std::complex<float>>(needed);
+        out = fftwf_malloc_unique_ptr<std::complex<float>>(needed);
+        this->size = size;
+        capacity = rows;
+    } else if (size != this->size) {
+        capacity = (size_t)this->size * capacity / size;
+        this->size = size;
+    }
+    used = 0;
+}
+
+// Demodulates a group of clients, running the IFFTs of all of them as
+// batched transforms instead of one small transform per client
+void AudioClient::send_audio_batch(std::span<audio_batch_entry> batch,
+                                   size_t frame_num) {
+    // Reused by each io thread to avoid allocating every frame
+    thread_local audio_ifft_rows c2c, c2r;
+    thread_local std::vector<audio_batch_entry *> begun;
+    begun.clear();
+    if (batch.empty()) {
+        return;
+    }
+    // AM takes two complex rows, one for the carrier
+    int size = batch.front().client->audio_fft_size;
+    c2c.reserve(size, batch.size() * 2);
+    c2r.reserve(size, batch.size());
+    for (auto &entry : batch) {
+        if (entry.client->demod_begin(entry.buf, entry.tuning, frame_num, c2c,
+                                      c2r)) {
+            begun.push_back(&entry);
+        }
+    }
+    if (begun.empty()) {
+        return;
+    }
+    execute_ifft_rows(PLAN_C2C_BACKWARD, c2c, batch.size());
+    execute_ifft_rows(PLAN_C2R, c2r, batch.size());
+    for (auto entry : begun) {
+        entry->client->demod_end(c2c, c2r, *entry);
+    }
+}
 
-// Does the demodulation and sends the audio to the client
-// buf is given offseted by l
-void AudioClient::send_audio(std::complex<float> *buf, size_t frame_num) {
+void AudioClient::execute_ifft_rows(fftw_plan_kind kind, audio_ifft_rows &rows,
+                                    size_t max_howmany) {
+    // Only power of two batches up to the batch size are planned
+    size_t done = 0;
+    while (done < rows.used) {
+        int howmany = 1;
+        while ((size_t)howmany * 2 <= rows.used - done &&
+               (size_t)howmany * 2 <= max_howmany) {
+            howmany *= 2;
+        }
+        fftwf_complex *in = (fftwf_complex *)rows.input(done);
+        fftwf_plan p =
+            fftw_plan_cache_get(kind, rows.size, in, rows.out.get(), howmany);
+        if (kind == PLAN_C2R) {
+            fftwf_execute_dft_c2r(p, in, rows.real_output(done));
+        } else {
+            fftwf_execute_dft(p, in,
+                              (fftwf_complex *)rows.complex_output(done));
+        }
+        done += howmany;
+    }
+}
+
+// Copies the requested bins into the IFFT inputs and queues the transforms
+// needed, returns false if there is nothing left to do for this frame
+bool AudioClient::demod_begin(std::complex<float> *buf,
+                              const audio_tuning &tuning, size_t frame_num,
+                              audio_ifft_rows &c2c, audio_ifft_rows &c2r) {
     try {
-        const int audio_l = l - l;
-        const int audio_r = r - l;
-        const int audio_m = floor(audio_mid) - l;
-        const int audio_m_idx = floor(audio_mid);
+        const int audio_l = tuning.l - tuning.l;
+        const int audio_r = tuning.r - tuning.l;
+        const int audio_m = floor(tuning.mid) - tuning.l;
 
         int len = audio_r - audio_l;
         // If the user request for the raw IQ signal, do not demodulate
         if (type == SIGNAL) {
             sender.send_binary_packet(hdl, buf,
                                       sizeof(std::complex<float>) * len);
-            return;
+            return false;
         }
 
-        float average_power = std::accumulate(
+        // Frames skipped while busy or following another client leave the
+        // sums from a frame that does not join up with this one
+        if (frame_num != last_frame_num + 1) {
+            reset_overlap();
+        }
+        last_frame_num = frame_num;
+        // The levels were those of another mode, or of audio this client did
+        // not demodulate while it followed another one
+        if (tuning.demodulation != pending_demodulation ||
+            stream_source != encoder->get_stream_id()) {
+            dc.reset();
+            agc.reset();
+        }
+
+        pending_frame_num = frame_num;
+        pending_l = audio_l;
+        pending_r = audio_r;
+        pending_mid = tuning.mid;
+        pending_m_idx = floor(tuning.mid);
+        pending_demodulation = tuning.demodulation;
+        pending_power = std::accumulate(
             buf, buf + len, 0.0f,
             [](float a, std::complex<float> &b) { return a + std::norm(b); });
 
-        // average_power /= len;
-
-        // Main demodulation logic for the frequency
-        if (demodulation == USB || demodulation == LSB) {
-            if (demodulation == USB) {
-                // For USB, just copy the bins to the audio frequencies
-                std::fill(audio_fft_input.get(),
-                          audio_fft_input.get() + audio_fft_size, 0.0f);
-                // User requested for [l, r)
-                // IFFT bins are [audio_m, audio_m + audio_fft_size)
-                // intersect and copy
-                int copy_l = std::max(audio_l, audio_m);
-                int copy_r = std::min(audio_r, audio_m + audio_fft_size);
-                if (copy_r >= copy_l) {
-                    std::copy(buf + copy_l - audio_l, buf + copy_r - audio_l,
-                            audio_fft_input.get() + copy_l - audio_m);
-                }
-                fftwf_execute(p_real);
-            } else if (demodulation == LSB) {
-                // For LSB, just copy the inverted bins to the audio frequencies
-                std::fill(audio_fft_input.get(),
-                          audio_fft_input.get() + audio_fft_size, 0.0f);
-                // User requested for [l, r)
-                // IFFT bins are [audio_m - audio_fft_size + 1, audio_m + 1)
-                // intersect and copy
-                int copy_l = std::max(audio_l, audio_m - audio_fft_size + 1);
-                int copy_r = std::min(audio_r, audio_m + 1);
-                // last element should be at audio_fft_size - 1
-                if (copy_r >= copy_l) {
-                    std::reverse_copy(buf + copy_l - audio_l,
-                                    buf + copy_r - audio_l,
-                                    audio_fft_input.get() + audio_m - copy_r + 1);
-                }
-                fftwf_execute(p_real);
-                std::reverse(audio_real.begin(), audio_real.end());
+        // pending_power /= len;
+
+        // Main demodulation logic for the frequency, the bins are written
+        // straight into the next IFFT row of the batch
+        std::complex<float> *input;
+        if (pending_demodulation == USB) {
+            pending_rows[0] = c2r.next();
+            input = c2r.input(pending_rows[0]);
+            // For USB, just copy the bins to the audio frequencies
+            std::fill(input, input + audio_fft_size, 0.0f);
+            // User requested for [l, r)
+            // IFFT bins are [audio_m, audio_m + audio_fft_size)
+            // intersect and copy
+            int copy_l = std::max(audio_l, audio_m);
+            int copy_r = std::min(audio_r, audio_m + audio_fft_size);
+            if (copy_r >= copy_l) {
+                std::copy(buf + copy_l - audio_l, buf + copy_r - audio_l,
+                          input + copy_l - audio_m);
             }
-            // On every other frame, the audio waveform is inverted due to the
-            // 50% overlap This only happens when downconverting by either even
-            // or odd bins, depending on modulation
-            if (demodulation == USB && frame_num % 2 == 1 &&
-                ((audio_m_idx % 2 == 0 && !is_real) ||
-                 (audio_m_idx % 2 == 1 && is_real))) {
-                dsp_negate_float(audio_real.data(), audio_fft_size);
-            } else if (demodulation == LSB && frame_num % 2 == 1 &&
-                       ((audio_m_idx % 2 == 0 && !is_real) ||
-                        (audio_m_idx % 2 == 1 && is_real))) {
-                dsp_negate_float(audio_real.data(), audio_fft_size);
+            rotate_to_baseband(input, frame_num);
+        } else if (pending_demodulation == LSB) {
+            pending_rows[0] = c2r.next();
+            input = c2r.input(pending_rows[0]);
+            // For LSB, just copy the inverted bins to the audio frequencies
+            std::fill(input, input + audio_fft_size, 0.0f);
+            // User requested for [l, r)
+            // IFFT bins are [audio_m - audio_fft_size + 1, audio_m + 1)
+            // intersect and copy
+            int copy_l = std::max(audio_l, audio_m - audio_fft_size + 1);
+            int copy_r = std::min(audio_r, audio_m + 1);
+            // last element should be at audio_fft_size - 1
+            if (copy_r >= copy_l) {
+                std::reverse_copy(buf + copy_l - audio_l,
+                                  buf + copy_r - audio_l,
+                                  input + audio_m - copy_r + 1);
             }
-
-            // Overlap and add the audio waveform, due to the 50% overlap
-            dsp_add_float(audio_real.data(), audio_real_prev.data(),
-                          audio_fft_size / 2);
-        } else if (demodulation == AM || demodulation == FM) {
+            rotate_to_baseband(input, frame_num);
+        } else if (pending_demodulation == AM || pending_demodulation == FM) {
+            pending_rows[0] = c2c.next();
+            input = c2c.input(pending_rows[0]);
             // For AM, copy the bins to the complex baseband frequencies
-            std::fill(audio_fft_input.get(),
-                      audio_fft_input.get() + audio_fft_size, 0.0f);
+            std::fill(input, input + audio_fft_size, 0.0f);
 
             // Bins are [audio_l, audio_r)
             // Positive IFFT bins are [audio_m, audio_m + audio_fft_size / 2)
@@ -184,7 +261,7 @@ void AudioClient::send_audio(std::complex<float> *buf, size_t frame_num) {
             if (pos_copy_r >= pos_copy_l) {
                 std::copy(buf + pos_copy_l - audio_l,
                           buf + pos_copy_r - audio_l,
-                          audio_fft_input.get() + pos_copy_l - audio_m);
+                          input + pos_copy_l - audio_m);
             }
             int neg_copy_l =
                 std::max(audio_l, audio_m - audio_fft_size / 2 + 1);
@@ -193,58 +270,158 @@ void AudioClient::send_audio(std::complex<float> *buf, size_t frame_num) {
             if (neg_copy_r >= neg_copy_l) {
                 std::copy(buf + neg_copy_l - audio_l,
                           buf + neg_copy_r - audio_l,
-                          audio_fft_input.get() + audio_fft_size -
-                              (audio_m - neg_copy_l));
+                          input + audio_fft_size - (audio_m - neg_copy_l));
             }
+            rotate_to_baseband(input, frame_num);
 
-            auto prev = audio_complex_baseband[audio_fft_size / 2 - 1];
-            std::copy(audio_complex_baseband.get() + audio_fft_size / 2,
-                      audio_complex_baseband.get() + audio_fft_size,
-                      audio_complex_baseband_prev.get());
-
-            if (demodulation == AM) {
+            if (pending_demodulation == AM) {
                 // Carrier
-                std::copy(audio_complex_baseband_carrier.get() +
-                              audio_fft_size / 2,
-                          audio_complex_baseband_carrier.get() + audio_fft_size,
-                          audio_complex_baseband_carrier_prev.get());
-            }
-            // Copy the bins to the complex baseband frequencies
-            // Remove DC
-            fftwf_execute(p_complex);
-            if (demodulation == AM) {
                 // Keep only the low frequencies < 500Hz
+                pending_rows[1] = c2c.next();
+                std::complex<float> *carrier = c2c.input(pending_rows[1]);
                 int cutoff = 500 * audio_fft_size / audio_rate;
-                std::fill(audio_fft_input.get() + cutoff,
-                          audio_fft_input.get() + audio_fft_size - cutoff,
+                std::copy(input, input + audio_fft_size, carrier);
+                std::fill(carrier + cutoff, carrier + audio_fft_size - cutoff,
                           0.0f);
-                fftwf_execute(p_complex_carrier);
             }
-            if (frame_num % 2 == 1 && ((audio_m_idx % 2 == 0 && !is_real) ||
-                                       (audio_m_idx % 2 == 1 && is_real))) {
-                // If the center frequency is even and the frame number is odd,
-                // or if the center frequency is odd and the frame number is
-                // even, then the signal is inverted
-                dsp_negate_complex(audio_complex_baseband.get(),
-                                   audio_fft_size);
-                if (demodulation == AM) {
-                    dsp_negate_complex(audio_complex_baseband_carrier.get(),
-                                       audio_fft_size);
-                }
+        } else {
+            return false;
+        }
+        return true;
+    } catch (const std::exception &exc) {
+        return false;
+    }
+}
+
+void AudioClient::rotate_to_baseband(std::complex<float> *input,
+                                     size_t frame_num) {
+    // Frame f starts f * hop samples in, so a tone in bin k has picked up
+    // a phase of 2 pi k f hop / fft_size. Shifting bin k down to baseband
+    // leaves that phase behind, which breaks the overlap-add unless removed
+    int64_t fft_size = overlap.fft_size;
+    int64_t bin = is_real ? pending_m_idx : pending_m_idx + fft_size / 2 + 1;
+    uint64_t start = (uint64_t)frame_num * overlap.fft_hop % fft_size;
+    uint64_t turn = (uint64_t)(bin % fft_size) * start % fft_size;
+    if (turn == 0) {
+        return;
+    }
+    // Half a turn is the common case with 50% overlap
+    if (turn * 2 == (uint64_t)fft_size) {
+        dsp_negate_complex(input, audio_fft_size);
+        return;
+    }
+    std::complex<float> rotation(
+        std::polar(1.0, -2.0 * M_PI * (double)turn / (double)fft_size));
+    for (int i = 0; i < audio_fft_size; i++) {
+        input[i] *= rotation;
+    }
+}
+
+void AudioClient::reset_overlap() {
+    int extended_size = audio_fft_size * overlap.taps;
+    std::fill(audio_real_prev.begin(), audio_real_prev.end(), 0.0f);
+    std::fill(audio_complex_baseband_prev.get(),
+              audio_complex_baseband_prev.get() + extended_size, 0.0f);
+    std::fill(audio_complex_baseband_carrier_prev.get(),
+              audio_complex_baseband_carrier_prev.get() + extended_size, 0.0f);
+    last_baseband = 0;
+}
+
+float build_audio_overlap(audio_overlap &overlap, fft_window window,
+                          int audio_size) {
+    overlap.audio_hop =
+        (int64_t)audio_size * overlap.fft_hop / overlap.fft_size;
+    overlap.gain.resize(overlap.audio_hop);
+    overlap.synthesis.clear();
+    std::vector<float> weights;
+    if (overlap.taps > 1) {
+        // A filterbank frame is unfolded to taps frames and weighted by a
+        // synthesis window that cancels the aliasing of the fold
+        int prototype_size = overlap.fft_size * overlap.taps;
+        int extended_size = audio_size * overlap.taps;
+        std::vector<float> prototype(prototype_size);
+        build_polyphase_prototype(prototype.data(), overlap.fft_size,
+                                  overlap.taps, window);
+        weights.resize(extended_size);
+        for (int i = 0; i < extended_size; i++) {
+            weights[i] = prototype[(int64_t)i * prototype_size / extended_size];
+        }
+        overlap.synthesis.resize(extended_size);
+        build_wola_synthesis(overlap.synthesis.data(), weights.data(),
+                             extended_size, audio_size, overlap.audio_hop);
+        for (int i = 0; i < extended_size; i++) {
+            weights[i] *= overlap.synthesis[i];
+        }
+    } else {
+        weights.resize(overlap.fft_size);
+        build_fft_window(weights.data(), overlap.fft_size, window);
+    }
+    return build_overlap_add_gain(overlap.gain.data(), weights.data(),
+                                  weights.size(), audio_size * overlap.taps,
+                                  overlap.audio_hop);
+}
+
+template <typename T>
+void overlap_add(T *frame, T *extended, T *sum, int len,
+                 const audio_overlap &overlap) {
+    int extended_len = len * overlap.taps;
+    int hop = overlap.audio_hop;
+    if (overlap.taps > 1) {
+        // A filterbank frame is time aliased, unfold it and apply the
+        // synthesis filter
+        for (int i = 0; i < extended_len; i++) {
+            extended[i] = frame[i % len] * overlap.synthesis[i];
+        }
+    } else {
+        extended = frame;
+    }
+    for (int i = 0; i < extended_len - hop; i++) {
+        extended[i] += sum[i];
+    }
+    std::copy(extended + hop, extended + extended_len, sum);
+    for (int i = 0; i < hop; i++) {
+        frame[i] = extended[i] * overlap.gain[i];
+    }
+}
+template void overlap_add(float *, float *, float *, int,
+                          const audio_overlap &);
+template void overlap_add(std::complex<float> *, std::complex<float> *,
+                          std::complex<float> *, int, const audio_overlap &);
+
+// Runs after the IFFTs of the rows taken by demod_begin, finishes
+// demodulation and sends the audio off
+void AudioClient::demod_end(audio_ifft_rows &c2c, audio_ifft_rows &c2r,
+                            const audio_batch_entry &entry) {
+    try {
+        const size_t frame_num = pending_frame_num;
+
+        // SSB audio is finished in place in its output row
+        float *audio = audio_real.data();
+        if (pending_demodulation == USB || pending_demodulation == LSB) {
+            audio = c2r.real_output(pending_rows[0]);
+            if (pending_demodulation == LSB) {
+                std::reverse(audio, audio + audio_fft_size);
             }
-            dsp_add_complex(audio_complex_baseband.get(),
-                            audio_complex_baseband_prev.get(),
-                            audio_fft_size / 2);
-            if (demodulation == AM) {
-                dsp_add_complex(audio_complex_baseband_carrier.get(),
-                                audio_complex_baseband_carrier_prev.get(),
-                                audio_fft_size / 2);
+
+            // Overlap and add the audio waveform
+            overlap_add(audio, audio_real_extended.data(),
+                        audio_real_prev.data(), audio_fft_size, overlap);
+        } else if (pending_demodulation == AM || pending_demodulation == FM) {
+            std::complex<float> *baseband = c2c.complex_output(pending_rows[0]);
+            overlap_add(baseband, audio_complex_extended.get(),
+                        audio_complex_baseband_prev.get(), audio_fft_size,
+                        overlap);
+            if (pending_demodulation == AM) {
+                std::complex<float> *carrier =
+                    c2c.complex_output(pending_rows[1]);
+                overlap_add(carrier, audio_complex_extended.get(),
+                            audio_complex_baseband_carrier_prev.get(),
+                            audio_fft_size, overlap);
 #ifdef HAS_LIQUID
-                for (int i = 0; i < audio_fft_size / 2; i++) {
+                for (int i = 0; i < audio_hop; i++) {
                     std::complex<float> v0, v1;
-                    nco_crcf_mix_down(mixer, audio_complex_baseband_carrier[i],
-                                      &v0);
-                    nco_crcf_mix_down(mixer, audio_complex_baseband[i], &v1);
+                    nco_crcf_mix_down(mixer, carrier[i], &v0);
+                    nco_crcf_mix_down(mixer, baseband[i], &v1);
                     float phase_error = std::arg(v0);
                     nco_crcf_pll_step(mixer, phase_error);
                     nco_crcf_step(mixer);
@@ -252,46 +429,59 @@ void AudioClient::send_audio(std::complex<float> *buf, size_t frame_num) {
                 }
 #else
                 // Envelope detection for AM
-                dsp_am_demod(audio_complex_baseband.get(), audio_real.data(),
-                             audio_fft_size / 2);
+                dsp_am_demod(baseband, audio_real.data(), audio_hop);
 #endif
             }
-            if (demodulation == FM) {
+            if (pending_demodulation == FM) {
                 // Polar discriminator for FM
-                polar_discriminator_fm(audio_complex_baseband.get(), prev,
-                                       audio_real.data(), audio_fft_size / 2);
+                polar_discriminator_fm(baseband, last_baseband,
+                                       audio_real.data(), audio_hop);
             }
+            last_baseband = baseband[audio_hop - 1];
         }
 
         // Check if any audio_real is nan
-        for (int i = 0; i < audio_fft_size / 2; i++) {
-            if (std::isnan(audio_real[i])) {
+        for (int i = 0; i < audio_hop; i++) {
+            if (std::isnan(audio[i])) {
                 throw std::runtime_error("NaN found in audio_real");
             }
         }
 
-        // Copy the half to add in the next frame
-        std::copy(audio_real.begin() + (audio_fft_size / 2), audio_real.end(),
-                  audio_real_prev.begin());
-
         // DC removal
-        dc.removeDC(audio_real.data(), audio_fft_size / 2);
+        dc.removeDC(audio, audio_hop);
 
         // AGC
-        agc.process(audio_real.data(), audio_fft_size / 2);
+        agc.process(audio, audio_hop);
         // Quantize into 16 bit audio to save bandwidth
-        dsp_float_to_int16(audio_real.data(), audio_real_int16.data(),
-                           65536 / 4, audio_fft_size / 2);
+        dsp_float_to_int16(audio, audio_real_int16.data(),
+                           65536 / 4, audio_hop);
 
         // Set audio details
-        encoder->set_data(frame_num, audio_l, audio_mid, audio_r,
-                          average_power);
+        encoder->set_data(frame_num, pending_l, pending_mid, pending_r,
+                          pending_power);
 
-        // Encode audio and send it off
-        encoder->process(audio_real_int16.data(), audio_fft_size / 2);
+        // Listeners that last decoded another encoder's stream start over on
+        // this one. The followers are busy until this frame is sent, so their
+        // stream source is not touched anywhere else
+        uint64_t stream_id = encoder->get_stream_id();
+        if (stream_source != stream_id) {
+            encoder->send_stream_header(hdl);
+            stream_source = stream_id;
+        }
+        for (auto &follower : entry.follower_clients) {
+            if (follower->stream_source != stream_id) {
+                try {
+                    encoder->send_stream_header(follower->hdl);
+                    follower->stream_source = stream_id;
+                } catch (...) {
+                }
+            }
+        }
 
-        // Increment the frame number
-        frame_num++;
+        // Encode audio and send it off, once for every listener on this tuning
+        encoder->set_followers(&entry.followers);
+        encoder->process(audio_real_int16.data(), audio_hop);
+        encoder->set_followers(nullptr);
     } catch (const std::exception &exc) {
         // std::cout << "client disconnect" << std::endl;
     }
@@ -313,31 +503,33 @@ void AudioClient::on_window_message(int new_l, std::optional<double> &m,
     set_audio_range(new_l, new_m, new_r);
 }
 
+void AudioClient::on_framing_message(packet_framing framing) {
+    encoder->set_framing(framing);
+}
+
 void AudioClient::on_demodulation_message(std::string &demodulation) {
-    // Update the demodulation type
+    // Update the demodulation type, the AGC is reset by the next frame
     if (demodulation == "USB") {
-        this->demodulation = USB;
+        set_audio_demodulation(USB);
     } else if (demodulation == "LSB") {
-        this->demodulation = LSB;
+        set_audio_demodulation(LSB);
     } else if (demodulation == "AM") {
-        this->demodulation = AM;
+        set_audio_demodulation(AM);
     } else if (demodulation == "FM") {
-        this->demodulation = FM;
+        set_audio_demodulation(FM);
     }
-    this->agc.reset();
 }
 
 void AudioClient::on_close() {
     {
         std::scoped_lock lk(signal_slice_mtx);
         signal_slices.erase(it);
+        // The connection holds the close handler bound to this client
+        con.reset();
     }
     sender.broadcast_signal_changes(unique_id, -1, -1, -1);
 }
 AudioClient::~AudioClient() {
-    fftwf_destroy_plan(p_real);
-    fftwf_destroy_plan(p_complex_carrier);
-    fftwf_destroy_plan(p_complex);
 #ifdef HAS_LIQUID
     nco_crcf_destroy(mixer);
 #endif
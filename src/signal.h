@@ -3,10 +3,13 @@
 
 #include "audio.h"
 #include "client.h"
+#include "fft.h"
 #include "utils.h"
 #include "utils/audioprocessing.h"
+#include "wisdom.h"
 
 #include <complex>
+#include <span>
 
 #include <boost/align/aligned_allocator.hpp>
 
@@ -50,21 +53,101 @@ fftwf_malloc_unique_ptr(size_t n) {
     return std::unique_ptr<T[], ComplexDeleter>(ptr);
 }
 
+class AudioClient;
+
+// Contiguous rows that a batch of clients write their IFFT inputs into, the
+// batched transforms run over them in place of the clients' own buffers and
+// leave each output in the row of the same index
+struct audio_ifft_rows {
+    int size = 0;
+    size_t capacity = 0;
+    size_t used = 0;
+    std::unique_ptr<std::complex<float>[], ComplexDeleter> in;
+    std::unique_ptr<std::complex<float>[], ComplexDeleter> out;
+
+    // Makes room for rows of size elements and empties the batch, rows
+    // handed out before are no longer valid
+    void reserve(int size, size_t rows);
+    size_t next() { return used++; }
+    std::complex<float> *input(size_t row) { return in.get() + row * size; }
+    // Rows are size elements apart for real outputs as well
+    std::complex<float> *complex_output(size_t row) {
+        return out.get() + row * size;
+    }
+    float *real_output(size_t row) { return (float *)out.get() + row * size; }
+};
+
+// How consecutive FFT frames overlap, the audio is rebuilt from them by
+// overlap-add with the same hop
+struct audio_overlap {
+    int fft_size;
+    // New input samples in each FFT frame
+    int fft_hop;
+    // New audio samples in each frame
+    int audio_hop;
+    // Undoes the sum of the overlapping windows for each of those samples
+    std::vector<float> gain;
+    // Polyphase filterbank frames are unfolded to taps IFFT lengths and
+    // weighted by the synthesis filter, a plain FFT has one tap and no filter
+    int taps;
+    std::vector<float> synthesis;
+};
+
+// Fills in the hop, gain and synthesis filter for IFFTs of audio_size bins,
+// fft_size, fft_hop and taps must be set already
+// Returns the ratio between the largest and the smallest gain
+float build_audio_overlap(audio_overlap &overlap, fft_window window,
+                          int audio_size);
+
+// Overlap-adds an IFFT output of len samples into the running sum, which
+// holds len * taps samples, and leaves the finished audio_hop samples at the
+// front of frame. extended is scratch of the same size as the sum
+template <typename T>
+void overlap_add(T *frame, T *extended, T *sum, int len,
+                 const audio_overlap &overlap);
+
+// What a client is tuned to. Written and read with the signal slice mutex
+// held, the DSP threads get a copy taken by the frame loop
+struct audio_tuning {
+    int l;
+    int r;
+    double mid;
+    demodulation_mode demodulation;
+    bool operator==(const audio_tuning &) const = default;
+};
+
+// A client together with its slice of the spectrum for this frame
+struct audio_batch_entry {
+    std::shared_ptr<AudioClient> client;
+    std::complex<float> *buf;
+    audio_tuning tuning;
+    // Listeners with the same tuning that are sent this client's audio
+    std::vector<connection_hdl> followers;
+    std::vector<std::shared_ptr<AudioClient>> follower_clients;
+};
+
 class AudioClient : public Client {
   public:
     AudioClient(connection_hdl hdl, PacketSender &sender,
                 audio_compressor audio_compression, bool is_real,
-                int audio_fft_size, int audio_max_sps, int fft_result_size);
+                int audio_fft_size, int audio_max_sps, int fft_result_size,
+                const audio_overlap &overlap);
     void set_audio_range(int l, double audio_mid, int r);
     void set_audio_demodulation(demodulation_mode demodulation);
     const std::string &get_unique_id();
+    // Both are called with the signal slice mutex held
+    audio_tuning get_tuning() const;
+    // Whether both clients would be sent exactly the same audio packets
+    bool same_tuning(const AudioClient &other) const;
 
     virtual void on_window_message(int l, std::optional<double> &m, int r,
                                    std::optional<int> &level);
     virtual void on_demodulation_message(std::string &demodulation);
+    virtual void on_framing_message(packet_framing framing);
     void on_close();
 
-    void send_audio(std::complex<float> *buf, size_t frame_num);
+    static void send_audio_batch(std::span<audio_batch_entry> batch,
+                                 size_t frame_num);
     virtual ~AudioClient();
 
     std::multimap<std::pair<int, int>, std::shared_ptr<AudioClient>>::iterator
@@ -74,6 +157,43 @@ class AudioClient : public Client {
     // User requested demodulation mode
     demodulation_mode demodulation;
 
+    // Demodulation is split around the IFFTs so they can be batched, the
+    // inputs are written straight into the rows and the outputs processed
+    // from them
+    bool demod_begin(std::complex<float> *buf, const audio_tuning &tuning,
+                     size_t frame_num, audio_ifft_rows &c2c,
+                     audio_ifft_rows &c2r);
+    void demod_end(audio_ifft_rows &c2c, audio_ifft_rows &c2r,
+                   const audio_batch_entry &entry);
+    static void execute_ifft_rows(fftw_plan_kind kind, audio_ifft_rows &rows,
+                                  size_t max_howmany);
+    // Undoes the phase the bins picked up from where the frame started
+    void rotate_to_baseband(std::complex<float> *input, size_t frame_num);
+    // Clears the overlap-add sums, for when the previous frame was not
+    // demodulated
+    void reset_overlap();
+
+    // Last frame demodulated, the overlap-add only joins consecutive frames
+    size_t last_frame_num;
+    // Encoder whose stream header the connection was last sent, 0 before
+    // the first audio. Listeners switching to or from following another
+    // client are sent the header of the encoder they now hear
+    // Only touched while the client is busy
+    uint64_t stream_source;
+
+    // State kept from demod_begin for demod_end
+    size_t pending_frame_num;
+    int pending_l;
+    int pending_r;
+    double pending_mid;
+    int pending_m_idx;
+    float pending_power;
+    demodulation_mode pending_demodulation;
+    // Rows of the signal and of the AM carrier
+    size_t pending_rows[2];
+    // Last baseband sample of the previous frame, for the FM discriminator
+    std::complex<float> last_baseband;
+
     // Scratch space for the slice the user requested
     fftwf_complex *fft_slice_buf;
     uint8_t *waterfall_slice_buf;
@@ -83,28 +203,24 @@ class AudioClient : public Client {
     int audio_fft_size;
     int fft_result_size;
     int audio_rate;
-    std::unique_ptr<std::complex<float>[], ComplexDeleter> audio_fft_input;
+    const audio_overlap &overlap;
+    int audio_hop;
 
-    // IQ data for demodulation
-    std::unique_ptr<std::complex<float>[], ComplexDeleter>
-        audio_complex_baseband;
+    // Overlap-add sums of the baseband and the AM carrier
     std::unique_ptr<std::complex<float>[], ComplexDeleter>
         audio_complex_baseband_prev;
-
-    std::unique_ptr<std::complex<float>[], ComplexDeleter>
-        audio_complex_baseband_carrier;
     std::unique_ptr<std::complex<float>[], ComplexDeleter>
         audio_complex_baseband_carrier_prev;
-    
+    // Scratch for unfolding filterbank frames
+    std::unique_ptr<std::complex<float>[], ComplexDeleter>
+        audio_complex_extended;
+
+    // Demodulated audio of AM and FM, SSB is finished in its IFFT row
     std::vector<float, AlignedAllocator<float>> audio_real;
     std::vector<float, AlignedAllocator<float>> audio_real_prev;
+    std::vector<float, AlignedAllocator<float>> audio_real_extended;
     std::vector<int32_t, AlignedAllocator<int32_t>> audio_real_int16;
 
-    // IFFT plans for demodulation
-    fftwf_plan p_complex;
-    fftwf_plan p_complex_carrier;
-    fftwf_plan p_real;
-
     // For DC offset removal and AGC implementatino
     DCBlocker<float> dc;
     AGC agc;
@@ -1,5 +1,9 @@
 #include "spectrumserver.h"
+#include "plancache.h"
 #include "samplereader.h"
+#include "wisdom.h"
+#include "utils/dsp.h"
+#include "utils/threadpool.h"
 
 #include <cstdio>
 #include <iostream>
@@ -16,9 +20,17 @@
 
 broadcast_server::broadcast_server(
     std::unique_ptr<SampleConverterBase> reader, toml::parse_result &config)
-    : reader{std::move(reader)}, frame_num{0} {
+    : reader{std::move(reader)}, fast_frame_num{0}, frame_num{0} {
 
     server_threads = config["server"]["threads"].value_or(1);
+    audio_batch = std::max(1, config["server"]["audio_batch"].value_or(16));
+    fft_engines = std::max(1, config["input"]["fft_engines"].value_or(1));
+    // Every engine needs the same number of output frames
+    fft_frames = std::max(1, config["input"]["fft_frames"].value_or(3));
+    fft_frames = (fft_frames + fft_engines - 1) / fft_engines * fft_engines;
+    for (int i = 0; i < fft_frames; i++) {
+        output_frames.emplace_back();
+    }
 
     // Read in configuration
     std::optional<int> sps_config = config["input"]["sps"].value<int>();
@@ -36,7 +48,10 @@ broadcast_server::broadcast_server(
     std::string accelerator_str =
         config["input"]["accelerator"].value_or("none");
 
-    fft_threads = config["input"]["fft_threads"].value_or(1);
+    // FFTW splits the transform this many ways over the DSP pool
+    fft_threads = config["input"]["fft_threads"].value_or(dsp_pool()->size());
+    // Need at least one slot being read into and one being converted
+    ring_slots = std::max(2, config["input"]["ring_slots"].value_or(8));
 
     std::optional<std::string> signal_type =
         config["input"]["signal"].value<std::string>();
@@ -52,6 +67,51 @@ broadcast_server::broadcast_server(
     is_real = signal_type_str == "real";
 
     fft_size = config["input"]["fft_size"].value_or(131072);
+    // Overlap between consecutive frames, in quarters of a frame so the audio
+    // hop stays a whole number of samples
+    double fft_overlap = config["input"]["fft_overlap"].value_or(0.5);
+    int overlap_quarters = (int)round(fft_overlap * 4);
+    if (overlap_quarters < 0 || overlap_quarters > 3 ||
+        overlap_quarters != fft_overlap * 4) {
+        throw "Invalid FFT overlap, specify either 0, 0.25, 0.5 or 0.75";
+    }
+    fft_hop = fft_size / 4 * (4 - overlap_quarters);
+    std::string fft_window_str = boost::algorithm::to_lower_copy(
+        config["input"]["fft_window"].value_or(std::string("hann")));
+    if (fft_window_str == "hann") {
+        fft_window_type = WINDOW_HANN;
+    } else if (fft_window_str == "blackman_harris") {
+        fft_window_type = WINDOW_BLACKMAN_HARRIS;
+    } else {
+        throw "Invalid FFT window, specify either hann or blackman_harris";
+    }
+    // Optional small FFT over the same input, feeding a low latency waterfall
+    // tier while the large FFT keeps the audio and the fine zoom levels
+    fast_fft_size = config["input"]["fast_fft_size"].value_or(0);
+    fast_waterfall_fps =
+        std::max(1, config["input"]["fast_waterfall_fps"].value_or(30));
+    if (fast_fft_size) {
+        int ratio = fast_fft_size > 0 ? fft_size / fast_fft_size : 0;
+        if (ratio < 2 || ratio * fast_fft_size != fft_size ||
+            (ratio & (ratio - 1)) || fast_fft_size % 4) {
+            throw "Invalid fast FFT size, it must be fft_size divided by a "
+                  "power of two";
+        }
+    }
+    fast_hop = fast_fft_size / 4 * (4 - overlap_quarters);
+    fast_skip = fast_fft_size ? std::max(1, (int)round((double)sps / fast_hop /
+                                                       fast_waterfall_fps))
+                              : 1;
+    std::string frontend_str = boost::algorithm::to_lower_copy(
+        config["input"]["frontend"].value_or(std::string("fft")));
+    if (frontend_str == "fft") {
+        polyphase_taps = 1;
+    } else if (frontend_str == "polyphase") {
+        polyphase_taps =
+            std::max(2, config["input"]["polyphase_taps"].value_or(4));
+    } else {
+        throw "Invalid frontend, specify either fft or polyphase";
+    }
     audio_max_sps = config["input"]["audio_sps"].value_or(12000);
     min_waterfall_fft = config["input"]["waterfall_size"].value_or(1024);
     brightness_offset = config["input"]["brightness_offset"].value_or(0);
@@ -150,11 +210,24 @@ broadcast_server::broadcast_server(
 
     audio_max_fft_size = ceil((double)audio_max_sps * fft_size / sps / 4.) * 4;
 
+
+    // Reuse FFTW plans measured on previous runs or by --tune
+    fftw_wisdom_set_directory(
+        config["input"]["fftw_wisdom"].value_or("wisdom"));
+    // AudioClients share these plans, so connecting never plans
+    for (int howmany = 1; howmany <= audio_batch; howmany *= 2) {
+        fftw_plan_cache_prepare(PLAN_C2C_BACKWARD, audio_max_fft_size,
+                                howmany);
+        fftw_plan_cache_prepare(PLAN_C2R, audio_max_fft_size, howmany);
+    }
+
     if (waterfall_compression_str == "zstd") {
         waterfall_compression = WATERFALL_ZSTD;
     } else if (waterfall_compression_str == "av1") {
 #ifdef HAS_LIBAOM
         waterfall_compression = WATERFALL_AV1;
+        av1_streams = std::make_unique<AV1Streams>(
+            config["server"]["av1_threads"].value_or(0));
 #else
         throw "AV1 support not compiled in";
 #endif
@@ -182,6 +255,43 @@ broadcast_server::broadcast_server(
         std::cout << "Using MKL" << std::endl;
     }
 
+    // Frame parallel FFT only has independent engines on the CPU
+    if (fft_engines > 1 && accelerator != CPU_FFTW) {
+        std::cout << "Multiple FFT engines need the CPU FFT, using one"
+                  << std::endl;
+        fft_engines = 1;
+    }
+    // Each engine gets an even share of the FFT threads
+    fft_threads = std::max(1, fft_threads / fft_engines);
+    if (polyphase_taps > 1 && accelerator != CPU_FFTW) {
+        std::cout << "The polyphase frontend needs the CPU FFT, using a "
+                  << "plain FFT" << std::endl;
+        polyphase_taps = 1;
+    }
+
+    // The audio is rebuilt with the same window and overlap as the FFT
+    audio_ola.fft_size = fft_size;
+    audio_ola.fft_hop = fft_hop;
+    audio_ola.taps = polyphase_taps;
+    float ripple =
+        build_audio_overlap(audio_ola, fft_window_type, audio_max_fft_size);
+    if (polyphase_taps > 1 && overlap_quarters == 0) {
+        std::cout << "The polyphase frontend needs overlapping frames for "
+                  << "clean audio" << std::endl;
+    }
+    // Past the cap parts of every frame are lost, at 0% overlap with a
+    // plain FFT that is the case for every window
+    if (ripple >= OVERLAP_ADD_MAX_GAIN) {
+        throw "The FFT window does not overlap-add at this fft_overlap, the "
+              "audio cannot be rebuilt. Raise fft_overlap";
+    }
+    if (ripple > 1.01f) {
+        std::cout << "The window does not overlap-add evenly at "
+                  << fft_overlap * 100 << "% overlap, the audio is "
+                  << "corrected by up to " << 20 * log10(ripple) << " dB"
+                  << std::endl;
+    }
+
     // Calculate number of downsampling levels for fft
     downsample_levels = 0;
     for (int cur_fft = fft_result_size; cur_fft >= min_waterfall_fft;
@@ -189,29 +299,200 @@ broadcast_server::broadcast_server(
         downsample_levels++;
     }
 
+    // The fast tier's levels are numbered after the main ones and the zoomed
+    // clients, its full resolution matches main level fast_shift
+    fast_levels = 0;
+    fast_shift = 0;
+    if (fast_fft_size) {
+        fast_result_size = is_real ? fast_fft_size / 2 : fast_fft_size;
+        for (int cur_fft = fast_result_size; cur_fft >= min_waterfall_fft;
+             cur_fft /= 2) {
+            fast_levels++;
+        }
+        if (!fast_levels) {
+            throw "Fast FFT size is smaller than the waterfall size";
+        }
+        fast_shift = (int)round(log2(fft_size / fast_fft_size));
+        fast_fft = std::make_unique<FFTW>(fast_fft_size, 1, fast_levels,
+                                          brightness_offset, fft_window_type);
+        fast_fft->set_output_additional_size(0);
+        fast_fft->set_hop(fast_hop);
+        for (int i = 0; i < fft_frames; i++) {
+            fast_output_frames.emplace_back();
+        }
+        std::cout << "Fast waterfall tier with a " << fast_fft_size
+                  << " point FFT" << std::endl;
+    }
+
     if (accelerator == GPU_cuFFT) {
 #ifdef CUFFT
-        fft = std::make_unique<cuFFT>(fft_size, fft_threads, downsample_levels, brightness_offset);
+        fft = std::make_unique<cuFFT>(fft_size, fft_threads,
+                                      downsample_levels, brightness_offset,
+                                      fft_window_type);
 #else
         throw "CUDA support is not compiled in";
 #endif
     } else if (accelerator == GPU_clFFT) {
 #ifdef CLFFT
-        fft = std::make_unique<clFFT>(fft_size, fft_threads, downsample_levels, brightness_offset);
+        fft = std::make_unique<clFFT>(fft_size, fft_threads,
+                                      downsample_levels, brightness_offset,
+                                      fft_window_type);
 #else
         throw "OpenCL support is not compiled in";
 #endif
     } else if (accelerator == CPU_mklFFT) {
 #ifdef MKL
-        fft =
-            std::make_unique<mklFFT>(fft_size, fft_threads, downsample_levels, brightness_offset);
+        fft = std::make_unique<mklFFT>(fft_size, fft_threads,
+                                       downsample_levels, brightness_offset,
+                                       fft_window_type);
 #else
         throw "MKL support is not compiled in";
 #endif
     } else {
-        fft = std::make_unique<FFTW>(fft_size, fft_threads, downsample_levels, brightness_offset);
+        fft = make_fftw_engine();
+        if (polyphase_taps > 1) {
+            std::cout << "Using a " << polyphase_taps
+                      << " tap polyphase filterbank" << std::endl;
+        }
     }
     fft->set_output_additional_size(audio_max_fft_size);
+    fft->set_hop(fft_hop);
+
+    // Waterfall clients zoomed in past the finest level
+    zoom_config.fft_size = fft_size;
+    zoom_config.fft_hop = fft_hop;
+    zoom_config.is_real = is_real;
+    zoom_config.taps = polyphase_taps;
+    zoom_config.window = fft_window_type;
+    zoom_config.power_offset = (int)round(log2(fft_size)) + brightness_offset;
+    zoom_config.max_zoom =
+        std::max(1, config["input"]["waterfall_max_zoom"].value_or(16));
+    // Like the audio, zooming in never plans
+    WaterfallZoom::for_each_plan(
+        zoom_config, min_waterfall_fft, [](fftw_plan_kind kind, int size) {
+            fftw_plan_cache_prepare(kind, size);
+        });
+
+    layout.min_waterfall_fft = min_waterfall_fft;
+    layout.fft_result_size = fft_result_size;
+    layout.main_levels = downsample_levels;
+    layout.fast_shift = fast_shift;
+    layout.tile_size =
+        std::max(0, config["input"]["waterfall_tile_size"].value_or(256));
+    std::string dictionary_file =
+        config["input"]["waterfall_dictionary"].value_or("");
+    if (dictionary_file.length() && waterfall_compression == WATERFALL_ZSTD) {
+        waterfall_dictionary = std::make_unique<WaterfallDictionary>();
+        if (waterfall_dictionary->load(dictionary_file)) {
+            std::cout << "Waterfall dictionary " << waterfall_dictionary->id()
+                      << " loaded from " << dictionary_file << std::endl;
+        } else {
+            std::cout << "Cannot load the waterfall dictionary "
+                      << dictionary_file << ", sending without it"
+                      << std::endl;
+            waterfall_dictionary.reset();
+        }
+    }
+    if (layout.tile_size && waterfall_compression != WATERFALL_ZSTD) {
+        // The AV1 encoder codes whole rows across frames
+        std::cout << "Waterfall tiles are only used with zstd compression"
+                  << std::endl;
+        layout.tile_size = 0;
+    }
+
+    // Target fps is 10, scaled by the number of frames each input block
+    // appears in
+    waterfall_skip = std::max(
+        1, (int)floor(((float)sps / fft_size) / 10.) * fft_size / fft_hop);
+
+    // Rows of the coarsest levels are kept as the shared tiles they were
+    // sent as
+    waterfall_history_seconds =
+        std::max(0, config["input"]["waterfall_history"].value_or(10));
+    int history_levels = std::clamp(
+        config["input"]["waterfall_history_levels"].value_or(4), 0,
+        downsample_levels);
+    if (waterfall_history_seconds && history_levels) {
+        if (!layout.tile_size) {
+            std::cout << "The waterfall history needs the waterfall tiles"
+                      << std::endl;
+        } else {
+            int rows = (int)ceil((double)waterfall_history_seconds * sps /
+                                 fft_hop / waterfall_skip);
+            waterfall_history = std::make_unique<WaterfallHistory>(
+                rows, downsample_levels - history_levels, history_levels,
+                fft_result_size, layout.tile_size);
+        }
+    }
+    // The coarsest levels are also archived to disk, at a slower rate
+    std::string archive_directory =
+        config["input"]["waterfall_archive"].value_or("");
+    if (!archive_directory.empty()) {
+        int archive_levels = std::clamp(
+            config["input"]["waterfall_archive_levels"].value_or(2), 1,
+            downsample_levels);
+        int archive_interval = std::max(
+            0, (int)(config["input"]["waterfall_archive_interval"].value_or(
+                         1.0) *
+                     1000));
+        size_t segment_mb = std::max(
+            1, config["input"]["waterfall_archive_segment_mb"].value_or(64));
+        int64_t retention_hours =
+            std::max(1, config["input"]["waterfall_archive_hours"].value_or(72));
+        waterfall_archive = std::make_unique<WaterfallArchive>(
+            archive_directory, downsample_levels - archive_levels,
+            archive_levels, fft_result_size, archive_interval,
+            segment_mb << 20, retention_hours * 3600 * 1000);
+    }
+
+    // Long term statistics of a coarse level, by default the one closest
+    // to 1024 bins
+    if (config["input"]["statistics"].value_or(false)) {
+        int statistics_level = config["input"]["statistics_level"].value_or(-1);
+        if (statistics_level < 0) {
+            statistics_level = (int)log2(std::max(1, fft_result_size / 1024));
+        }
+        statistics_level =
+            std::clamp(statistics_level, 0, downsample_levels - 1);
+        spectrum_statistics = std::make_unique<SpectrumStatistics>(
+            statistics_level, fft_result_size,
+            (double)sps / fft_hop / waterfall_skip,
+            config["input"]["statistics_halflife"].value_or(24.0),
+            config["input"]["statistics_days"].value_or(7.0),
+            config["input"]["statistics_threshold"].value_or(10));
+        statistics_file = config["input"]["statistics_file"].value_or("");
+        statistics_save_interval = std::max(
+            1, config["input"]["statistics_save_interval"].value_or(600));
+        statistics_save_timer = 0;
+        if (!statistics_file.empty() &&
+            spectrum_statistics->load(statistics_file)) {
+            std::cout << "Loaded the statistics from " << statistics_file
+                      << std::endl;
+        }
+    }
+
+    // Active signals found on the level closest to 8192 bins by default
+    if (config["input"]["detector"].value_or(false)) {
+        int detector_level = config["input"]["detector_level"].value_or(-1);
+        if (detector_level < 0) {
+            detector_level = (int)log2(std::max(1, fft_result_size / 8192));
+        }
+        detector_level = std::clamp(detector_level, 0, downsample_levels - 1);
+        signal_detector = std::make_unique<SignalDetector>(
+            detector_level, fft_result_size,
+            (double)sps / fft_hop / waterfall_skip,
+            config["input"]["detector_threshold"].value_or(8),
+            config["input"]["detector_hold"].value_or(10.0),
+            std::max(1, config["input"]["detector_max_signals"].value_or(256)));
+    }
+
+    shared_waterfall.dictionary = waterfall_dictionary.get();
+#ifdef HAS_LIBAOM
+    shared_waterfall.av1_streams = av1_streams.get();
+#else
+    shared_waterfall.av1_streams = nullptr;
+#endif
+    shared_waterfall.history = waterfall_history.get();
 
     // Initialize the websocket server
     m_server.init_asio();
@@ -227,8 +508,8 @@ broadcast_server::broadcast_server(
         std::bind(&broadcast_server::on_http, this, std::placeholders::_1));
 
     // Init data structures
-    waterfall_slices.resize(downsample_levels);
-    waterfall_slice_mtx.resize(downsample_levels);
+    waterfall_slices.resize(downsample_levels + 1 + fast_levels);
+    waterfall_slice_mtx.resize(downsample_levels + 1 + fast_levels);
 }
 
 void broadcast_server::run(uint16_t port) {
@@ -261,10 +542,17 @@ void broadcast_server::run(uint16_t port) {
     }
     registration_thread.join();
     fft_thread.join();
+    if (spectrum_statistics && !statistics_file.empty()) {
+        spectrum_statistics->save(statistics_file);
+    }
 }
 void broadcast_server::stop() {
     running = false;
     fft_processed.notify_all();
+    // The io threads may stop before finishing the frames
+    for (auto &frame : output_frames) {
+        frame.done.close();
+    }
 
     m_server.stop_listening();
     for (auto &[slice, data] : signal_slices) {
@@ -296,9 +584,18 @@ void broadcast_server::stop() {
 
 broadcast_server *g_signal;
 
+// FFTW hands its parallel sections to the DSP pool instead of its own threads
+static void fftw_pool_callback(void *(*work)(char *), char *jobdata,
+                               size_t elsize, int njobs, void *data) {
+    static_cast<DSPThreadPool *>(data)->parallel_for(
+        njobs, [&](size_t i) { work(jobdata + elsize * i); });
+}
+
 int main(int argc, char **argv) {
     // Parse the options
     std::string config_file;
+    unsigned tune_flags = 0;
+    std::string dictionary_file;
     for (int i = 1; i < argc; i++) {
         if ((std::string(argv[i]) == "-c" ||
              std::string(argv[i]) == "--config") &&
@@ -306,11 +603,28 @@ int main(int argc, char **argv) {
             config_file = argv[i + 1];
             i++;
         }
+        if (std::string(argv[i]) == "--tune") {
+            tune_flags = FFTW_PATIENT;
+            if (i + 1 < argc && std::string(argv[i + 1]) == "exhaustive") {
+                tune_flags = FFTW_EXHAUSTIVE;
+                i++;
+            } else if (i + 1 < argc && std::string(argv[i + 1]) == "patient") {
+                i++;
+            }
+        }
+        if (std::string(argv[i]) == "--train-dictionary" && i + 1 < argc) {
+            dictionary_file = argv[i + 1];
+            i++;
+        }
         if (std::string(argv[i]) == "-h" || std::string(argv[i]) == "--help") {
             std::cout
                 << "Options:\n"
                    "--help                             produce help message\n"
-                   "-c [ --config ] arg (=config.toml) config file\n";
+                   "-c [ --config ] arg (=config.toml) config file\n"
+                   "--tune [patient|exhaustive]        measure the FFTs once, "
+                   "store the wisdom and exit\n"
+                   "--train-dictionary arg             train the waterfall "
+                   "dictionary on the input and exit\n";
             return 0;
         }
     }
@@ -331,11 +645,18 @@ int main(int argc, char **argv) {
         config["input"]["driver"]["format"].value_or("f32");
     boost::algorithm::to_lower(input_format);
 
-    // Initialise FFT threads if requested for multithreaded
-    int fft_threads = config["input"]["fft_threads"].value_or(1);
-    if (fft_threads > 1) {
-        fftwf_init_threads();
+    // Every DSP thread comes from the one pool, FFTW included
+    std::vector<int> dsp_cpus;
+    if (auto cpus = config["server"]["dsp_cpus"].as_array()) {
+        for (auto &cpu : *cpus) {
+            dsp_cpus.push_back(cpu.value_or(-1));
+        }
     }
+    dsp_pool_init(config["server"]["dsp_threads"].value_or(0), dsp_cpus);
+    std::cout << "DSP thread pool has " << dsp_pool()->size() << " threads"
+              << std::endl;
+    fftwf_init_threads();
+    fftwf_threads_set_callback(fftw_pool_callback, dsp_pool());
 
     // Set input to binary
     freopen(NULL, "rb", stdin);
@@ -362,9 +683,18 @@ int main(int argc, char **argv) {
         std::cout << "Unknown input format: " << input_format << std::endl;
         return 1;
     }
+    std::cout << "Sample conversion uses " << convert_isa_name() << std::endl;
 
     int port = config["server"]["port"].value_or(9002);
     broadcast_server server(std::move(driver), config);
+    if (tune_flags) {
+        server.tune_fft(tune_flags);
+        return 0;
+    }
+    if (dictionary_file.length()) {
+        server.train_waterfall_dictionary(dictionary_file);
+        return 0;
+    }
     g_signal = &server;
     std::signal(SIGINT, [](int) { g_signal->stop(); });
     server.run(port);
@@ -10,15 +10,40 @@
 
 #include <toml++/toml.h>
 
+#include "archive.h"
 #include "client.h"
+#include "detector.h"
 #include "fft.h"
 #include "samplereader.h"
 #include "signal.h"
+#include "statistics.h"
+#include "utils/latch.h"
 #include "waterfall.h"
 #include "websocket.h"
 
 using websocketpp::connection_hdl;
 
+// One FFT output and the work of the clients still reading it
+struct FFTFrame {
+    size_t frame_num;
+    std::complex<float> *fft_buffer;
+    int8_t *fft_power_quantized;
+    // Sent to the waterfall clients, and the waterfall levels built for it,
+    // bit k for level k
+    bool waterfall;
+    uint32_t pyramid_mask;
+    // Reused every time the frame comes around
+    std::vector<audio_batch_entry> signal_work;
+    std::vector<std::pair<std::shared_ptr<WaterfallClient>, int8_t *>>
+        waterfall_work;
+    // Compressed waterfall tiles shared by the clients of this frame
+    WaterfallTiles tiles;
+    // Zoomed waterfall clients and whether they are sent a row
+    std::vector<std::pair<std::shared_ptr<WaterfallClient>, bool>> zoom_work;
+    // Released once every io thread is done with its chunk of the frame
+    CountdownLatch done;
+};
+
 typedef std::set<connection_hdl, std::owner_less<connection_hdl>>
     event_con_list;
 
@@ -51,18 +76,32 @@ class broadcast_server : public PacketSender {
 
     // Main FFT loop to process input samples
     void fft_task();
+    // Creates a CPU engine for the configured front end
+    std::unique_ptr<FFT> make_fftw_engine();
+    // Runs the fast FFT over one input block and sends its waterfall rows
+    void fast_fft_task(const void *raw);
+    // Plans every FFT with the given rigor and stores the wisdom
+    void tune_fft(unsigned flags);
+    // Trains the waterfall zstd dictionary on delta coded rows of the input
+    void train_waterfall_dictionary(const std::string &filename);
 
     // Signal functions, audio demodulation
     void on_open_signal(connection_hdl hdl, conn_type signal_type);
     void on_close_signal(connection_hdl hdl, std::shared_ptr<AudioClient> &d);
-    std::vector<std::future<void>> signal_loop();
+    void signal_loop(FFTFrame &frame);
 
     // Waterfall functions
     void on_open_waterfall(connection_hdl hdl);
     void on_close_waterfall(connection_hdl hdl,
                             std::shared_ptr<WaterfallClient> &d);
-    std::vector<std::future<void>> waterfall_loop(int8_t *fft_power_quantized);
+    // Sends the frame's levels, stored from first_level on in the slices
+    void waterfall_loop(FFTFrame &frame, int first_level, int result_size);
+    // Waterfall levels of the tier that have a client, bit k for level k
+    uint32_t waterfall_levels_needed(int first_level, int num_levels);
+    // Feeds every frame to the clients zoomed in past the finest level
+    void zoom_loop(FFTFrame &frame);
 
+    virtual void send_binary_packet(connection_hdl hdl, packet_buffers_t bufs);
     virtual void send_binary_packet(
         connection_hdl hdl,
         const std::initializer_list<std::pair<const void *, size_t>> &bufs);
@@ -73,6 +112,7 @@ class broadcast_server : public PacketSender {
                      const std::initializer_list<std::string> &data);
     virtual void send_text_packet(connection_hdl hdl, const std::string &data);
     virtual std::string ip_from_hdl(connection_hdl hdl);
+    virtual size_t get_buffered_amount(connection_hdl hdl);
     virtual void log(connection_hdl hdl, const std::string &msg);
 
     virtual waterfall_slices_t &get_waterfall_slices();
@@ -104,6 +144,31 @@ class broadcast_server : public PacketSender {
     int audio_fft_size;
     int audio_max_fft_size;
     int fft_threads;
+    int fft_engines;
+    // New input samples in each frame, the rest overlaps the previous one
+    int fft_hop;
+    fft_window fft_window_type;
+    // Polyphase filterbank taps, 1 is the plain windowed FFT
+    int polyphase_taps;
+    audio_overlap audio_ola;
+    waterfall_zoom_config zoom_config;
+    waterfall_layout layout;
+    // Main FFT frames between waterfall rows
+    int waterfall_skip;
+    // Fast waterfall tier, disabled when the size is 0
+    int fast_fft_size;
+    int fast_hop;
+    int fast_result_size;
+    int fast_levels;
+    // Main waterfall level with the same resolution as the fast FFT
+    int fast_shift;
+    int fast_waterfall_fps;
+    // Waterfall rows are sent every fast_skip fast FFTs
+    int fast_skip;
+    size_t fast_frame_num;
+    int ring_slots;
+    int audio_batch;
+    int fft_frames;
     std::string input_format;
     std::string m_docroot;
     bool running;
@@ -112,6 +177,26 @@ class broadcast_server : public PacketSender {
     int frame_num;
     waterfall_compressor waterfall_compression;
     std::string waterfall_compression_str;
+    // Offered to zstd waterfall clients, null if none is configured
+    std::unique_ptr<WaterfallDictionary> waterfall_dictionary;
+#ifdef HAS_LIBAOM
+    // Encodes shared by the AV1 waterfall clients with the same view
+    std::unique_ptr<AV1Streams> av1_streams;
+#endif
+    // Recent rows of the main tier, null if disabled
+    std::unique_ptr<WaterfallHistory> waterfall_history;
+    int waterfall_history_seconds;
+    // Coarse rows kept on disk for days, null if disabled
+    std::unique_ptr<WaterfallArchive> waterfall_archive;
+    // Per bin occupancy of a coarse level, null if disabled
+    std::unique_ptr<SpectrumStatistics> spectrum_statistics;
+    std::string statistics_file;
+    // Seconds between snapshots and since the last one
+    int statistics_save_interval;
+    int statistics_save_timer;
+    // Active signals sent to the events connections, null if disabled
+    std::unique_ptr<SignalDetector> signal_detector;
+    waterfall_shared shared_waterfall;
     audio_compressor audio_compression;
     std::string audio_compression_str;
 
@@ -178,8 +263,12 @@ class broadcast_server : public PacketSender {
         signal_changes;
     std::mutex signal_changes_mtx;
 
-    // FFT output to send to clients
-    std::complex<float> *fft_buffer;
+    // Ring of FFT outputs, clients read older frames while the FFT computes
+    // the next one
+    std::deque<FFTFrame> output_frames;
+    // Only touched by the fast tier task, one runs at a time
+    std::unique_ptr<FFT> fast_fft;
+    std::deque<FFTFrame> fast_output_frames;
     // std::shared_mutex fft_mutex;
     std::condition_variable_any fft_processed;
 
@@ -0,0 +1,213 @@
+#include "statistics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+// 2 dB buckets covering the int8_t range
+static constexpr int HISTOGRAM_BUCKETS = 128;
+// The noise floor of a row is its 20th percentile
+static constexpr int NOISE_FLOOR_PERCENT = 20;
+
+static constexpr uint32_t SNAPSHOT_MAGIC = 0x53545350; // "PSTS"
+static constexpr uint32_t SNAPSHOT_VERSION = 2;
+
+struct statistics_snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t level;
+    int32_t bins;
+    uint64_t frames;
+    double weight;
+    double total;
+};
+
+SpectrumStatistics::SpectrumStatistics(int level, int size,
+                                       double rows_per_second,
+                                       double halflife_hours,
+                                       double halflife_days, int threshold)
+    : level{level}, bins{size >> level}, offset{0}, threshold{threshold},
+      frames{0},
+      mean(bins), max(bins), duty(bins), hourly(24 * bins),
+      histogram(bins * HISTOGRAM_BUCKETS), weight{1}, total{0},
+      row_histogram(256) {
+    for (int i = 0; i < level; i++) {
+        offset += size >> i;
+    }
+    double rows_per_halflife = halflife_hours * 3600 * rows_per_second;
+    decay = std::pow(0.5, 1. / std::max(1., rows_per_halflife));
+    // Each hour of the day only gets an hour of rows per day
+    double hourly_rows_per_halflife = halflife_days * 3600 * rows_per_second;
+    hourly_decay = std::pow(0.5, 1. / std::max(1., hourly_rows_per_halflife));
+}
+
+void SpectrumStatistics::update(const int8_t *pyramid, uint32_t pyramid_mask) {
+    if (!(pyramid_mask >> level & 1)) {
+        return;
+    }
+    std::unique_lock lk(mtx, std::try_to_lock);
+    if (!lk.owns_lock()) {
+        return;
+    }
+    const int8_t *row = pyramid + offset;
+
+    // Noise floor from a histogram of the row instead of sorting it
+    std::fill(row_histogram.begin(), row_histogram.end(), 0);
+    for (int i = 0; i < bins; i++) {
+        row_histogram[row[i] + 128]++;
+    }
+    int floor = 0;
+    for (int count = 0, target = bins * NOISE_FLOOR_PERCENT / 100;
+         floor < 255 && count + (int)row_histogram[floor] <= target; floor++) {
+        count += row_histogram[floor];
+    }
+    int busy_level = floor - 128 + threshold;
+
+    int hour = std::chrono::duration_cast<std::chrono::hours>(
+                   std::chrono::system_clock::now().time_since_epoch())
+                   .count() %
+               24;
+    double *hourly_row = hourly.data() + hour * bins;
+
+    if (frames == 0) {
+        for (int i = 0; i < bins; i++) {
+            mean[i] = row[i];
+            max[i] = row[i];
+        }
+    }
+    double alpha = 1 - decay;
+    double hourly_alpha = 1 - hourly_decay;
+    for (int i = 0; i < bins; i++) {
+        double value = row[i];
+        double busy = row[i] > busy_level;
+        mean[i] += alpha * (value - mean[i]);
+        // Peaks fall back towards the mean at the same rate
+        max[i] = std::max(value, max[i] - alpha * (max[i] - mean[i]));
+        duty[i] += alpha * (busy - duty[i]);
+        hourly_row[i] += hourly_alpha * (busy - hourly_row[i]);
+    }
+
+    weight /= decay;
+    total += weight;
+    double *bucket = histogram.data();
+    for (int i = 0; i < bins; i++, bucket += HISTOGRAM_BUCKETS) {
+        bucket[(row[i] + 128) >> 1] += weight;
+    }
+    if (weight > 1e100) {
+        renormalize();
+    }
+    frames++;
+}
+
+void SpectrumStatistics::renormalize() {
+    double scale = 1 / weight;
+    for (auto &count : histogram) {
+        count *= scale;
+    }
+    total *= scale;
+    weight = 1;
+}
+
+std::string SpectrumStatistics::get(const std::vector<int> &percentiles) {
+    std::string body;
+    body.resize(sizeof(statistics_header) +
+                bins * (2 + percentiles.size() + 1 + 24));
+    statistics_header header;
+    header.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::system_clock::now().time_since_epoch())
+                         .count();
+    header.level = level;
+    header.bins = bins;
+    header.threshold = threshold;
+    header.percentiles = percentiles.size();
+
+    std::scoped_lock lk(mtx);
+    header.frames = frames;
+    memcpy(body.data(), &header, sizeof(header));
+    int8_t *out = (int8_t *)body.data() + sizeof(header);
+    for (int i = 0; i < bins; i++) {
+        *out++ = std::lround(mean[i]);
+    }
+    for (int i = 0; i < bins; i++) {
+        *out++ = std::lround(max[i]);
+    }
+    for (int percentile : percentiles) {
+        double target = total * std::clamp(percentile, 0, 100) / 100;
+        const double *bucket = histogram.data();
+        for (int i = 0; i < bins; i++, bucket += HISTOGRAM_BUCKETS) {
+            int b = 0;
+            for (double count = bucket[0];
+                 b < HISTOGRAM_BUCKETS - 1 && count < target;) {
+                count += bucket[++b];
+            }
+            // Middle of the bucket
+            *out++ = b * 2 - 127;
+        }
+    }
+    uint8_t *duty_out = (uint8_t *)out;
+    for (int i = 0; i < bins; i++) {
+        *duty_out++ = std::lround(duty[i] * 255);
+    }
+    for (auto value : hourly) {
+        *duty_out++ = std::lround(value * 255);
+    }
+    return body;
+}
+
+bool SpectrumStatistics::save(const std::string &filename) {
+    std::string temporary = filename + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::out | std::ios::binary |
+                                          std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        std::scoped_lock lk(mtx);
+        statistics_snapshot_header header = {
+            SNAPSHOT_MAGIC, SNAPSHOT_VERSION, level, bins,
+            frames,         weight,           total};
+        file.write((const char *)&header, sizeof(header));
+        for (auto *values : {&mean, &max, &duty, &hourly, &histogram}) {
+            file.write((const char *)values->data(),
+                       values->size() * sizeof(double));
+        }
+        if (!file) {
+            return false;
+        }
+    }
+    // Replaces the previous snapshot only once the new one is complete
+    std::error_code ec;
+    std::filesystem::rename(temporary, filename, ec);
+    return !ec;
+}
+
+bool SpectrumStatistics::load(const std::string &filename) {
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    statistics_snapshot_header header;
+    if (!file.read((char *)&header, sizeof(header)) ||
+        header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+        header.level != level || header.bins != bins) {
+        return false;
+    }
+    std::scoped_lock lk(mtx);
+    for (auto *values : {&mean, &max, &duty, &hourly, &histogram}) {
+        if (!file.read((char *)values->data(),
+                       values->size() * sizeof(double))) {
+            // Starts over rather than from a partial snapshot
+            for (auto *reset : {&mean, &max, &duty, &hourly, &histogram}) {
+                std::fill(reset->begin(), reset->end(), 0.);
+            }
+            frames = 0;
+            weight = 1;
+            total = 0;
+            return false;
+        }
+    }
+    frames = header.frames;
+    weight = header.weight;
+    total = header.total;
+    return true;
+}
@@ -0,0 +1,86 @@
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Long term statistics of every bin of one waterfall level, so operators can
+// see which channels are busy and when without recording the waterfall
+// Values are in the quantized dB of the waterfall and decay exponentially,
+// each update is O(bins) and nothing is allocated after construction
+
+// Starts the /statistics response, followed by the int8_t mean and max, an
+// int8_t row per requested percentile, the uint8_t duty cycle scaled to 255
+// and 24 uint8_t rows of the duty cycle by UTC hour, each bins long
+struct statistics_header {
+    uint64_t frames;
+    // Milliseconds since the epoch
+    int64_t time_ms;
+    int32_t level;
+    int32_t bins;
+    // dB above the noise floor that counts as busy
+    int32_t threshold;
+    uint32_t percentiles;
+};
+static_assert(sizeof(statistics_header) == 32);
+
+class SpectrumStatistics {
+  public:
+    // Tracks a level of a pyramid whose level 0 is size wide, updated
+    // rows_per_second times a second
+    // The statistics have a half-life of halflife_hours, the duty cycle of
+    // each hour of the day one of halflife_days of that hour
+    SpectrumStatistics(int level, int size, double rows_per_second,
+                       double halflife_hours, double halflife_days,
+                       int threshold);
+    SpectrumStatistics(const SpectrumStatistics &) = delete;
+    SpectrumStatistics &operator=(const SpectrumStatistics &) = delete;
+
+    int get_level() const { return level; }
+    // Adds the row of the level, skipped rather than waited for if the
+    // statistics are being read
+    // Called from the FFT thread only
+    void update(const int8_t *pyramid, uint32_t pyramid_mask);
+    // Percentiles are 0 to 100
+    std::string get(const std::vector<int> &percentiles);
+
+    // Snapshots survive restarts as long as the level is the same
+    bool save(const std::string &filename);
+    bool load(const std::string &filename);
+
+  protected:
+    // Rescales the histograms before the weights grow too large
+    void renormalize();
+
+    int level;
+    int bins;
+    // Of the level in the pyramid
+    size_t offset;
+    int threshold;
+    // Weight of the old value per update, overall and for the hourly rows
+    // With half-lives of hours the weight of a new value is around 1e-6,
+    // too small a step for a float holding -100 dB, so all of the running
+    // values are doubles
+    double decay;
+    double hourly_decay;
+
+    std::mutex mtx;
+    uint64_t frames;
+    std::vector<double> mean;
+    std::vector<double> max;
+    std::vector<double> duty;
+    // 24 rows of bins
+    std::vector<double> hourly;
+    // HISTOGRAM_BUCKETS per bin. Instead of decaying every bucket, each new
+    // value is added with a weight that grows by 1 / decay per update
+    std::vector<double> histogram;
+    double weight;
+    double total;
+    // Values of the current row, for its noise floor
+    std::vector<uint32_t> row_histogram;
+};
+
+#endif
@@ -0,0 +1,293 @@
+#include "convert.h"
+
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86
+#include <immintrin.h>
+#endif
+
+enum convert_isa { ISA_GENERIC, ISA_SSE2, ISA_AVX2, ISA_AVX512 };
+
+static convert_isa detect_isa() {
+#ifdef CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return ISA_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return ISA_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return ISA_SSE2;
+    }
+#endif
+    return ISA_GENERIC;
+}
+
+const char *convert_isa_name() {
+    switch (detect_isa()) {
+    case ISA_AVX512:
+        return "AVX-512";
+    case ISA_AVX2:
+        return "AVX2";
+    case ISA_SSE2:
+        return "SSE2";
+    default:
+        return "generic";
+    }
+}
+
+// Integers are scaled by the magnitude of their most negative value
+template <typename T> static constexpr float sample_scale() {
+    if constexpr (std::is_integral<T>::value) {
+        using T_signed = typename std::make_signed<T>::type;
+        return 1.f / ((float)std::numeric_limits<T_signed>::max() + 1.f);
+    } else {
+        return 1.f;
+    }
+}
+
+// Scalar version, also handles the tails of the vectorized loops
+template <typename T>
+static void convert_generic(float *arr, const T *samples, size_t num,
+                            size_t start = 0) {
+    constexpr float scale = sample_scale<T>();
+    for (size_t i = start; i < num; i++) {
+        if constexpr (std::is_integral<T>::value) {
+            using T_signed = typename std::make_signed<T>::type;
+            T sample = samples[i];
+            if constexpr (std::is_unsigned<T>::value) {
+                sample ^= (T)1 << (sizeof(T) * 8 - 1);
+            }
+            arr[i] = (float)(T_signed)sample * scale;
+        } else {
+            arr[i] = (float)samples[i];
+        }
+    }
+}
+
+static void convert_f32(float *arr, const float *samples, size_t num) {
+    // Already in the right format, only move if it was read elsewhere
+    if (arr != samples) {
+        std::memmove(arr, samples, sizeof(float) * num);
+    }
+}
+
+#ifdef CONVERT_X86
+// Each iteration loads its input before storing, so the samples can be read
+// in place from the end of the output array
+
+/* 8 bit samples */
+template <typename T>
+__attribute__((target("sse2"))) static void
+convert_8_sse2(float *arr, const T *samples, size_t num) {
+    const __m128 scale = _mm_set1_ps(sample_scale<T>());
+    const __m128i bias =
+        _mm_set1_epi8(std::is_unsigned<T>::value ? (char)0x80 : 0);
+    size_t i = 0;
+    for (; i + 16 <= num; i += 16) {
+        __m128i v = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i *)(samples + i)), bias);
+        // Sign extend by duplicating into the high half and shifting down
+        __m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+        __m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+        __m128 f0 = _mm_cvtepi32_ps(
+            _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16));
+        __m128 f1 = _mm_cvtepi32_ps(
+            _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16));
+        __m128 f2 = _mm_cvtepi32_ps(
+            _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16));
+        __m128 f3 = _mm_cvtepi32_ps(
+            _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16));
+        _mm_storeu_ps(arr + i, _mm_mul_ps(f0, scale));
+        _mm_storeu_ps(arr + i + 4, _mm_mul_ps(f1, scale));
+        _mm_storeu_ps(arr + i + 8, _mm_mul_ps(f2, scale));
+        _mm_storeu_ps(arr + i + 12, _mm_mul_ps(f3, scale));
+    }
+    convert_generic(arr, samples, num, i);
+}
+template <typename T>
+__attribute__((target("avx2"))) static void
+convert_8_avx2(float *arr, const T *samples, size_t num) {
+    const __m256 scale = _mm256_set1_ps(sample_scale<T>());
+    const __m128i bias =
+        _mm_set1_epi8(std::is_unsigned<T>::value ? (char)0x80 : 0);
+    size_t i = 0;
+    for (; i + 16 <= num; i += 16) {
+        __m128i v = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i *)(samples + i)), bias);
+        __m256 f0 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(v));
+        __m256 f1 =
+            _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(v, 8)));
+        _mm256_storeu_ps(arr + i, _mm256_mul_ps(f0, scale));
+        _mm256_storeu_ps(arr + i + 8, _mm256_mul_ps(f1, scale));
+    }
+    convert_generic(arr, samples, num, i);
+}
+// GCC flags the intentionally undefined registers in the AVX-512 headers,
+// the warning is turned off around each AVX-512 function only
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+template <typename T>
+__attribute__((target("avx512f"))) static void
+convert_8_avx512(float *arr, const T *samples, size_t num) {
+    const __m512 scale = _mm512_set1_ps(sample_scale<T>());
+    const __m128i bias =
+        _mm_set1_epi8(std::is_unsigned<T>::value ? (char)0x80 : 0);
+    size_t i = 0;
+    for (; i + 16 <= num; i += 16) {
+        __m128i v = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i *)(samples + i)), bias);
+        __m512 f = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(v));
+        _mm512_storeu_ps(arr + i, _mm512_mul_ps(f, scale));
+    }
+    convert_generic(arr, samples, num, i);
+}
+#pragma GCC diagnostic pop
+
+/* 16 bit samples */
+template <typename T>
+__attribute__((target("sse2"))) static void
+convert_16_sse2(float *arr, const T *samples, size_t num) {
+    const __m128 scale = _mm_set1_ps(sample_scale<T>());
+    const __m128i bias =
+        _mm_set1_epi16(std::is_unsigned<T>::value ? (short)0x8000 : 0);
+    size_t i = 0;
+    for (; i + 8 <= num; i += 8) {
+        __m128i v = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i *)(samples + i)), bias);
+        __m128 f0 = _mm_cvtepi32_ps(
+            _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+        __m128 f1 = _mm_cvtepi32_ps(
+            _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+        _mm_storeu_ps(arr + i, _mm_mul_ps(f0, scale));
+        _mm_storeu_ps(arr + i + 4, _mm_mul_ps(f1, scale));
+    }
+    convert_generic(arr, samples, num, i);
+}
+template <typename T>
+__attribute__((target("avx2"))) static void
+convert_16_avx2(float *arr, const T *samples, size_t num) {
+    const __m256 scale = _mm256_set1_ps(sample_scale<T>());
+    const __m128i bias =
+        _mm_set1_epi16(std::is_unsigned<T>::value ? (short)0x8000 : 0);
+    size_t i = 0;
+    for (; i + 8 <= num; i += 8) {
+        __m128i v = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i *)(samples + i)), bias);
+        __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+        _mm256_storeu_ps(arr + i, _mm256_mul_ps(f, scale));
+    }
+    convert_generic(arr, samples, num, i);
+}
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+template <typename T>
+__attribute__((target("avx512f"))) static void
+convert_16_avx512(float *arr, const T *samples, size_t num) {
+    const __m512 scale = _mm512_set1_ps(sample_scale<T>());
+    const __m256i bias =
+        _mm256_set1_epi16(std::is_unsigned<T>::value ? (short)0x8000 : 0);
+    size_t i = 0;
+    for (; i + 16 <= num; i += 16) {
+        __m256i v = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i *)(samples + i)), bias);
+        __m512 f = _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(v));
+        _mm512_storeu_ps(arr + i, _mm512_mul_ps(f, scale));
+    }
+    convert_generic(arr, samples, num, i);
+}
+#pragma GCC diagnostic pop
+
+/* 64 bit floating point samples */
+__attribute__((target("sse2"))) static void
+convert_f64_sse2(float *arr, const double *samples, size_t num) {
+    size_t i = 0;
+    for (; i + 4 <= num; i += 4) {
+        __m128 f0 = _mm_cvtpd_ps(_mm_loadu_pd(samples + i));
+        __m128 f1 = _mm_cvtpd_ps(_mm_loadu_pd(samples + i + 2));
+        _mm_storeu_ps(arr + i, _mm_movelh_ps(f0, f1));
+    }
+    convert_generic(arr, samples, num, i);
+}
+__attribute__((target("avx2"))) static void
+convert_f64_avx2(float *arr, const double *samples, size_t num) {
+    size_t i = 0;
+    for (; i + 4 <= num; i += 4) {
+        _mm_storeu_ps(arr + i, _mm256_cvtpd_ps(_mm256_loadu_pd(samples + i)));
+    }
+    convert_generic(arr, samples, num, i);
+}
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f"))) static void
+convert_f64_avx512(float *arr, const double *samples, size_t num) {
+    size_t i = 0;
+    for (; i + 8 <= num; i += 8) {
+        _mm256_storeu_ps(arr + i,
+                         _mm512_cvtpd_ps(_mm512_loadu_pd(samples + i)));
+    }
+    convert_generic(arr, samples, num, i);
+}
+#pragma GCC diagnostic pop
+#endif
+
+template <typename T> convert_fn_t<T> select_convert_fn() {
+    [[maybe_unused]] convert_isa isa = detect_isa();
+    if constexpr (std::is_same<T, float>::value) {
+        return convert_f32;
+    }
+#ifdef CONVERT_X86
+    if constexpr (std::is_integral<T>::value && sizeof(T) == 1) {
+        switch (isa) {
+        case ISA_AVX512:
+            return convert_8_avx512<T>;
+        case ISA_AVX2:
+            return convert_8_avx2<T>;
+        case ISA_SSE2:
+            return convert_8_sse2<T>;
+        default:
+            break;
+        }
+    } else if constexpr (std::is_integral<T>::value && sizeof(T) == 2) {
+        switch (isa) {
+        case ISA_AVX512:
+            return convert_16_avx512<T>;
+        case ISA_AVX2:
+            return convert_16_avx2<T>;
+        case ISA_SSE2:
+            return convert_16_sse2<T>;
+        default:
+            break;
+        }
+    } else if constexpr (std::is_same<T, double>::value) {
+        switch (isa) {
+        case ISA_AVX512:
+            return convert_f64_avx512;
+        case ISA_AVX2:
+            return convert_f64_avx2;
+        case ISA_SSE2:
+            return convert_f64_sse2;
+        default:
+            break;
+        }
+    }
+#endif
+    return [](float *arr, const T *samples, size_t num) {
+        convert_generic(arr, samples, num);
+    };
+}
+
+template convert_fn_t<uint8_t> select_convert_fn<uint8_t>();
+template convert_fn_t<int8_t> select_convert_fn<int8_t>();
+template convert_fn_t<uint16_t> select_convert_fn<uint16_t>();
+template convert_fn_t<int16_t> select_convert_fn<int16_t>();
+template convert_fn_t<uint32_t> select_convert_fn<uint32_t>();
+template convert_fn_t<int32_t> select_convert_fn<int32_t>();
+template convert_fn_t<uint64_t> select_convert_fn<uint64_t>();
+template convert_fn_t<int64_t> select_convert_fn<int64_t>();
+template convert_fn_t<float> select_convert_fn<float>();
+template convert_fn_t<double> select_convert_fn<double>();
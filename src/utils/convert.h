@@ -0,0 +1,19 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Converts raw samples into floats scaled to [-1, 1)
+// Unsigned samples are offset binary and are recentered around 0
+// samples may alias the tail of arr, the kernels always load before storing
+template <typename T>
+using convert_fn_t = void (*)(float *arr, const T *samples, size_t num);
+
+// Picks the widest implementation supported by the running CPU
+template <typename T> convert_fn_t<T> select_convert_fn();
+
+// Name of the instruction set select_convert_fn picks, for logging
+const char *convert_isa_name();
+
+#endif
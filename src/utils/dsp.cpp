@@ -1,7 +1,9 @@
 #include "dsp.h"
+#include <algorithm>
 #include <cstdint>
 //#include <immintrin.h>
 #include <memory>
+#include <vector>
 
 void build_hann_window(float *arr, int num) {
     // Use a Hann window
@@ -23,6 +25,88 @@ void build_blackman_harris_window(float *arr, int num) {
     }
 }
 
+float build_overlap_add_gain(float *gain, const float *window, int window_len,
+                             int len, int hop) {
+    float max_sum = 0.f;
+    for (int i = 0; i < hop; i++) {
+        float sum = 0.f;
+        for (int j = i; j < len; j += hop) {
+            sum += window[(int64_t)j * window_len / len];
+        }
+        gain[i] = sum;
+        max_sum = std::max(max_sum, sum);
+    }
+    // Where the windows barely cover the signal the gain is capped rather
+    // than amplifying the noise
+    float min_sum = INFINITY;
+    for (int i = 0; i < hop; i++) {
+        min_sum = std::min(min_sum, gain[i]);
+        gain[i] = 1.f / std::max(gain[i], max_sum / OVERLAP_ADD_MAX_GAIN);
+    }
+    return min_sum > 0.f ? max_sum / min_sum : INFINITY;
+}
+
+void build_wola_synthesis(float *synthesis, const float *analysis, int len,
+                          int size, int hop) {
+    // Output sample t gets analysis[p + k * size] * synthesis[p] times the
+    // input k frames away, summed over the frame offsets p = t mod hop. Only
+    // k = 0 may remain, which is one small linear system per offset
+    int num_k = 2 * ((len + size - 1) / size) - 1;
+    int k_min = -(num_k / 2);
+    for (int t = 0; t < hop; t++) {
+        std::vector<int> pos;
+        for (int p = t; p < len; p += hop) {
+            pos.push_back(p);
+        }
+        auto coeff = [&](int k, size_t r) {
+            int idx = pos[r] + (k_min + k) * size;
+            return idx >= 0 && idx < len ? (double)analysis[idx] : 0.;
+        };
+        // Minimum norm solution of A f = e, through (A A^T) y = e and
+        // f = A^T y. Lightly regularised since the system is overdetermined
+        // below 50% overlap
+        std::vector<double> m(num_k * num_k), y(num_k, 0.);
+        double trace = 0;
+        for (int i = 0; i < num_k; i++) {
+            for (int j = 0; j < num_k; j++) {
+                double sum = 0;
+                for (size_t r = 0; r < pos.size(); r++) {
+                    sum += coeff(i, r) * coeff(j, r);
+                }
+                m[i * num_k + j] = sum;
+            }
+            trace += m[i * num_k + i];
+        }
+        for (int i = 0; i < num_k; i++) {
+            m[i * num_k + i] += trace / num_k * 1e-9;
+        }
+        y[-k_min] = 1.;
+        // Gaussian elimination, the matrix is symmetric positive definite
+        for (int i = 0; i < num_k; i++) {
+            for (int j = i + 1; j < num_k; j++) {
+                double f = m[j * num_k + i] / m[i * num_k + i];
+                for (int l = i; l < num_k; l++) {
+                    m[j * num_k + l] -= f * m[i * num_k + l];
+                }
+                y[j] -= f * y[i];
+            }
+        }
+        for (int i = num_k - 1; i >= 0; i--) {
+            for (int l = i + 1; l < num_k; l++) {
+                y[i] -= m[i * num_k + l] * y[l];
+            }
+            y[i] /= m[i * num_k + i];
+        }
+        for (size_t r = 0; r < pos.size(); r++) {
+            double sum = 0;
+            for (int k = 0; k < num_k; k++) {
+                sum += coeff(k, r) * y[k];
+            }
+            synthesis[pos[r]] = sum;
+        }
+    }
+}
+
 //__attribute__((target("default")))
 void polar_discriminator_fm(std::complex<float> *buf, std::complex<float> prev,
                             float *output, size_t len) {
@@ -90,6 +174,33 @@ void dsp_negate_complex(std::complex<float> *arr, size_t len) {
     }
 }
 
+void dsp_multiply_float(float *arr1, const float *arr2, const float *arr3,
+                        size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        arr1[i] = arr2[i] * arr3[i];
+    }
+}
+void dsp_multiply_complex(std::complex<float> *arr1,
+                          const std::complex<float> *arr2, const float *arr3,
+                          size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        arr1[i] = arr2[i] * arr3[i];
+    }
+}
+void dsp_multiply_add_float(float *arr1, const float *arr2, const float *arr3,
+                            size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        arr1[i] += arr2[i] * arr3[i];
+    }
+}
+void dsp_multiply_add_complex(std::complex<float> *arr1,
+                              const std::complex<float> *arr2,
+                              const float *arr3, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        arr1[i] += arr2[i] * arr3[i];
+    }
+}
+
 void dsp_add_float(float *arr1, float *arr2, size_t len) {
     //[[assume(len % (64 / sizeof(float)) == 0)]];
     [[assume(len > 0)]];
@@ -8,11 +8,35 @@
 
 void build_hann_window(float *arr, int num);
 void build_blackman_harris_window(float *arr, int num);
+// Largest correction build_overlap_add_gain applies, relative to where the
+// windows overlap the most
+constexpr float OVERLAP_ADD_MAX_GAIN = 10.f;
+// Gain that undoes the sum of the overlapping windows for each of the hop
+// samples a len point frame adds, window has window_len points
+// Returns the ratio between the largest and the smallest sum, if it reaches
+// OVERLAP_ADD_MAX_GAIN the gain is capped and the audio is not restored
+float build_overlap_add_gain(float *gain, const float *window, int window_len,
+                             int len, int hop);
+// Synthesis window for frames analysed with a len point window folded to size
+// points, so the time aliasing of the fold cancels when overlap-added at hop
+void build_wola_synthesis(float *synthesis, const float *analysis, int len,
+                          int size, int hop);
 void polar_discriminator_fm(std::complex<float> *buf, std::complex<float> prev,
                             float *output, size_t len);
 
 void dsp_negate_float(float *arr, size_t len);
 void dsp_negate_complex(std::complex<float> *arr, size_t len);
+void dsp_multiply_float(float *arr1, const float *arr2, const float *arr3,
+                        size_t len);
+void dsp_multiply_complex(std::complex<float> *arr1,
+                          const std::complex<float> *arr2, const float *arr3,
+                          size_t len);
+// arr1 += arr2 * arr3
+void dsp_multiply_add_float(float *arr1, const float *arr2, const float *arr3,
+                            size_t len);
+void dsp_multiply_add_complex(std::complex<float> *arr1,
+                              const std::complex<float> *arr2,
+                              const float *arr3, size_t len);
 void dsp_add_float(float *arr1, float *arr2, size_t len);
 void dsp_add_complex(std::complex<float> *arr1, std::complex<float> *arr2,
                      size_t len);
@@ -0,0 +1,51 @@
+#ifndef LATCH_H
+#define LATCH_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+// Reusable countdown latch used to know when a frame is no longer read
+// Unlike std::latch it can be rearmed every frame, and count_down holds the
+// lock while notifying so the waiter can reuse it as soon as wait returns
+class CountdownLatch {
+  public:
+    CountdownLatch() : count{0}, closed{false} {}
+
+    // Adds count more tasks to wait for
+    void add(size_t count) {
+        std::scoped_lock lk(mtx);
+        this->count += count;
+    }
+    void count_down() {
+        std::scoped_lock lk(mtx);
+        if (count && --count == 0) {
+            cv.notify_all();
+        }
+    }
+    // Blocks until every task has counted down or the latch is closed
+    void wait() {
+        std::unique_lock lk(mtx);
+        cv.wait(lk, [&] { return count == 0 || closed; });
+    }
+    // True if wait would return immediately
+    bool ready() {
+        std::scoped_lock lk(mtx);
+        return count == 0 || closed;
+    }
+    // Releases the waiter for good, used on shutdown when the tasks may
+    // never run
+    void close() {
+        std::scoped_lock lk(mtx);
+        closed = true;
+        cv.notify_all();
+    }
+
+  protected:
+    size_t count;
+    bool closed;
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include "pyramid.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <bit>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PYRAMID_X86
+#include <immintrin.h>
+#endif
+
+// Bins per tile, the complex input, powers and the upper levels of a tile
+// stay in L2 while they are being reduced
+constexpr size_t tile_bins = 8192;
+
+// log2 with the exponent taken from the float bits and a quadratic fit of the
+// mantissa, scaled to dB and offset into the int8 range
+static inline int8_t quantize_power(float val, int power_offset) {
+    uint32_t bits;
+    __builtin_memcpy(&bits, &val, sizeof(bits));
+    float log_val = (float)((int)((bits >> 23) & 0xFF) - 128) + power_offset;
+    // Set exponent to 0
+    bits &= ~(255u << 23);
+    bits += 127u << 23;
+    float mantissa;
+    __builtin_memcpy(&mantissa, &bits, sizeof(mantissa));
+    log_val +=
+        ((-0.34484843f) * mantissa + 2.02466578f) * mantissa - 0.67487759f;
+    return std::clamp(log_val * 0.3010299956639812f * 20.f + 127.f, -128.f,
+                      127.f);
+}
+
+static void power_quantize_generic(float *complexbuf, float *powerbuf,
+                                   int8_t *quantizedbuf, size_t len,
+                                   float normalize, int power_offset) {
+    for (size_t i = 0; i < len; i++) {
+        complexbuf[i * 2] /= normalize;
+        complexbuf[i * 2 + 1] /= normalize;
+        float re = complexbuf[i * 2];
+        float im = complexbuf[i * 2 + 1];
+        float power = re * re + im * im;
+        powerbuf[i] = power;
+        if (quantizedbuf) {
+            quantizedbuf[i] = quantize_power(power, power_offset);
+        }
+    }
+}
+static void half_quantize_generic(const float *powerbuf, float *halfbuf,
+                                  int8_t *quantizedbuf, size_t len,
+                                  int power_offset) {
+    for (size_t i = 0; i < len; i++) {
+        float power = powerbuf[i * 2] + powerbuf[i * 2 + 1];
+        halfbuf[i] = power;
+        if (quantizedbuf) {
+            quantizedbuf[i] = quantize_power(power, power_offset);
+        }
+    }
+}
+
+#ifdef PYRAMID_X86
+// Same approximation as quantize_power, 8 lanes at a time
+__attribute__((target("avx2"))) static inline void
+quantize_power_avx2(__m256 power, int power_offset, int8_t *quantizedbuf) {
+    const __m256i exponent_mask = _mm256_set1_epi32(0xFF);
+    const __m256i mantissa_mask = _mm256_set1_epi32(~(255 << 23));
+    const __m256i exponent_zero = _mm256_set1_epi32(127 << 23);
+    __m256i bits = _mm256_castps_si256(power);
+    __m256 log_val = _mm256_cvtepi32_ps(_mm256_sub_epi32(
+        _mm256_and_si256(_mm256_srli_epi32(bits, 23), exponent_mask),
+        _mm256_set1_epi32(128 - power_offset)));
+    __m256 mantissa = _mm256_castsi256_ps(
+        _mm256_or_si256(_mm256_and_si256(bits, mantissa_mask), exponent_zero));
+    __m256 poly = _mm256_add_ps(
+        _mm256_mul_ps(mantissa, _mm256_set1_ps(-0.34484843f)),
+        _mm256_set1_ps(2.02466578f));
+    poly = _mm256_sub_ps(_mm256_mul_ps(poly, mantissa),
+                         _mm256_set1_ps(0.67487759f));
+    log_val = _mm256_add_ps(log_val, poly);
+    __m256 db = _mm256_add_ps(
+        _mm256_mul_ps(log_val, _mm256_set1_ps(0.3010299956639812f * 20.f)),
+        _mm256_set1_ps(127.f));
+    // Truncate like the scalar conversion, the packs saturate to int8
+    __m256i q = _mm256_cvttps_epi32(db);
+    __m128i q16 = _mm_packs_epi32(_mm256_castsi256_si128(q),
+                                  _mm256_extracti128_si256(q, 1));
+    _mm_storel_epi64((__m128i *)quantizedbuf, _mm_packs_epi16(q16, q16));
+}
+
+// Sums adjacent pairs of a and b, in order
+__attribute__((target("avx2"))) static inline __m256 pair_sum_avx2(__m256 a,
+                                                                   __m256 b) {
+    __m256 h = _mm256_hadd_ps(a, b);
+    return _mm256_castpd_ps(
+        _mm256_permute4x64_pd(_mm256_castps_pd(h), _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+__attribute__((target("avx2"))) static void
+power_quantize_avx2(float *complexbuf, float *powerbuf, int8_t *quantizedbuf,
+                    size_t len, float normalize, int power_offset) {
+    const __m256 norm = _mm256_set1_ps(normalize);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m256 a = _mm256_div_ps(_mm256_loadu_ps(complexbuf + i * 2), norm);
+        __m256 b = _mm256_div_ps(_mm256_loadu_ps(complexbuf + i * 2 + 8), norm);
+        _mm256_storeu_ps(complexbuf + i * 2, a);
+        _mm256_storeu_ps(complexbuf + i * 2 + 8, b);
+        __m256 power = pair_sum_avx2(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b));
+        _mm256_storeu_ps(powerbuf + i, power);
+        if (quantizedbuf) {
+            quantize_power_avx2(power, power_offset, quantizedbuf + i);
+        }
+    }
+    power_quantize_generic(complexbuf + i * 2, powerbuf + i,
+                           quantizedbuf ? quantizedbuf + i : nullptr, len - i,
+                           normalize, power_offset);
+}
+__attribute__((target("avx2"))) static void
+half_quantize_avx2(const float *powerbuf, float *halfbuf, int8_t *quantizedbuf,
+                   size_t len, int power_offset) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m256 power = pair_sum_avx2(_mm256_loadu_ps(powerbuf + i * 2),
+                                     _mm256_loadu_ps(powerbuf + i * 2 + 8));
+        _mm256_storeu_ps(halfbuf + i, power);
+        if (quantizedbuf) {
+            quantize_power_avx2(power, power_offset, quantizedbuf + i);
+        }
+    }
+    half_quantize_generic(powerbuf + i * 2, halfbuf + i,
+                          quantizedbuf ? quantizedbuf + i : nullptr, len - i,
+                          power_offset);
+}
+#endif
+
+static void normalize_generic(float *complexbuf, size_t len,
+                              float normalize) {
+    for (size_t i = 0; i < len * 2; i++) {
+        complexbuf[i] /= normalize;
+    }
+}
+
+typedef void (*power_quantize_fn_t)(float *, float *, int8_t *, size_t, float,
+                                    int);
+typedef void (*half_quantize_fn_t)(const float *, float *, int8_t *, size_t,
+                                   int);
+
+static bool has_avx2() {
+#ifdef PYRAMID_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+void dsp_power_pyramid(float *complexbuf, float *powerbuf,
+                       int8_t *quantizedbuf, size_t len, size_t base_idx,
+                       uint32_t level_mask, float normalize, int power_offset) {
+    static const bool avx2 = has_avx2();
+    power_quantize_fn_t power_quantize = power_quantize_generic;
+    half_quantize_fn_t half_quantize = half_quantize_generic;
+#ifdef PYRAMID_X86
+    if (avx2) {
+        power_quantize = power_quantize_avx2;
+        half_quantize = half_quantize_avx2;
+    }
+#endif
+
+    // Nothing to send the power to, the audio only needs normalized bins
+    int levels = std::bit_width(level_mask);
+    if (levels == 0) {
+        size_t num_tiles = (len + tile_bins - 1) / tile_bins;
+        dsp_parallel_for(num_tiles, [&](size_t t) {
+            size_t start = t * tile_bins;
+            normalize_generic(complexbuf + start * 2,
+                              std::min(tile_bins, len - start), normalize);
+        });
+        return;
+    }
+
+    // Tiles hold a whole number of bins of the smallest level
+    size_t tile = std::max(tile_bins, (size_t)1 << (levels - 1));
+    size_t num_tiles = (len + tile - 1) / tile;
+
+    dsp_parallel_for(num_tiles, [&](size_t t) {
+        size_t start = t * tile;
+        size_t tile_len = std::min(tile, len - start);
+
+        // Levels nobody reads are only summed for the levels above them
+        auto quantized = [&](int k, size_t offset) {
+            return level_mask >> k & 1 ? quantizedbuf + offset : nullptr;
+        };
+
+        // Level 0, the tile may wrap around the end of the FFT output
+        size_t src = (start + base_idx) % len;
+        size_t first = std::min(tile_len, len - src);
+        power_quantize(complexbuf + src * 2, powerbuf + start,
+                       quantized(0, start), first, normalize, power_offset);
+        if (first < tile_len) {
+            power_quantize(complexbuf, powerbuf + start + first,
+                           quantized(0, start + first), tile_len - first,
+                           normalize, power_offset);
+        }
+
+        // Every other level is reduced from the one below while it is cached
+        size_t level_offset = 0;
+        for (int k = 1; k < levels; k++) {
+            size_t prev_offset = level_offset;
+            level_offset += len >> (k - 1);
+            half_quantize(powerbuf + prev_offset + (start >> (k - 1)),
+                          powerbuf + level_offset + (start >> k),
+                          quantized(k, level_offset + (start >> k)),
+                          tile_len >> k, power_offset - k);
+        }
+    });
+}
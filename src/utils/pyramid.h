@@ -0,0 +1,19 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Computes the power of every bin and each downsampled waterfall level above
+// it in a single pass over the FFT output, one cache sized tile at a time
+// complexbuf has len bins and is normalized in place, the spectrum starts at
+// base_idx and wraps around. Level k is stored after level k - 1 in powerbuf
+// and quantizedbuf and has len >> k bins, quantized with power_offset - k
+// The powers are summed up to the highest level set in level_mask, bit k for
+// level k, but only the levels that are set are quantized
+// With no levels only the normalization runs
+void dsp_power_pyramid(float *complexbuf, float *powerbuf,
+                       int8_t *quantizedbuf, size_t len, size_t base_idx,
+                       uint32_t level_mask, float normalize, int power_offset);
+
+#endif
@@ -0,0 +1,146 @@
+#include "threadpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <memory>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+DSPThreadPool::DSPThreadPool(int num_threads, const std::vector<int> &cpus)
+    : stopping{false} {
+    for (int i = 0; i < num_threads; i++) {
+        int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        threads.emplace_back(&DSPThreadPool::worker, this, i, cpu);
+    }
+}
+
+DSPThreadPool::~DSPThreadPool() {
+    {
+        std::scoped_lock lk(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+void DSPThreadPool::worker(int idx, int cpu) {
+#ifdef __linux__
+    if (cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset)) {
+            std::cout << "Cannot pin DSP thread " << idx << " to CPU " << cpu
+                      << std::endl;
+        }
+    }
+#else
+    (void)idx;
+    (void)cpu;
+#endif
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock lk(mtx);
+            cv.wait(lk, [&] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void DSPThreadPool::post(std::function<void()> fn) {
+    {
+        std::scoped_lock lk(mtx);
+        tasks.push_back(std::move(fn));
+    }
+    cv.notify_one();
+}
+
+void DSPThreadPool::post_front(std::function<void()> fn) {
+    {
+        std::scoped_lock lk(mtx);
+        tasks.push_front(std::move(fn));
+    }
+    cv.notify_one();
+}
+
+void DSPThreadPool::parallel_for(size_t n,
+                                 const std::function<void(size_t)> &fn) {
+    if (n == 0) {
+        return;
+    }
+    if (n == 1 || threads.empty()) {
+        for (size_t i = 0; i < n; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    // Helpers may only start after the indices ran out and the caller
+    // returned, so they hold on to the shared state
+    struct State {
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> finished{0};
+        size_t n;
+        const std::function<void(size_t)> *fn;
+    };
+    auto state = std::make_shared<State>();
+    state->n = n;
+    state->fn = &fn;
+    auto run = [](State &s) {
+        size_t i;
+        while ((i = s.next.fetch_add(1)) < s.n) {
+            (*s.fn)(i);
+            if (s.finished.fetch_add(1) + 1 == s.n) {
+                s.finished.notify_all();
+            }
+        }
+    };
+
+    size_t num_helpers = std::min(n - 1, threads.size());
+    {
+        std::scoped_lock lk(mtx);
+        for (size_t i = 0; i < num_helpers; i++) {
+            tasks.push_front([state, run]() { run(*state); });
+        }
+    }
+    cv.notify_all();
+
+    run(*state);
+    size_t finished;
+    while ((finished = state->finished.load()) != n) {
+        state->finished.wait(finished);
+    }
+}
+
+static std::unique_ptr<DSPThreadPool> pool;
+
+void dsp_pool_init(int num_threads, const std::vector<int> &cpus) {
+    if (num_threads < 1) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    pool = std::make_unique<DSPThreadPool>(num_threads, cpus);
+}
+
+DSPThreadPool *dsp_pool() { return pool.get(); }
+
+void dsp_parallel_for(size_t n, const std::function<void(size_t)> &fn) {
+    if (pool) {
+        pool->parallel_for(n, fn);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        fn(i);
+    }
+}
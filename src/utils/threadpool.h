@@ -0,0 +1,57 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker threads for the DSP work, the FFT, the waterfall pyramid
+// and the demodulation all run on the same cores instead of each spawning
+// their own threads and fighting over them
+class DSPThreadPool {
+  public:
+    // Worker i is pinned to cpus[i % cpus.size()], empty leaves it unpinned
+    DSPThreadPool(int num_threads, const std::vector<int> &cpus);
+    DSPThreadPool(const DSPThreadPool &) = delete;
+    DSPThreadPool &operator=(const DSPThreadPool &) = delete;
+    ~DSPThreadPool();
+
+    int size() const { return threads.size(); }
+
+    // Runs fn on a worker without waiting for it
+    void post(std::function<void()> fn);
+    // Like post, but ahead of every task already queued, for work the next
+    // frame waits on
+    void post_front(std::function<void()> fn);
+
+    // Runs fn(i) for every i in [0, n) and returns once all have finished
+    // The calling thread takes part, so it makes progress even while every
+    // worker is busy with posted tasks
+    void parallel_for(size_t n, const std::function<void(size_t)> &fn);
+
+  protected:
+    void worker(int idx, int cpu);
+
+    std::vector<std::thread> threads;
+    // parallel_for helpers and post_front go to the front since their
+    // caller is waiting
+    std::deque<std::function<void()>> tasks;
+    bool stopping;
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+// The process wide pool, must be created before any DSP work starts
+// Sizes below 1 use every core
+void dsp_pool_init(int num_threads, const std::vector<int> &cpus);
+// nullptr until dsp_pool_init is called
+DSPThreadPool *dsp_pool();
+
+// Runs on the process wide pool, or serially on the caller without one
+void dsp_parallel_for(size_t n, const std::function<void(size_t)> &fn);
+
+#endif
@@ -1,27 +1,164 @@
 #include <cmath>
 
+#include "plancache.h"
+#include "utils/pyramid.h"
 #include "waterfall.h"
 #include "waterfallcompression.h"
 
-WaterfallClient::WaterfallClient(
-    connection_hdl hdl, PacketSender &sender,
-    waterfall_compressor waterfall_compression, int min_waterfall_fft)
-    : Client(hdl, sender, WATERFALL), min_waterfall_fft{min_waterfall_fft},
-      level{0}, waterfall_slices{sender.get_waterfall_slices()},
+WaterfallZoom::WaterfallZoom(const waterfall_zoom_config &config, int center,
+                             int bins, int zoom)
+    : config{config}, center{center}, bins{bins}, zoom{zoom},
+      size{bins * zoom}, history_head{0}, last_frame_num{0} {
+    // The baseband is rebuilt from the overlapping frames like the audio
+    overlap.fft_size = config.fft_size;
+    overlap.fft_hop = config.fft_hop;
+    overlap.taps = config.taps;
+    build_audio_overlap(overlap, config.window, bins);
+
+    bins_buf = fftwf_malloc_unique_ptr<std::complex<float>>(bins);
+    baseband = fftwf_malloc_unique_ptr<std::complex<float>>(bins);
+    baseband_extended =
+        fftwf_malloc_unique_ptr<std::complex<float>>(bins * overlap.taps);
+    baseband_sum =
+        fftwf_malloc_unique_ptr<std::complex<float>>(bins * overlap.taps);
+    history = fftwf_malloc_unique_ptr<std::complex<float>>(size);
+    zoom_in = fftwf_malloc_unique_ptr<std::complex<float>>(size);
+    zoom_out = fftwf_malloc_unique_ptr<std::complex<float>>(size);
+    window.resize(size);
+    build_fft_window(window.data(), size, config.window);
+    power.resize(size);
+    quantized.resize(size);
+
+    p_baseband = fftw_plan_cache_get(PLAN_C2C_BACKWARD, bins, bins_buf.get(),
+                                     baseband.get());
+    p_zoom = fftw_plan_cache_get(PLAN_C2C_FORWARD, size, zoom_in.get(),
+                                 zoom_out.get());
+}
+
+void WaterfallZoom::for_each_plan(
+    const waterfall_zoom_config &config, int min_waterfall_fft,
+    const std::function<void(fftw_plan_kind, int)> &fn) {
+    if (config.max_zoom < 2) {
+        return;
+    }
+    // Follows WaterfallClient::on_window_message, views of up to half the
+    // waterfall size zoom in and get the smallest power of two of at least
+    // 16 bins that leaves a margin of 8
+    for (int bins = 16;; bins *= 2) {
+        // Narrowest view that gets this many bins
+        int width = std::max(1, bins / 2 - 7);
+        if (width * 2 > min_waterfall_fft) {
+            break;
+        }
+        fn(PLAN_C2C_BACKWARD, bins);
+        for (int zoom = 2;
+             zoom <= config.max_zoom && width * zoom <= min_waterfall_fft;
+             zoom *= 2) {
+            fn(PLAN_C2C_FORWARD, bins * zoom);
+        }
+    }
+}
+
+void WaterfallZoom::add_frame(const std::complex<float> *fft_buffer,
+                              size_t frame_num) {
+    if (frame_num != last_frame_num + 1) {
+        reset();
+    }
+    last_frame_num = frame_num;
+
+    int fft_size = config.fft_size;
+    // Baseband 0 at the front and the bins below it wrapped to the back, the
+    // same layout as the audio
+    std::fill(bins_buf.get(), bins_buf.get() + bins, 0.f);
+    for (int j = -bins / 2 + 1; j < bins / 2; j++) {
+        int k = center + j;
+        std::complex<float> &dst = bins_buf[(j + bins) % bins];
+        if (config.is_real) {
+            if (k >= 0 && k <= fft_size / 2) {
+                dst = fft_buffer[k];
+            }
+        } else {
+            dst = fft_buffer[((k + fft_size / 2 + 1) % fft_size + fft_size) %
+                             fft_size];
+        }
+    }
+
+    // Undo the phase the centre bin picked up from where the frame started,
+    // as AudioClient::rotate_to_baseband does
+    uint64_t bin = config.is_real ? center : center + fft_size / 2 + 1;
+    uint64_t start = frame_num * config.fft_hop % fft_size;
+    uint64_t turn = bin % fft_size * start % fft_size;
+    if (turn) {
+        std::complex<float> rotation(
+            std::polar(1.0, -2.0 * M_PI * (double)turn / fft_size));
+        for (int i = 0; i < bins; i++) {
+            bins_buf[i] *= rotation;
+        }
+    }
+
+    fftwf_execute_dft(p_baseband, (fftwf_complex *)bins_buf.get(),
+                      (fftwf_complex *)baseband.get());
+    overlap_add(baseband.get(), baseband_extended.get(), baseband_sum.get(),
+                bins, overlap);
+    for (int i = 0; i < overlap.audio_hop; i++) {
+        history[history_head] = baseband[i];
+        history_head = (history_head + 1) % size;
+    }
+}
+
+void WaterfallZoom::reset() {
+    std::fill(baseband_sum.get(), baseband_sum.get() + bins * overlap.taps,
+              0.f);
+    std::fill(history.get(), history.get() + size, 0.f);
+    history_head = 0;
+}
+
+const int8_t *WaterfallZoom::row(int l) {
+    for (int i = 0; i < size; i++) {
+        zoom_in[i] = history[(history_head + i) % size] * window[i];
+    }
+    fftwf_execute_dft(p_zoom, (fftwf_complex *)zoom_in.get(),
+                      (fftwf_complex *)zoom_out.get());
+    // Lowest frequency first like the main FFT of IQ input, normalized the
+    // same way so tones keep their level while the noise floor drops
+    dsp_power_pyramid((float *)zoom_out.get(), power.data(), quantized.data(),
+                      size, size / 2 + 1, 1, size, config.power_offset);
+    return &quantized[(l - center) * zoom + size / 2 - 1];
+}
+
+WaterfallClient::WaterfallClient(connection_hdl hdl, PacketSender &sender,
+                                 waterfall_compressor waterfall_compression,
+                                 const waterfall_layout &layout,
+                                 const waterfall_zoom_config &zoom_config,
+                                 const waterfall_shared &shared)
+    : Client(hdl, sender, WATERFALL), tiled{false}, layout{layout}, level{0},
+      fast{false}, zoom_config{zoom_config}, shared{shared}, history{false},
+      history_pending{false},
+      waterfall_slices{sender.get_waterfall_slices()},
       waterfall_slice_mtx{sender.get_waterfall_slice_mtx()} {
 
     if (waterfall_compression == WATERFALL_ZSTD) {
-        waterfall_encoder =
-            std::make_unique<ZstdEncoder>(hdl, sender, min_waterfall_fft);
+        waterfall_encoder = std::make_unique<ZstdEncoder>(
+            hdl, sender, layout.min_waterfall_fft, shared.dictionary);
     }
 #ifdef HAS_LIBAOM
     else if (waterfall_compression == WATERFALL_AV1) {
         waterfall_encoder =
-            std::make_unique<AV1Encoder>(hdl, sender, min_waterfall_fft);
+            std::make_unique<AV1Encoder>(hdl, sender, *shared.av1_streams);
     }
 #endif
 }
 
+int WaterfallClient::level_shift(int level) const {
+    return level < layout.main_levels
+               ? level
+               : level - layout.main_levels - 1 + layout.fast_shift;
+}
+
+int WaterfallClient::tier_level(int level) const {
+    return level < layout.main_levels ? level : level - layout.main_levels - 1;
+}
+
 void WaterfallClient::set_waterfall_range(int level, int l, int r) {
 
     // Change the waterfall data structures to reflect the changes
@@ -39,17 +176,49 @@ void WaterfallClient::set_waterfall_range(int level, int l, int r) {
     this->l = l;
     this->r = r;
     this->level = level;
+    waterfall_encoder->set_view(level, l, r);
 }
 
-void WaterfallClient::send_waterfall(int8_t *buf, size_t frame_num) {
+void WaterfallClient::send_waterfall(int8_t *buf, size_t frame_num,
+                                     const WaterfallTiles &tiles) {
     try {
+        int level = this->level;
+        int l = this->l;
+        int r = this->r;
         int len = r - l;
-        waterfall_encoder->send(buf, len, frame_num, l << level, r << level);
+        int shift = level_shift(level);
+        if (history_pending.exchange(false)) {
+            send_history(level, l, r, frame_num);
+        }
+        if (tiled && tiles.covers(tier_level(level), l, r) &&
+            !waterfall_encoder->send_tiles(tiles.get(tier_level(level), l, r),
+                                           len, frame_num, l << shift,
+                                           r << shift)) {
+            return;
+        }
+        waterfall_encoder->send(buf, len, frame_num, l << shift, r << shift);
     } catch (...) {
         // std::cout << "waterfall client disconnect" << std::endl;
     }
 }
 
+void WaterfallClient::send_zoom(const std::complex<float> *fft_buffer,
+                                size_t frame_num, bool waterfall) {
+    std::scoped_lock lk(zoom_mtx);
+    if (!zoom) {
+        return;
+    }
+    zoom->add_frame(fft_buffer, frame_num);
+    if (!waterfall) {
+        return;
+    }
+    try {
+        int len = (r - l) * zoom->get_zoom();
+        waterfall_encoder->send(zoom->row(l), len, frame_num, l, r);
+    } catch (...) {
+    }
+}
+
 void WaterfallClient::on_window_message(int new_l, std::optional<double> &,
                                         int new_r, std::optional<int> &) {
     // Sanitize the inputs
@@ -61,16 +230,21 @@ void WaterfallClient::on_window_message(int new_l, std::optional<double> &,
     // Use floating point to prevent integer rounding errors
     // Find level closest to min_waterfall_fft samples
 
-    float new_l_f = new_l;
-    float new_r_f = new_r;
-    int downsample_levels = waterfall_slices.size();
-    int new_level = downsample_levels - 1;
+    // The fast tier only has the coarser levels, from fast_shift on
+    int main_levels = layout.main_levels;
+    int min_waterfall_fft = layout.min_waterfall_fft;
+    float new_l_f = fast ? ldexpf(new_l, -layout.fast_shift) : new_l;
+    float new_r_f = fast ? ldexpf(new_r, -layout.fast_shift) : new_r;
+    int first_level = fast ? main_levels + 1 : 0;
+    int downsample_levels =
+        fast ? (int)waterfall_slices.size() - main_levels - 1 : main_levels;
+    int new_level = first_level + downsample_levels - 1;
     float best_difference = min_waterfall_fft * 2;
     for (int i = 0; i < downsample_levels; i++) {
         float send_size = abs((new_r_f - new_l_f) - min_waterfall_fft);
         if (send_size < best_difference) {
             best_difference = send_size;
-            new_level = i;
+            new_level = first_level + i;
             new_l = round(new_l_f);
             new_r = round(new_r_f);
         }
@@ -78,22 +252,105 @@ void WaterfallClient::on_window_message(int new_l, std::optional<double> &,
         new_r_f /= 2;
     }
 
+    // Past the finest level the view is zoomed in with a DDC instead
+    int zoom_factor = 1;
+    if (!fast && new_level == 0) {
+        while (zoom_factor * 2 <= zoom_config.max_zoom &&
+               (new_r - new_l) * zoom_factor * 2 <= min_waterfall_fft) {
+            zoom_factor *= 2;
+        }
+    }
+
+    // Views made of whole tiles share the compressed tiles
+    if (tiled && layout.tile_size && zoom_factor == 1) {
+        int tile_size = layout.tile_size;
+        int level_size = layout.fft_result_size >> level_shift(new_level);
+        new_r = std::min((new_r + tile_size - 1) / tile_size * tile_size,
+                         level_size);
+        new_l = std::min(new_l, new_r - 1) / tile_size * tile_size;
+    }
+
     // Since the parameters are modified, output the new parameters
 
     {
         std::ostringstream command_log;
         command_log << sender.ip_from_hdl(hdl);
         command_log << " [Waterfall User: " << user_id << "]";
+        command_log << " Waterfall Tier: " << (fast ? "fast" : "high");
         command_log << " Waterfall Level: " << new_level;
+        command_log << " Waterfall Zoom: " << zoom_factor;
         command_log << " Waterfall L: " << new_l;
         command_log << " Waterfall R: " << new_r;
         sender.log(hdl, command_log.str());
     }
 
+    std::scoped_lock lk(zoom_mtx);
+    if (zoom_factor > 1) {
+        // A margin keeps the view clear of the edges of the extracted band
+        int bins = 16;
+        while (bins < new_r - new_l + 8) {
+            bins *= 2;
+        }
+        int center = (new_l + new_r) / 2;
+        if (!zoom || zoom->get_zoom() != zoom_factor ||
+            zoom->get_center() != center || zoom->get_bins() != bins) {
+            zoom = std::make_unique<WaterfallZoom>(zoom_config, center, bins,
+                                                   zoom_factor);
+        }
+        new_level = main_levels;
+    } else {
+        zoom.reset();
+    }
+    bool moved = new_level != level || new_l != l || new_r != r;
     set_waterfall_range(new_level, new_l, new_r);
+    if (moved && history) {
+        history_pending = true;
+    }
+}
+
+void WaterfallClient::send_history(int level, int l, int r,
+                                   size_t frame_num) {
+    if (!shared.history) {
+        return;
+    }
+    shared.history->send(sender, hdl, level, l, r, level_shift(level),
+                         frame_num);
+}
+
+void WaterfallClient::on_tier_message(std::string &tier) {
+    // Takes effect with the window in the same message
+    fast = tier == "fast" &&
+           (int)waterfall_slices.size() > layout.main_levels + 1;
+}
+
+void WaterfallClient::on_tiles_message(bool tiles) {
+    // Takes effect with the window in the same message
+    tiled = tiles && layout.tile_size;
+}
+
+void WaterfallClient::on_framing_message(packet_framing framing) {
+    waterfall_encoder->set_framing(framing);
+}
+
+void WaterfallClient::on_coding_message(bool delta, bool dictionary) {
+    waterfall_encoder->set_coding(delta, dictionary);
+}
+
+void WaterfallClient::on_history_message(bool history) {
+    if (this->history.exchange(history) != history && shared.history) {
+        if (history) {
+            shared.history->subscribe();
+        } else {
+            shared.history->unsubscribe();
+        }
+    }
+    history_pending = history;
 }
 
 void WaterfallClient::on_close() {
+    on_history_message(false);
     std::scoped_lock lk(waterfall_slice_mtx[level]);
     waterfall_slices[level].erase(it);
+    // The connection holds the close handler bound to this client
+    con.reset();
 }
\ No newline at end of file
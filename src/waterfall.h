@@ -2,26 +2,149 @@
 #define WATERFALL_H
 
 #include "client.h"
+#include "signal.h"
 #include "waterfallcompression.h"
 
+// What a waterfall client needs to zoom in past the finest level
+struct waterfall_zoom_config {
+    // Main FFT, the zoom rebuilds the baseband from its frames like the audio
+    int fft_size;
+    int fft_hop;
+    bool is_real;
+    int taps;
+    fft_window window;
+    // Quantization offset of the main FFT so tones keep their level
+    int power_offset;
+    // Largest gain in resolution, 1 disables zooming
+    int max_zoom;
+};
+
+// Extra waterfall resolution for one client, the bins around its view are
+// turned back into a decimated baseband and a longer FFT is run over it
+class WaterfallZoom {
+  public:
+    // Baseband of bins main FFT bins around center, resolution zoom times finer
+    WaterfallZoom(const waterfall_zoom_config &config, int center, int bins,
+                  int zoom);
+    // Adds the baseband of the next main FFT frame. After skipped frames the
+    // baseband starts over instead of joining across the gap
+    void add_frame(const std::complex<float> *fft_buffer, size_t frame_num);
+    // Computes a waterfall row over the latest baseband, returns where main
+    // FFT bin l is, each main bin spans zoom values
+    const int8_t *row(int l);
+
+    // Calls fn with every transform a zoomed view of a waterfall
+    // min_waterfall_fft wide can plan, so they are planned at startup
+    static void
+    for_each_plan(const waterfall_zoom_config &config, int min_waterfall_fft,
+                  const std::function<void(fftw_plan_kind, int)> &fn);
+
+    int get_zoom() const { return zoom; }
+    int get_center() const { return center; }
+    int get_bins() const { return bins; }
+
+  protected:
+    // Clears the overlap-add sum and the history
+    void reset();
+
+    const waterfall_zoom_config &config;
+    int center;
+    int bins;
+    int zoom;
+    int size;
+    audio_overlap overlap;
+    fftwf_plan p_baseband;
+    fftwf_plan p_zoom;
+    std::unique_ptr<std::complex<float>[], ComplexDeleter> bins_buf;
+    std::unique_ptr<std::complex<float>[], ComplexDeleter> baseband;
+    std::unique_ptr<std::complex<float>[], ComplexDeleter> baseband_extended;
+    std::unique_ptr<std::complex<float>[], ComplexDeleter> baseband_sum;
+    // Ring of the latest size baseband samples, history_head is the oldest
+    std::unique_ptr<std::complex<float>[], ComplexDeleter> history;
+    size_t history_head;
+    size_t last_frame_num;
+    std::unique_ptr<std::complex<float>[], ComplexDeleter> zoom_in;
+    std::unique_ptr<std::complex<float>[], ComplexDeleter> zoom_out;
+    std::vector<float> window;
+    std::vector<float> power;
+    std::vector<int8_t> quantized;
+};
+
+// Where the waterfall levels are in the slices and how wide they are
+struct waterfall_layout {
+    int min_waterfall_fft;
+    int fft_result_size;
+    // Level main_levels holds the zoomed clients, the levels after it belong
+    // to the fast tier, whose first level has the resolution of main level
+    // fast_shift
+    int main_levels;
+    int fast_shift;
+    // Width of the shared compressed tiles, 0 disables them
+    int tile_size;
+};
+
+// Owned by the server and shared by every waterfall client, the pointers are
+// null when the feature is off
+struct waterfall_shared {
+    const WaterfallDictionary *dictionary;
+    AV1Streams *av1_streams;
+    WaterfallHistory *history;
+};
+
 class WaterfallClient : public Client {
   public:
     WaterfallClient(connection_hdl hdl, PacketSender &sender,
                     waterfall_compressor waterfall_compression,
-                    int min_waterfall_fft);
+                    const waterfall_layout &layout,
+                    const waterfall_zoom_config &zoom_config,
+                    const waterfall_shared &shared);
     void set_waterfall_range(int level, int l, int r);
-    void send_waterfall(int8_t *buf, size_t frame_num);
+    // Sends the shared tiles instead of compressing buf when they cover the
+    // view, tiles holds the levels of the client's tier
+    void send_waterfall(int8_t *buf, size_t frame_num,
+                        const WaterfallTiles &tiles);
+    // Feeds a zoomed client every main FFT frame, rows are only sent for
+    // waterfall frames
+    void send_zoom(const std::complex<float> *fft_buffer, size_t frame_num,
+                   bool waterfall);
     virtual void on_window_message(int l, std::optional<double> &m, int r,
                                    std::optional<int> &level);
+    virtual void on_tier_message(std::string &tier);
+    virtual void on_tiles_message(bool tiles);
+    virtual void on_framing_message(packet_framing framing);
+    virtual void on_coding_message(bool delta, bool dictionary);
+    virtual void on_history_message(bool history);
     void on_close();
     virtual ~WaterfallClient(){};
 
     std::multimap<std::pair<int, int>,
                   std::shared_ptr<WaterfallClient>>::iterator it;
+    // Set by clients that decode a message of several zstd frames, their
+    // views are snapped to the tiles
+    std::atomic<bool> tiled;
 
   protected:
-    int min_waterfall_fft;
+    // Resolution of the level relative to main level 0
+    int level_shift(int level) const;
+    // Level within its tier, as the tier's frames number them
+    int tier_level(int level) const;
+    // Sends the stored rows of the view before frame_num, on the same
+    // thread as the live rows so the history always comes before them
+    void send_history(int level, int l, int r, size_t frame_num);
+
+    const waterfall_layout &layout;
     int level;
+    bool fast;
+    const waterfall_zoom_config &zoom_config;
+    const waterfall_shared &shared;
+    // Set by clients that understand the history message, they are sent
+    // one before the first row after each change of their view
+    std::atomic<bool> history;
+    std::atomic<bool> history_pending;
+    // Only set while zoomed in past level 0, guarded by zoom_mtx since the
+    // frames are processed on the DSP pool
+    std::unique_ptr<WaterfallZoom> zoom;
+    std::mutex zoom_mtx;
     // Compression codec variables for waterfall
     std::unique_ptr<WaterfallEncoder> waterfall_encoder;
 
@@ -1,10 +1,66 @@
 #include "waterfallcompression.h"
 
+#include <algorithm>
 #include <boost/container/small_vector.hpp>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+
+#include "utils/threadpool.h"
 
 #define ZSTD_STATIC_LINKING_ONLY
 #include <zstd.h>
+#include <zdict.h>
+
+bool WaterfallDictionary::load(const std::string &filename) {
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    bytes.assign(std::istreambuf_iterator<char>(file),
+                 std::istreambuf_iterator<char>());
+    // Raw content dictionaries have no ID for the clients to check against
+    dict_id = ZDICT_getDictID(bytes.data(), bytes.size());
+    if (!dict_id) {
+        return false;
+    }
+    cdict = ZSTD_createCDict(bytes.data(), bytes.size(), ZSTD_CLEVEL_DEFAULT);
+    return cdict != nullptr;
+}
+
+bool WaterfallDictionary::train(const std::string &filename,
+                                const std::vector<uint8_t> &buffer,
+                                const std::vector<size_t> &sample_sizes,
+                                size_t dictionary_size) {
+    std::vector<uint8_t> dict(dictionary_size);
+    size_t size = ZDICT_trainFromBuffer(dict.data(), dict.size(), buffer.data(),
+                                        sample_sizes.data(),
+                                        sample_sizes.size());
+    if (ZDICT_isError(size)) {
+        std::cout << "Dictionary training failed: "
+                  << ZDICT_getErrorName(size) << std::endl;
+        return false;
+    }
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    file.write((const char *)dict.data(), size);
+    return (bool)file;
+}
+
+WaterfallDictionary::~WaterfallDictionary() { ZSTD_freeCDict(cdict); }
+
+void waterfall_delta_encode(int8_t *residual, const int8_t *row,
+                            const int8_t *previous, size_t size) {
+    // Wraps around, the decoder adds the residual back modulo 256
+    const uint8_t *a = (const uint8_t *)row;
+    const uint8_t *b = (const uint8_t *)previous;
+    uint8_t *out = (uint8_t *)residual;
+    for (size_t i = 0; i < size; i++) {
+        out[i] = a[i] - b[i];
+    }
+}
 
 void WaterfallEncoder::send_packet(void *packet, size_t bytes) {
     sender.send_binary_packet(hdl, packet, bytes);
@@ -15,38 +71,420 @@ void WaterfallEncoder::set_data(uint64_t frame_num, int l, int r) {
     packet["l"] = l;
     packet["r"] = r;
 }
-ZstdEncoder::ZstdEncoder(connection_hdl hdl, PacketSender &sender, int)
-    : WaterfallEncoder(hdl, sender) {
+
+void WaterfallEncoder::set_header(uint64_t frame_num, int l, int r,
+                                  size_t bytes) {
+    header.frame_num = frame_num;
+    header.m = 0;
+    header.l = l;
+    header.r = r;
+    header.pwr = 0;
+    header.bytes = bytes;
+}
+
+ZstdEncoder::ZstdEncoder(connection_hdl hdl, PacketSender &sender, int,
+                         const WaterfallDictionary *dictionary)
+    : WaterfallEncoder(hdl, sender), dictionary{dictionary},
+      frame_open{false}, delta_requested{false}, dictionary_requested{false},
+      delta{false}, dictionary_used{false}, previous_l{0}, previous_r{0} {
     stream = ZSTD_createCStream();
 }
 ZstdEncoder::~ZstdEncoder() { ZSTD_freeCStream(stream); }
 
+uint8_t *ZstdEncoder::reserve_output(size_t bytes) {
+    // Leaves room to end the frame as well
+    size_t bound = ZSTD_compressBound(bytes) + 64;
+    if (output.size() < bound) {
+        output.resize(bound);
+    }
+    return output.data();
+}
+
+void ZstdEncoder::set_coding(bool delta, bool dictionary) {
+    delta_requested = delta;
+    dictionary_requested = dictionary;
+}
+
+size_t ZstdEncoder::apply_coding() {
+    bool delta = delta_requested;
+    bool use_dictionary =
+        dictionary_requested && dictionary && dictionary->get();
+    if (delta != this->delta) {
+        // The first row is sent as is
+        previous.clear();
+        this->delta = delta;
+    }
+    if (use_dictionary == dictionary_used) {
+        return 0;
+    }
+    // The dictionary can only change between frames, the decoder continues
+    // from the end of one into the next
+    size_t end_size = 0;
+    if (frame_open) {
+        ZSTD_inBuffer none = {nullptr, 0, 0};
+        ZSTD_outBuffer packet_out = {reserve_output(0), output.size(), 0};
+        ZSTD_compressStream2(stream, &packet_out, &none, ZSTD_e_end);
+        end_size = packet_out.pos;
+        frame_open = false;
+    }
+    ZSTD_CCtx_refCDict(stream, use_dictionary ? dictionary->get() : nullptr);
+    dictionary_used = use_dictionary;
+    return end_size;
+}
+
 int ZstdEncoder::send(const void *buffer, size_t bytes, uint64_t frame_num,
                       int l, int r) {
-    set_data(frame_num, l, r);
-    packet["data"] = json::binary(
-        std::vector<uint8_t>((uint8_t *)buffer, (uint8_t *)buffer + bytes));
-    auto cbor = json::to_cbor(packet);
-    boost::container::small_vector<uint8_t, 4096> zstd_packet;
-    zstd_packet.resize(ZSTD_compressBound(cbor.size()));
-    ZSTD_inBuffer data = {cbor.data(), cbor.size(), 0};
-    ZSTD_outBuffer packet_out = {zstd_packet.data(), zstd_packet.size(), 0};
+    packet_framing framing = this->framing;
+    size_t end_size = apply_coding();
+    // The client predicts the same way from the last row it decoded
+    if (delta) {
+        const int8_t *row = (const int8_t *)buffer;
+        bool predicted =
+            previous.size() == bytes && previous_l == l && previous_r == r;
+        if (predicted) {
+            residual.resize(bytes);
+            waterfall_delta_encode(residual.data(), row, previous.data(),
+                                   bytes);
+        }
+        previous.assign(row, row + bytes);
+        previous_l = l;
+        previous_r = r;
+        if (predicted) {
+            buffer = residual.data();
+        }
+    }
+    const void *src = buffer;
+    size_t src_size = bytes;
+    std::vector<uint8_t> cbor;
+    if (framing == FRAMING_CBOR) {
+        set_data(frame_num, l, r);
+        packet["data"] = json::binary(
+            std::vector<uint8_t>((uint8_t *)buffer, (uint8_t *)buffer + bytes));
+        cbor = json::to_cbor(packet);
+        src = cbor.data();
+        src_size = cbor.size();
+    }
+
+    // The row is compressed straight into the reused output buffer, after
+    // the end of the previous frame if the coding changed
+    ZSTD_inBuffer data = {src, src_size, 0};
+    ZSTD_outBuffer packet_out = {reserve_output(src_size), output.size(),
+                                 end_size};
     ZSTD_compressStream2(stream, &packet_out, &data, ZSTD_e_flush);
-    sender.send_binary_packet(hdl, packet_out.dst, packet_out.pos);
+    frame_open = true;
+    if (framing == FRAMING_BINARY) {
+        set_header(frame_num, l, r, bytes);
+        sender.send_binary_packet(
+            hdl, {{&header, sizeof(header)}, {output.data(), packet_out.pos}});
+    } else {
+        sender.send_binary_packet(hdl, output.data(), packet_out.pos);
+    }
     return 0;
 }
 
+int ZstdEncoder::send_tiles(std::span<const std::vector<uint8_t>> tiles,
+                            size_t bytes, uint64_t frame_num, int l, int r) {
+    // The tiles are the rows as is, predicted rows need the stream
+    if (delta_requested) {
+        return -1;
+    }
+    // The coding changes here as well, and the next predicted row starts
+    // over since this one bypassed the prediction
+    size_t end_size = apply_coding();
+    previous.clear();
+    boost::container::small_vector<std::pair<const void *, size_t>, 32> parts;
+    if (framing == FRAMING_BINARY) {
+        // Ends the frame left open by send, the tiles are frames of their own
+        if (frame_open) {
+            ZSTD_inBuffer none = {nullptr, 0, 0};
+            ZSTD_outBuffer packet_out = {reserve_output(0), output.size(),
+                                         end_size};
+            ZSTD_compressStream2(stream, &packet_out, &none, ZSTD_e_end);
+            end_size = packet_out.pos;
+            frame_open = false;
+        }
+        set_header(frame_num, l, r, bytes);
+        parts.emplace_back(&header, sizeof(header));
+        parts.emplace_back(output.data(), end_size);
+        for (auto &tile : tiles) {
+            parts.emplace_back(tile.data(), tile.size());
+        }
+        sender.send_binary_packet(
+            hdl, packet_buffers_t(parts.data(), parts.size()));
+        return 0;
+    }
+
+    // Decompresses to the same CBOR as send, the tiles only hold the data
+    // bytes so the rest of the packet is framed around them
+    // Every piece is a complete zstd frame that the decoder continues with
+    uint8_t cbor_header[16] = {0xa4, 0x64, 'd', 'a', 't', 'a'};
+    size_t header_size = 6;
+    if (bytes < 24) {
+        cbor_header[header_size++] = 0x40 | bytes;
+    } else if (bytes < 0x100) {
+        cbor_header[header_size++] = 0x58;
+        cbor_header[header_size++] = bytes;
+    } else if (bytes < 0x10000) {
+        cbor_header[header_size++] = 0x59;
+        cbor_header[header_size++] = bytes >> 8;
+        cbor_header[header_size++] = bytes;
+    } else {
+        cbor_header[header_size++] = 0x5a;
+        for (int i = 3; i >= 0; i--) {
+            cbor_header[header_size++] = bytes >> (i * 8);
+        }
+    }
+    // Keys are sorted so the rest follow data, without their map header
+    json trailer = {{"frame_num", frame_num}, {"l", l}, {"r", r}};
+    auto trailer_cbor = json::to_cbor(trailer);
+
+    // Ending the frame also ends the one left open by send
+    ZSTD_outBuffer packet_out = {
+        reserve_output(end_size + header_size + trailer_cbor.size()),
+        output.size(), end_size};
+    ZSTD_inBuffer data = {cbor_header, header_size, 0};
+    ZSTD_compressStream2(stream, &packet_out, &data, ZSTD_e_end);
+    size_t header_frame = packet_out.pos;
+    data = {trailer_cbor.data() + 1, trailer_cbor.size() - 1, 0};
+    ZSTD_compressStream2(stream, &packet_out, &data, ZSTD_e_end);
+    frame_open = false;
+
+    parts.emplace_back(output.data(), header_frame);
+    for (auto &tile : tiles) {
+        parts.emplace_back(tile.data(), tile.size());
+    }
+    parts.emplace_back(output.data() + header_frame,
+                       packet_out.pos - header_frame);
+    sender.send_binary_packet(hdl,
+                              packet_buffers_t(parts.data(), parts.size()));
+    return 0;
+}
+
+void WaterfallTiles::reset(int tile_size, const int8_t *rows, int size,
+                           int levels) {
+    this->tile_size = tile_size;
+    this->rows = rows;
+    this->size = size;
+    level_tiles.clear();
+    level_offsets.clear();
+    int tiles = 0;
+    int offset = 0;
+    for (int i = 0; tile_size && i < levels; i++) {
+        level_tiles.push_back(tiles);
+        level_offsets.push_back(offset);
+        tiles += ((size >> i) + tile_size - 1) / tile_size;
+        offset += size >> i;
+    }
+    // One past the last level
+    level_tiles.push_back(tiles);
+    needed.assign(tiles, 0);
+    compressed.resize(tiles);
+    pending.reserve(tiles);
+}
+
+bool WaterfallTiles::aligned(int level, int l, int r) const {
+    if (!tile_size || level < 0 || level >= (int)level_offsets.size()) {
+        return false;
+    }
+    int level_size = size >> level;
+    return l >= 0 && l < r && r <= level_size && l % tile_size == 0 &&
+           (r % tile_size == 0 || r == level_size);
+}
+
+void WaterfallTiles::request(int level, int l, int r) {
+    if (!aligned(level, l, r)) {
+        return;
+    }
+    int first = level_tiles[level] + l / tile_size;
+    int last = level_tiles[level] + (r + tile_size - 1) / tile_size;
+    std::fill(needed.begin() + first, needed.begin() + last, 1);
+}
+
+int WaterfallTiles::compress() {
+    pending.clear();
+    for (int i = 0; i < (int)needed.size(); i++) {
+        if (needed[i]) {
+            pending.push_back(i);
+        }
+    }
+    std::atomic<int> failed{0};
+    dsp_parallel_for(pending.size(), [&](size_t i) {
+        if (!compress_tile(pending[i])) {
+            failed++;
+        }
+    });
+    return failed;
+}
+
+bool WaterfallTiles::compress_tile(int idx) {
+    thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(
+        ZSTD_createCCtx(), ZSTD_freeCCtx);
+    int level = std::upper_bound(level_tiles.begin(), level_tiles.end(), idx) -
+                level_tiles.begin() - 1;
+    int start = (idx - level_tiles[level]) * tile_size;
+    int len = std::min(tile_size, (size >> level) - start);
+
+    // A tile that failed keeps the bytes of an older frame, so it must not
+    // be sent
+    auto &tile = compressed[idx];
+    try {
+        if (!cctx) {
+            throw std::bad_alloc();
+        }
+        tile.resize(ZSTD_compressBound(len));
+    } catch (...) {
+        needed[idx] = 0;
+        return false;
+    }
+    size_t compressed_size = ZSTD_compressCCtx(
+        cctx.get(), tile.data(), tile.size(),
+        rows + level_offsets[level] + start, len, ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(compressed_size)) {
+        needed[idx] = 0;
+        return false;
+    }
+    tile.resize(compressed_size);
+    return true;
+}
+
+bool WaterfallTiles::covers(int level, int l, int r) const {
+    if (!aligned(level, l, r)) {
+        return false;
+    }
+    int first = level_tiles[level] + l / tile_size;
+    int last = level_tiles[level] + (r + tile_size - 1) / tile_size;
+    return std::all_of(needed.begin() + first, needed.begin() + last,
+                       [](uint8_t n) { return n; });
+}
+
+std::span<const std::vector<uint8_t>> WaterfallTiles::get(int level, int l,
+                                                          int r) const {
+    int first = level_tiles[level] + l / tile_size;
+    int last = level_tiles[level] + (r + tile_size - 1) / tile_size;
+    return {compressed.data() + first, (size_t)(last - first)};
+}
+
+WaterfallHistory::WaterfallHistory(int num_rows, int first_level,
+                                   int levels, int size, int tile_size)
+    : first_level{first_level}, num_levels{levels}, size{size},
+      tile_size{tile_size}, rows(num_rows), head{0}, count{0},
+      subscribers{0} {
+    for (auto &row : rows) {
+        row.levels.resize(levels);
+    }
+}
+
+void WaterfallHistory::subscribe() {
+    if (subscribers++ == 0) {
+        // Nothing was kept since the last one left, the old rows would
+        // leave a gap before the live ones
+        std::scoped_lock lk(mtx);
+        count = 0;
+    }
+}
+
+void WaterfallHistory::unsubscribe() { subscribers--; }
+
+void WaterfallHistory::request(WaterfallTiles &tiles) const {
+    for (int i = first_level; i < first_level + num_levels; i++) {
+        tiles.request(i, 0, size >> i);
+    }
+}
+
+void WaterfallHistory::add(uint64_t frame_num, const WaterfallTiles &tiles) {
+    if (rows.empty()) {
+        return;
+    }
+    std::scoped_lock lk(mtx);
+    // Frames are compressed on the DSP pool and may finish out of order,
+    // a late one is dropped to keep the rows in order
+    if (count &&
+        frame_num <= rows[(head + rows.size() - 1) % rows.size()].frame_num) {
+        return;
+    }
+    // The buffers of the oldest row are reused, so this stops allocating
+    // once the ring has gone round
+    row &slot = rows[head];
+    slot.frame_num = frame_num;
+    for (int i = 0; i < num_levels; i++) {
+        level_row &dst = slot.levels[i];
+        int level = first_level + i;
+        dst.data.clear();
+        dst.offsets.clear();
+        if (!tiles.covers(level, 0, size >> level)) {
+            continue;
+        }
+        dst.offsets.push_back(0);
+        for (auto &tile : tiles.get(level, 0, size >> level)) {
+            dst.data.insert(dst.data.end(), tile.begin(), tile.end());
+            dst.offsets.push_back(dst.data.size());
+        }
+    }
+    head = (head + 1) % rows.size();
+    count = std::min(count + 1, rows.size());
+}
+
+void WaterfallHistory::send(PacketSender &sender, connection_hdl hdl,
+                            int level, int l, int r, int shift,
+                            uint64_t next_frame) {
+    int idx = level - first_level;
+    if (idx < 0 || idx >= num_levels || l < 0 || l >= r) {
+        return;
+    }
+    int level_size = size >> level;
+    int first = l / tile_size;
+    int last = (std::min(r, level_size) + tile_size - 1) / tile_size;
+    int tile_l = first * tile_size;
+    int tile_r = std::min(last * tile_size, level_size);
+
+    std::scoped_lock lk(mtx);
+    // The parts point into the headers, so they may not move
+    std::vector<waterfall_history_row> headers;
+    headers.reserve(count);
+    std::vector<std::pair<const void *, size_t>> parts;
+    parts.reserve(count * 2 + 1);
+    waterfall_history_header start = {~0ULL, 0, 0, next_frame};
+    parts.emplace_back(&start, sizeof(start));
+    for (size_t i = 0; i < count; i++) {
+        const row &slot = rows[(head + rows.size() - count + i) % rows.size()];
+        const level_row &src = slot.levels[idx];
+        if (slot.frame_num >= next_frame || (int)src.offsets.size() <= last) {
+            continue;
+        }
+        size_t begin = src.offsets[first];
+        size_t end = src.offsets[last];
+        waterfall_history_row &header = headers.emplace_back();
+        header.header.frame_num = slot.frame_num;
+        header.header.m = 0;
+        header.header.l = tile_l << shift;
+        header.header.r = tile_r << shift;
+        header.header.pwr = 0;
+        header.header.bytes = tile_r - tile_l;
+        header.payload = end - begin;
+        header.reserved = 0;
+        parts.emplace_back(&header, sizeof(header));
+        parts.emplace_back(&src.data[begin], end - begin);
+    }
+    if (headers.empty()) {
+        return;
+    }
+    start.rows = headers.size();
+    sender.send_binary_packet(hdl,
+                              packet_buffers_t(parts.data(), parts.size()));
+}
+
 #ifdef HAS_LIBAOM
-AV1Encoder::AV1Encoder(connection_hdl hdl, PacketSender &sender,
-                       int waterfall_size)
-    : WaterfallEncoder(hdl, sender), frames{0}, line{0} {
+AV1Stream::AV1Stream(int width, DSPThreadPool &pool)
+    : width{width}, pool{pool}, line{0}, next_frame{0}, encoding{false},
+      need_keyframe{true}, frames{0}, failures{0} {
     aom_codec_err_t err;
+    filling.rows.resize(width * WATERFALL_COALESCE);
     encoder = aom_codec_av1_cx();
     if (!encoder) {
         std::cout << "no encoder" << '\n';
     }
-    if (!aom_img_alloc(&image, AOM_IMG_FMT_I420, waterfall_size,
-                       WATERFALL_COALESCE, 1)) {
+    if (!aom_img_alloc(&image, AOM_IMG_FMT_I420, width, WATERFALL_COALESCE,
+                       1)) {
         std::cout << "no image" << '\n';
     }
     image.monochrome = 1;
@@ -54,13 +492,23 @@ AV1Encoder::AV1Encoder(connection_hdl hdl, PacketSender &sender,
     if (err) {
         std::cout << "no config" << '\n';
     }
+    // Wide views are cut into up to 4 tile columns of at least 256 values,
+    // each encoded by its own thread
+    int tile_columns_log2 = 0;
+    while (tile_columns_log2 < 2 && (width >> (tile_columns_log2 + 1)) >= 256) {
+        tile_columns_log2++;
+    }
     cfg.g_h = WATERFALL_COALESCE;
-    cfg.g_w = waterfall_size;
+    cfg.g_w = width;
+    cfg.g_threads = 1 << tile_columns_log2;
     cfg.g_bit_depth = AOM_BITS_8;
     cfg.g_input_bit_depth = 8;
     cfg.g_profile = 0;
     cfg.g_pass = AOM_RC_ONE_PASS;
     cfg.g_lag_in_frames = 0;
+    // Late subscribers get a forced keyframe, this bounds the recovery of
+    // clients that lost a packet anyway
+    cfg.kf_max_dist = 64;
 
     cfg.rc_end_usage = AOM_CQ;
     // cfg.rc_target_bitrate = 8;
@@ -76,55 +524,238 @@ AV1Encoder::AV1Encoder(connection_hdl hdl, PacketSender &sender,
     }
     aom_codec_control(&codec, AOME_SET_CPUUSED, 8);
     aom_codec_control(&codec, AOME_SET_CQ_LEVEL, 63 - 51);
+    aom_codec_control(&codec, AV1E_SET_ROW_MT, 1);
+    aom_codec_control(&codec, AV1E_SET_TILE_COLUMNS, tile_columns_log2);
     // lossless
     AOM_CODEC_CONTROL_TYPECHECKED(&codec, AV1E_SET_LOSSLESS, 1);
     aom_img_add_metadata(&image, 4, (const uint8_t *)header_multi_compressed,
                          sizeof(header_multi_compressed), AOM_MIF_ANY_FRAME);
 }
-int AV1Encoder::send(const void *buffer, size_t bytes, uint64_t frame_num,
-                     int l, int r) {
-    aom_codec_err_t err;
-    const uint8_t *buffer_arr = (uint8_t *)buffer;
+
+AV1Stream::~AV1Stream() {
+    aom_img_free(&image);
+    aom_codec_destroy(&codec);
+}
+
+void AV1Stream::subscribe(const void *owner, connection_hdl hdl,
+                          PacketSender &sender,
+                          const std::atomic<packet_framing> &framing) {
+    std::scoped_lock lk(subscribers_mtx);
+    subscribers.push_back({owner, hdl, &sender, &framing, false});
+    need_keyframe = true;
+}
+
+void AV1Stream::unsubscribe(const void *owner) {
+    std::scoped_lock lk(subscribers_mtx);
+    std::erase_if(subscribers,
+                  [&](const subscriber &sub) { return sub.owner == owner; });
+}
+
+void AV1Stream::add_row(const void *buffer, size_t bytes, uint64_t frame_num,
+                        int l, int r) {
+    if ((int)bytes != width) {
+        return;
+    }
+    std::scoped_lock lk(mtx);
+    // Another subscriber already added this frame, or a newer one
+    if (frame_num < next_frame) {
+        return;
+    }
+    next_frame = frame_num + 1;
+    const uint8_t *buffer_arr = (const uint8_t *)buffer;
+    uint8_t *row = &filling.rows[line * width];
+    for (int i = 0; i < width; i++) {
+        row[i] = buffer_arr[i] ^ 0x80;
+    }
+    filling.headers[line] = {frame_num, (uint32_t)bytes, (uint32_t)l,
+                             (uint32_t)r};
+    if (++line < WATERFALL_COALESCE) {
+        return;
+    }
+    line = 0;
+
+    // The encoder fell behind, the oldest rows are lost for everyone
+    if (pending.size() >= 4) {
+        spare.push_back(std::move(pending.front()));
+        pending.pop_front();
+        need_keyframe = true;
+    }
+    pending.push_back(std::move(filling));
+    if (spare.empty()) {
+        filling.rows.resize(width * WATERFALL_COALESCE);
+    } else {
+        filling = std::move(spare.back());
+        spare.pop_back();
+    }
+    if (!encoding) {
+        encoding = true;
+        pool.post([self = shared_from_this()]() { self->encode_pending(); });
+    }
+}
+
+void AV1Stream::encode_pending() {
+    while (true) {
+        batch b;
+        {
+            std::scoped_lock lk(mtx);
+            if (pending.empty()) {
+                encoding = false;
+                return;
+            }
+            b = std::move(pending.front());
+            pending.pop_front();
+        }
+        try {
+            encode(b);
+        } catch (const std::exception &e) {
+            if (failures++ % 100 == 0) {
+                std::cout << "AV1 waterfall encoding failed: " << e.what()
+                          << ", " << failures << " batches lost"
+                          << std::endl;
+            }
+            // The subscribers lost a frame the next ones refer to
+            need_keyframe = true;
+        } catch (...) {
+            if (failures++ % 100 == 0) {
+                std::cout << "AV1 waterfall encoding failed, " << failures
+                          << " batches lost" << std::endl;
+            }
+            need_keyframe = true;
+        }
+        std::scoped_lock lk(mtx);
+        spare.push_back(std::move(b));
+    }
+}
+
+void AV1Stream::encode(batch &b) {
     int stride = image.stride[0];
-    for (size_t i = 0; i < bytes; i++) {
-        image.planes[0][i + line * stride] = buffer_arr[i] ^ 0x80;
-    }
-
-    header_multi[line].frame_num = frame_num;
-    header_multi[line].bytes = bytes;
-    header_multi[line].l = l;
-    header_multi[line].r = r;
-
-    line++;
-    if (line == WATERFALL_COALESCE) {
-        // const aom_metadata_t *metadata = aom_img_get_metadata(&image, 0);
-        aom_img_remove_metadata(&image);
-        header_multi_compressed[0] = 0;
-        size_t metadata_sz = ZSTD_compress(
-            &header_multi_compressed[1], sizeof(header_multi_compressed),
-            header_multi, sizeof(header_multi), 5);
-        aom_img_add_metadata(&image, OBU_METADATA_TYPE_ITUT_T35,
-                             (const uint8_t *)header_multi_compressed,
-                             metadata_sz + 1, AOM_MIF_ANY_FRAME);
-        // memcpy(metadata->payload, header_multi_u32, (1 + 4 * 8) * 4);
-
-        err = aom_codec_encode(&codec, &image, frames, 1, 0);
-        if (err < 0) {
-            throw std::runtime_error("AV1 Encode");
-        }
-        const aom_codec_cx_pkt_t *pkt = NULL;
-        aom_codec_iter_t iter = NULL;
-        while ((pkt = aom_codec_get_cx_data(&codec, &iter)) != NULL) {
-            if (pkt->kind == AOM_CODEC_CX_FRAME_PKT) {
-                send_packet(pkt->data.frame.buf, pkt->data.frame.sz);
+    for (int i = 0; i < WATERFALL_COALESCE; i++) {
+        memcpy(image.planes[0] + i * stride, &b.rows[i * width], width);
+    }
+    // const aom_metadata_t *metadata = aom_img_get_metadata(&image, 0);
+    aom_img_remove_metadata(&image);
+    header_multi_compressed[0] = 0;
+    size_t metadata_sz = ZSTD_compress(
+        &header_multi_compressed[1], sizeof(header_multi_compressed) - 1,
+        b.headers, sizeof(b.headers), 5);
+    aom_img_add_metadata(&image, OBU_METADATA_TYPE_ITUT_T35,
+                         (const uint8_t *)header_multi_compressed,
+                         metadata_sz + 1, AOM_MIF_ANY_FRAME);
+
+    bool keyframe = need_keyframe.exchange(false);
+    aom_codec_err_t err = aom_codec_encode(&codec, &image, frames++, 1,
+                                           keyframe ? AOM_EFLAG_FORCE_KF : 0);
+    if (err < 0) {
+        throw std::runtime_error("AV1 Encode");
+    }
+    bitstream.clear();
+    const aom_codec_cx_pkt_t *pkt = NULL;
+    aom_codec_iter_t iter = NULL;
+    while ((pkt = aom_codec_get_cx_data(&codec, &iter)) != NULL) {
+        if (pkt->kind == AOM_CODEC_CX_FRAME_PKT) {
+            keyframe |= (pkt->data.frame.flags & AOM_FRAME_IS_KEY) != 0;
+            const uint8_t *data = (const uint8_t *)pkt->data.frame.buf;
+            bitstream.insert(bitstream.end(), data,
+                             data + pkt->data.frame.sz);
+        }
+    }
+    if (bitstream.empty()) {
+        return;
+    }
+    // Binary framing describes the packet by its first row, the rows
+    // themselves are described by the metadata in the bitstream
+    binary_packet_header header = {b.headers[0].frame_num,
+                                   0,
+                                   (int32_t)b.headers[0].l,
+                                   (int32_t)b.headers[0].r,
+                                   0,
+                                   (uint32_t)(width * WATERFALL_COALESCE)};
+
+    std::scoped_lock lk(subscribers_mtx);
+    for (auto &sub : subscribers) {
+        // The connection may close while it is looked up
+        try {
+            // Slow clients drop packets and wait for a keyframe to catch up
+            if (sub.sender->get_buffered_amount(sub.hdl) > 50000) {
+                if (sub.synced) {
+                    sub.synced = false;
+                    need_keyframe = true;
+                }
+                continue;
+            }
+            if (!sub.synced && !keyframe) {
+                continue;
+            }
+            if (*sub.framing == FRAMING_BINARY) {
+                sub.sender->send_binary_packet(
+                    sub.hdl, {{&header, sizeof(header)},
+                              {bitstream.data(), bitstream.size()}});
+            } else {
+                sub.sender->send_binary_packet(sub.hdl, bitstream.data(),
+                                               bitstream.size());
             }
+            sub.synced = true;
+        } catch (...) {
+            sub.synced = false;
         }
-        line = 0;
     }
+}
+
+AV1Streams::AV1Streams(int threads)
+    : pool(threads > 0
+               ? threads
+               : std::max(1u, std::thread::hardware_concurrency() / 4),
+           {}) {}
+
+std::shared_ptr<AV1Stream> AV1Streams::get(int level, int l, int r,
+                                           int width) {
+    std::scoped_lock lk(mtx);
+    std::erase_if(streams, [](auto &it) { return it.second.expired(); });
+    auto &entry = streams[{level, l, r, width}];
+    auto stream = entry.lock();
+    if (!stream) {
+        stream = std::make_shared<AV1Stream>(width, pool);
+        entry = stream;
+    }
+    return stream;
+}
+
+AV1Encoder::AV1Encoder(connection_hdl hdl, PacketSender &sender,
+                       AV1Streams &streams)
+    : WaterfallEncoder(hdl, sender), streams{streams}, view{-1, 0, 0},
+      stream_view{-1, 0, 0} {}
+
+void AV1Encoder::set_view(int level, int l, int r) {
+    std::scoped_lock lk(view_mtx);
+    view = {level, l, r};
+}
+
+int AV1Encoder::send(const void *buffer, size_t bytes, uint64_t frame_num,
+                     int l, int r) {
+    std::tuple<int, int, int> view;
+    {
+        std::scoped_lock lk(view_mtx);
+        view = this->view;
+    }
+    // A row read before the view changed would give the stream the wrong
+    // width, the width is part of the key so it gets a stream of its own
+    if (!stream || view != stream_view ||
+        stream->get_width() != (int)bytes) {
+        if (stream) {
+            stream->unsubscribe(this);
+        }
+        auto &[level, view_l, view_r] = view;
+        stream = streams.get(level, view_l, view_r, bytes);
+        stream->subscribe(this, hdl, sender, framing);
+        stream_view = view;
+    }
+    stream->add_row(buffer, bytes, frame_num, l, r);
     return 0;
 }
+
 AV1Encoder::~AV1Encoder() {
-    aom_img_free(&image);
-    aom_codec_destroy(&codec);
+    if (stream) {
+        stream->unsubscribe(this);
+    }
 }
 #endif
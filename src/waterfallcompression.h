@@ -2,6 +2,7 @@
 #define WATERFALLCOMPRESSION_H
 
 #include "client.h"
+#include "utils/threadpool.h"
 
 #include <nlohmann/json.hpp>
 using json = nlohmann::json;
@@ -11,56 +12,336 @@ using json = nlohmann::json;
 #include "aom/aomcx.h"
 #endif
 
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <tuple>
+#include <vector>
+
 #include <zstd.h>
 
 #define WATERFALL_COALESCE 8
 
+class AV1Streams;
+
+// Zstd dictionary trained on delta coded waterfall rows, loaded once and
+// referenced by every encoder of the clients that fetched it
+class WaterfallDictionary {
+  public:
+    // Returns false if the file cannot be read or is not a zstd dictionary
+    bool load(const std::string &filename);
+    // Trains a dictionary from samples concatenated in buffer and stores it
+    static bool train(const std::string &filename,
+                      const std::vector<uint8_t> &buffer,
+                      const std::vector<size_t> &sample_sizes,
+                      size_t dictionary_size);
+    const ZSTD_CDict *get() const { return cdict; }
+    unsigned id() const { return dict_id; }
+    // Raw dictionary, served to the clients
+    const std::string &content() const { return bytes; }
+    ~WaterfallDictionary();
+
+  protected:
+    std::string bytes;
+    ZSTD_CDict *cdict = nullptr;
+    unsigned dict_id = 0;
+};
+
+// Replaces row with its difference from the previous row, both size long
+void waterfall_delta_encode(int8_t *residual, const int8_t *row,
+                            const int8_t *previous, size_t size);
+
+// Waterfall rows cut into fixed width tiles, each tile is compressed once per
+// frame and shared by every client whose view is made of whole tiles
+class WaterfallTiles {
+  public:
+    // Starts a new frame, level i of the rows is size >> i wide and follows
+    // the previous level, a tile_size of 0 disables the tiles
+    void reset(int tile_size, const int8_t *rows, int size, int levels);
+    // Marks the tiles of [l, r) as needed, unaligned ranges are ignored
+    void request(int level, int l, int r);
+    // Compresses the needed tiles into independent zstd frames, returns
+    // how many failed. Those are no longer needed, so covers leaves them out
+    int compress();
+    // Whether [l, r) is made of whole tiles that were compressed
+    bool covers(int level, int l, int r) const;
+    // Compressed tiles of [l, r), only valid if covers is true
+    std::span<const std::vector<uint8_t>> get(int level, int l, int r) const;
+
+  protected:
+    bool aligned(int level, int l, int r) const;
+    // Returns false and clears the tile's needed flag if it failed
+    bool compress_tile(int idx);
+
+    int tile_size = 0;
+    const int8_t *rows = nullptr;
+    int size = 0;
+    // Index of the first tile and the first value of each level
+    std::vector<int> level_tiles;
+    std::vector<int> level_offsets;
+    std::vector<uint8_t> needed;
+    std::vector<int> pending;
+    std::vector<std::vector<uint8_t>> compressed;
+};
+
+// Starts a history message, the marker is all ones so it is never taken for
+// the binary_packet_header of a row or the start of a zstd frame
+// next_frame is the frame of the live row sent right after the message, the
+// history holds the rows before it. Archive messages leave it 0
+struct waterfall_history_header {
+    uint64_t marker;
+    uint32_t rows;
+    uint32_t reserved;
+    uint64_t next_frame;
+};
+static_assert(sizeof(waterfall_history_header) == 24);
+// Precedes each row of a history message, the row is payload bytes of
+// independent zstd frames that decompress to header.bytes values
+struct waterfall_history_row {
+    binary_packet_header header;
+    uint32_t payload;
+    uint32_t reserved;
+};
+static_assert(sizeof(waterfall_history_row) == 40);
+// Row of an archive message, which is otherwise laid out like a history
+// message, the payload is a single zstd frame of the whole level
+struct waterfall_archive_row {
+    binary_packet_header header;
+    uint32_t payload;
+    uint32_t reserved;
+    // Milliseconds since the epoch
+    int64_t time_ms;
+};
+static_assert(sizeof(waterfall_archive_row) == 48);
+
+// The last rows of the coarser main levels in their compressed tile form,
+// sent in one message to clients that connect or move their view so their
+// screen fills at once
+class WaterfallHistory {
+  public:
+    // Keeps num_rows rows of the levels [first_level, first_level + levels),
+    // level i is size >> i wide
+    WaterfallHistory(int num_rows, int first_level, int levels, int size,
+                     int tile_size);
+    int get_first_level() const { return first_level; }
+    int get_levels() const { return num_levels; }
+    // Clients that asked for the history, the rows are only kept while
+    // there is one. The rows from before the last one left are dropped
+    void subscribe();
+    void unsubscribe();
+    bool has_subscribers() const { return subscribers > 0; }
+    // Marks the tiles of the kept levels as needed
+    void request(WaterfallTiles &tiles) const;
+    // Stores the frame's tiles, levels that were not compressed are skipped
+    // and so are frames older than the newest row
+    void add(uint64_t frame_num, const WaterfallTiles &tiles);
+    // Sends the stored rows before next_frame of the tiles covering [l, r)
+    // of the level in one message, oldest first, with l and r scaled by
+    // shift like the rows
+    void send(PacketSender &sender, connection_hdl hdl, int level, int l,
+              int r, int shift, uint64_t next_frame);
+
+  protected:
+    struct level_row {
+        std::vector<uint8_t> data;
+        // Where each tile starts in data, and one past the last tile
+        std::vector<uint32_t> offsets;
+    };
+    struct row {
+        uint64_t frame_num;
+        std::vector<level_row> levels;
+    };
+
+    int first_level;
+    int num_levels;
+    int size;
+    int tile_size;
+    std::mutex mtx;
+    // Ring of rows, head is the next one written
+    std::vector<row> rows;
+    size_t head;
+    size_t count;
+    std::atomic<int> subscribers;
+};
+
 class WaterfallEncoder {
   public:
     WaterfallEncoder(connection_hdl hdl, PacketSender &sender)
-        : hdl{hdl}, sender{sender} {}
+        : hdl{hdl}, sender{sender}, framing{FRAMING_CBOR} {}
     virtual int send(const void *buffer, size_t bytes, uint64_t frame_num, int l, int r) = 0;
+    // Sends a row made of precompressed tiles, returns non zero if the
+    // encoder cannot send tiles and send has to be used instead
+    virtual int send_tiles(std::span<const std::vector<uint8_t>>, size_t,
+                           uint64_t, int, int) {
+        return -1;
+    }
+    void set_framing(packet_framing framing) { this->framing = framing; }
+    // Row prediction and dictionary, only the zstd encoder has them
+    virtual void set_coding(bool, bool) {}
+    // Level and range in the level the rows come from
+    virtual void set_view(int, int, int) {}
     virtual ~WaterfallEncoder(){};
 
   protected:
     void set_data(uint64_t frame_num, int l, int r);
+    void set_header(uint64_t frame_num, int l, int r, size_t bytes);
     void send_packet(void *packet, size_t bytes);
     websocketpp::connection_hdl hdl;
     PacketSender &sender;
 
+    std::atomic<packet_framing> framing;
     json packet;
+    binary_packet_header header;
 };
 
 class ZstdEncoder : public WaterfallEncoder {
   public:
-    ZstdEncoder(connection_hdl hdl, PacketSender &sender, int waterfall_size);
+    ZstdEncoder(connection_hdl hdl, PacketSender &sender, int waterfall_size,
+                const WaterfallDictionary *dictionary);
     int send(const void *buffer, size_t bytes, uint64_t frame_num, int l, int r);
+    int send_tiles(std::span<const std::vector<uint8_t>> tiles, size_t bytes,
+                   uint64_t frame_num, int l, int r);
+    // Rows are sent as their difference from the previous row when it had
+    // the same l, r and size, and compressed with the dictionary from the
+    // next zstd frame on. Takes effect with the next row
+    void set_coding(bool delta, bool dictionary);
     virtual ~ZstdEncoder();
 
   protected:
+    // Grows the output buffer to hold bytes once compressed
+    uint8_t *reserve_output(size_t bytes);
+    // Ends the open frame into the output buffer if the coding changed and
+    // applies the new one, returns the bytes written
+    size_t apply_coding();
+
     ZSTD_CStream *stream;
+    const WaterfallDictionary *dictionary;
+    // Whether the last packet left the zstd frame open for the next one
+    bool frame_open;
+    // Reused for every packet so compressing does not allocate
+    std::vector<uint8_t> output;
+
+    // Coding asked for by the client and the one the stream uses
+    std::atomic<bool> delta_requested;
+    std::atomic<bool> dictionary_requested;
+    bool delta;
+    bool dictionary_used;
+    // Last row sent and where it was, the prediction for the next one
+    std::vector<int8_t> previous;
+    int previous_l;
+    int previous_r;
+    std::vector<int8_t> residual;
 };
 
 #ifdef HAS_LIBAOM
-class AV1Encoder : public WaterfallEncoder {
+// One AV1 encode of a waterfall view, shared by every client with the same
+// level, l and r. Rows are added once per frame by whichever client gets
+// there first, every WATERFALL_COALESCE rows are encoded on the encoder pool
+// and the bitstream is sent to all the subscribers
+class AV1Stream : public std::enable_shared_from_this<AV1Stream> {
   public:
-    AV1Encoder(connection_hdl hdl, PacketSender &sender, int waterfall_size);
-    int send(const void *buffer, size_t bytes, uint64_t frame_num, int l, int r);
-    virtual ~AV1Encoder();
+    AV1Stream(int width, DSPThreadPool &pool);
+    AV1Stream(const AV1Stream &) = delete;
+    AV1Stream &operator=(const AV1Stream &) = delete;
+    ~AV1Stream();
+
+    // Subscribers start with the next keyframe, which is forced for them
+    // Each gets the bitstream in the framing it asked for, framing must
+    // outlive the subscription
+    void subscribe(const void *owner, connection_hdl hdl, PacketSender &sender,
+                   const std::atomic<packet_framing> &framing);
+    void unsubscribe(const void *owner);
+    // Rows of frames older than the last one added are ignored
+    void add_row(const void *buffer, size_t bytes, uint64_t frame_num, int l,
+                 int r);
+    int get_width() const { return width; }
 
   protected:
+    struct row_header {
+        uint64_t frame_num;
+        uint32_t bytes;
+        uint32_t l, r;
+    };
+    // WATERFALL_COALESCE rows waiting to be encoded
+    struct batch {
+        std::vector<uint8_t> rows;
+        row_header headers[WATERFALL_COALESCE];
+    };
+    struct subscriber {
+        const void *owner;
+        connection_hdl hdl;
+        PacketSender *sender;
+        const std::atomic<packet_framing> *framing;
+        // Received every packet since the last keyframe
+        bool synced;
+    };
+    // Encodes the pending batches in order, one task per stream at a time
+    void encode_pending();
+    void encode(batch &b);
+
+    int width;
+    DSPThreadPool &pool;
+
+    // Guards the rows being filled and the pending batches
+    std::mutex mtx;
+    batch filling;
+    int line;
+    uint64_t next_frame;
+    std::deque<batch> pending;
+    // Batches already encoded, reused so the rows do not allocate
+    std::vector<batch> spare;
+    bool encoding;
+
+    std::mutex subscribers_mtx;
+    std::vector<subscriber> subscribers;
+    std::atomic<bool> need_keyframe;
+
+    // Only touched by the encode task
     aom_codec_iface_t *encoder;
     aom_image_t image;
     aom_codec_enc_cfg_t cfg;
     aom_codec_ctx_t codec;
     int frames;
-    int line;
-    struct {
-        uint64_t frame_num;
-        uint32_t bytes;
-        uint32_t l, r;
-    } header_multi[WATERFALL_COALESCE];
+    // Batches that failed to encode, reported every hundred
+    uint64_t failures;
     uint8_t header_multi_compressed[4 * WATERFALL_COALESCE * 4 * 2];
+    std::vector<uint8_t> bitstream;
+};
+
+// The shared AV1 streams and the threads encoding them
+class AV1Streams {
+  public:
+    // Threads below 1 use a quarter of the cores
+    AV1Streams(int threads);
+    // Returns the stream of the view, creating it if no one has it yet
+    std::shared_ptr<AV1Stream> get(int level, int l, int r, int width);
+
+  protected:
+    std::mutex mtx;
+    std::map<std::tuple<int, int, int, int>, std::weak_ptr<AV1Stream>>
+        streams;
+    DSPThreadPool pool;
+};
+
+class AV1Encoder : public WaterfallEncoder {
+  public:
+    AV1Encoder(connection_hdl hdl, PacketSender &sender, AV1Streams &streams);
+    int send(const void *buffer, size_t bytes, uint64_t frame_num, int l, int r);
+    void set_view(int level, int l, int r);
+    virtual ~AV1Encoder();
+
+  protected:
+    AV1Streams &streams;
+    // View set by the client and the one the stream belongs to, the stream
+    // is switched by the next row
+    std::mutex view_mtx;
+    std::tuple<int, int, int> view;
+    std::tuple<int, int, int> stream_view;
+    std::shared_ptr<AV1Stream> stream;
 };
 #endif
 #endif
\ No newline at end of file
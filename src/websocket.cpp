@@ -2,9 +2,12 @@
 #include "signal.h"
 #include "spectrumserver.h"
 #include "waterfall.h"
+#include "utils/threadpool.h"
 
 #include "glaze/glaze.hpp"
 
+#include <bit>
+
 void broadcast_server::on_socket_init(
     websocketpp::connection_hdl, websocketpp::lib::asio::ip::tcp::socket &s) {
     websocketpp::lib::asio::ip::tcp::no_delay option(true);
@@ -51,6 +54,29 @@ void broadcast_server::send_basic_info(connection_hdl hdl) {
         {"fft_size", fft_size},
         {"fft_result_size", fft_result_size},
         {"waterfall_size", min_waterfall_fft},
+        {"fast_fft_size", fast_fft_size},
+        {"fast_waterfall_fps", fast_waterfall_fps},
+        {"waterfall_tiles", layout.tile_size},
+        // Clients may ask for binary_packet_header framing instead of CBOR
+        {"binary_framing", true},
+        // Zstd waterfall rows can be delta coded and use the dictionary
+        // served at /waterfall.dict, whose ID is given here or 0 if none
+        {"waterfall_delta", waterfall_compression == WATERFALL_ZSTD},
+        {"waterfall_dictionary",
+         waterfall_dictionary ? waterfall_dictionary->id() : 0},
+        // Seconds of rows sent on request when the view changes, 0 if none
+        {"waterfall_history", waterfall_history ? waterfall_history_seconds : 0},
+        // Levels served at /archive, 0 levels if the archive is disabled
+        {"waterfall_archive_level",
+         waterfall_archive ? waterfall_archive->get_first_level() : 0},
+        {"waterfall_archive_levels",
+         waterfall_archive ? waterfall_archive->get_levels() : 0},
+        // Level served at /statistics, -1 if they are disabled
+        {"statistics_level",
+         spectrum_statistics ? spectrum_statistics->get_level() : -1},
+        // Level the signals sent on the events socket are found on, -1 if
+        // the detector is disabled
+        {"detector_level", signal_detector ? signal_detector->get_level() : -1},
         {"basefreq", basefreq},
         {"total_bandwidth", is_real ? sps / 2 : sps},
         {"defaults",
@@ -66,9 +92,8 @@ void broadcast_server::send_basic_info(connection_hdl hdl) {
 }
 
 // PacketSender---------------------------------------------------------------
-void broadcast_server::send_binary_packet(
-    connection_hdl hdl,
-    const std::initializer_list<std::pair<const void *, size_t>> &bufs) {
+void broadcast_server::send_binary_packet(connection_hdl hdl,
+                                          packet_buffers_t bufs) {
     auto con = m_server.get_con_from_hdl(hdl);
     auto total_size =
         std::accumulate(bufs.begin(), bufs.end(), 0,
@@ -80,6 +105,11 @@ void broadcast_server::send_binary_packet(
     }
     con->send(msg_ptr);
 }
+void broadcast_server::send_binary_packet(
+    connection_hdl hdl,
+    const std::initializer_list<std::pair<const void *, size_t>> &bufs) {
+    send_binary_packet(hdl, packet_buffers_t(bufs.begin(), bufs.size()));
+}
 void broadcast_server::send_binary_packet(connection_hdl hdl, const void *buf,
                                           size_t len) {
     m_server.send(hdl, buf, len, websocketpp::frame::opcode::binary);
@@ -107,6 +137,9 @@ void broadcast_server::log(connection_hdl, const std::string &str) {
 std::string broadcast_server::ip_from_hdl(connection_hdl hdl) {
     return m_server.get_con_from_hdl(hdl)->get_remote_endpoint();
 }
+size_t broadcast_server::get_buffered_amount(connection_hdl hdl) {
+    return m_server.get_con_from_hdl(hdl)->get_buffered_amount();
+}
 waterfall_slices_t &broadcast_server::get_waterfall_slices() {
     return waterfall_slices;
 }
@@ -133,7 +166,9 @@ void broadcast_server::on_open_signal(connection_hdl hdl,
     int audio_fft_size = ceil((double)audio_max_sps * fft_size / sps / 4.) * 4;
     std::shared_ptr<AudioClient> client = std::make_shared<AudioClient>(
         hdl, *this, audio_compression, is_real, audio_fft_size, audio_max_sps,
-        fft_result_size);
+        fft_result_size, audio_ola);
+    server::connection_ptr con = m_server.get_con_from_hdl(hdl);
+    client->con = con;
 
     client->set_audio_demodulation(default_mode);
     {
@@ -144,44 +179,102 @@ void broadcast_server::on_open_signal(connection_hdl hdl,
     // Default slice
     client->set_audio_range(default_l, default_m, default_r);
 
-    server::connection_ptr con = m_server.get_con_from_hdl(hdl);
-
     con->set_close_handler(std::bind(&AudioClient::on_close, client));
     con->set_message_handler(std::bind(
         &broadcast_server::on_message, this, std::placeholders::_1,
         std::placeholders::_2, std::static_pointer_cast<Client>(client)));
 }
 
+// Splits the work into one contiguous chunk per DSP thread, the latch is
+// released once every chunk has been processed
+template <typename T, typename F>
+static void dispatch_chunks(DSPThreadPool &pool, std::vector<T> &work,
+                            CountdownLatch &latch, F fn) {
+    size_t num_chunks = std::min(work.size(), (size_t)pool.size());
+    latch.add(num_chunks);
+    for (size_t i = 0; i < num_chunks; i++) {
+        size_t begin = work.size() * i / num_chunks;
+        size_t end = work.size() * (i + 1) / num_chunks;
+        pool.post([&work, &latch, fn, begin, end]() {
+            try {
+                fn(std::span<T>(work.data() + begin, end - begin));
+            } catch (...) {
+            }
+            latch.count_down();
+        });
+    }
+}
+
 // Iterates through the client list to send the slices
-std::vector<std::future<void>> broadcast_server::signal_loop() {
+void broadcast_server::signal_loop(FFTFrame &frame) {
     int base_idx = 0;
     if (!is_real) {
         base_idx = fft_size / 2 + 1;
     }
     std::scoped_lock lg(signal_slice_mtx);
-    auto &io_service = m_server.get_io_service();
-
-    // Completion futures
-    std::vector<std::future<void>> futures;
-    futures.reserve(signal_slices.size());
-
-    // Send the apprioriate signal slice to the client
-    for (auto &[slice, data] : signal_slices) {
-        auto &[l_idx, r_idx] = slice;
-        // If the client is slow, avoid unnecessary buffering and drop the
-        // audio
-        auto con = m_server.get_con_from_hdl(data->hdl);
-        if (con->get_buffered_amount() > 50000) {
-            continue;
+
+    // Listeners with identical tunings are demodulated once, the first one
+    // does the work and its encoded audio is sent to the others as well
+    // Identical tunings share the same slice, so they are adjacent here
+    auto &signal_work = frame.signal_work;
+    signal_work.clear();
+    for (auto it = signal_slices.begin(); it != signal_slices.end();) {
+        auto range_end = signal_slices.upper_bound(it->first);
+        size_t range_first = signal_work.size();
+        for (; it != range_end; ++it) {
+            auto &[slice, data] = *it;
+            auto &[l_idx, r_idx] = slice;
+            // If the client is slow, avoid unnecessary buffering and drop
+            // the audio
+            if (!data->con || data->con->get_buffered_amount() > 50000) {
+                continue;
+            }
+            // Still sending an older frame, as a leader or a follower, skip
+            // this one so its audio stays in order
+            if (data->busy.exchange(true)) {
+                continue;
+            }
+            auto leader = std::find_if(
+                signal_work.begin() + range_first, signal_work.end(),
+                [&](auto &entry) { return entry.client->same_tuning(*data); });
+            if (leader != signal_work.end()) {
+                // Stays busy until the leader has sent this frame
+                leader->followers.push_back(data->hdl);
+                leader->follower_clients.push_back(data);
+                continue;
+            }
+            signal_work.push_back(
+                {data,
+                 &frame.fft_buffer[(l_idx + base_idx) % fft_result_size],
+                 data->get_tuning(),
+                 {},
+                 {}});
         }
-        // Equivalent to
-        // data->send_audio(&fft_buffer[(l_idx + base_idx) % fft_result_size],
-        // frame_num);
-        futures.emplace_back(io_service.post(boost::asio::use_future(std::bind(
-            &AudioClient::send_audio, data,
-            &fft_buffer[(l_idx + base_idx) % fft_result_size], frame_num))));
     }
-    return futures;
+
+    // Each DSP thread demodulates its chunk in groups so the IFFTs run
+    // batched
+    size_t batch_size = audio_batch;
+    dispatch_chunks(
+        *dsp_pool(), signal_work, frame.done,
+        [batch_size,
+         frame_num = frame.frame_num](std::span<audio_batch_entry> chunk) {
+            for (size_t i = 0; i < chunk.size(); i += batch_size) {
+                size_t len = std::min(batch_size, chunk.size() - i);
+                try {
+                    AudioClient::send_audio_batch(chunk.subspan(i, len),
+                                                  frame_num);
+                } catch (...) {
+                }
+                // Ready for the next frame
+                for (auto &entry : chunk.subspan(i, len)) {
+                    for (auto &follower : entry.follower_clients) {
+                        follower->busy.store(false);
+                    }
+                    entry.client->busy.store(false);
+                }
+            }
+        });
 }
 
 void broadcast_server::on_open_waterfall(connection_hdl hdl) {
@@ -189,7 +282,10 @@ void broadcast_server::on_open_waterfall(connection_hdl hdl) {
 
     // Set default to the entire spectrum
     std::shared_ptr<WaterfallClient> client = std::make_shared<WaterfallClient>(
-        hdl, *this, waterfall_compression, min_waterfall_fft);
+        hdl, *this, waterfall_compression, layout, zoom_config,
+        shared_waterfall);
+    server::connection_ptr con = m_server.get_con_from_hdl(hdl);
+    client->con = con;
     {
         std::scoped_lock lk(waterfall_slice_mtx[0]);
         auto it = waterfall_slices[0].insert({{0, min_waterfall_fft}, client});
@@ -197,40 +293,134 @@ void broadcast_server::on_open_waterfall(connection_hdl hdl) {
     }
     client->set_waterfall_range(downsample_levels - 1, 0, min_waterfall_fft);
 
-    server::connection_ptr con = m_server.get_con_from_hdl(hdl);
     con->set_close_handler(std::bind(&WaterfallClient::on_close, client));
     con->set_message_handler(std::bind(
         &broadcast_server::on_message, this, std::placeholders::_1,
         std::placeholders::_2, std::static_pointer_cast<Client>(client)));
 }
 
-std::vector<std::future<void>>
-broadcast_server::waterfall_loop(int8_t *fft_power_quantized) {
-    // Completion futures
-    std::vector<std::future<void>> futures;
-    futures.reserve(signal_slices.size());
+void broadcast_server::zoom_loop(FFTFrame &frame) {
+    auto &zoom_work = frame.zoom_work;
+    zoom_work.clear();
+    {
+        std::scoped_lock lg(waterfall_slice_mtx[downsample_levels]);
+        for (auto &[slice, data] : waterfall_slices[downsample_levels]) {
+            if (!data->con) {
+                continue;
+            }
+            // Still on an older frame, the zoom starts its baseband over
+            // from the next one it gets
+            if (data->busy.exchange(true)) {
+                continue;
+            }
+            // Slow clients keep their baseband but skip the row
+            bool send = frame.waterfall &&
+                        data->con->get_buffered_amount() <= 50000;
+            zoom_work.emplace_back(data, send);
+        }
+    }
+
+    dispatch_chunks(
+        *dsp_pool(), zoom_work, frame.done,
+        [fft_buffer = frame.fft_buffer, frame_num = frame.frame_num](
+            std::span<std::pair<std::shared_ptr<WaterfallClient>, bool>>
+                chunk) {
+            for (auto &[client, send] : chunk) {
+                client->send_zoom(fft_buffer, frame_num, send);
+                client->busy.store(false);
+            }
+        });
+}
 
-    auto &io_service = m_server.get_io_service();
-    for (int i = 0; i < downsample_levels; i++) {
+uint32_t broadcast_server::waterfall_levels_needed(int first_level,
+                                                   int num_levels) {
+    uint32_t levels = 0;
+    for (int i = 0; i < num_levels; i++) {
+        std::scoped_lock lg(waterfall_slice_mtx[first_level + i]);
+        if (!waterfall_slices[first_level + i].empty()) {
+            levels |= 1u << i;
+        }
+    }
+    return levels;
+}
+
+void broadcast_server::waterfall_loop(FFTFrame &frame, int first_level,
+                                      int result_size) {
+    int8_t *fft_power_quantized = frame.fft_power_quantized;
+    auto &waterfall_work = frame.waterfall_work;
+    waterfall_work.clear();
+    auto &tiles = frame.tiles;
+    int pyramid_levels = std::bit_width(frame.pyramid_mask);
+    tiles.reset(layout.tile_size, fft_power_quantized, result_size,
+                pyramid_levels);
+    // Clients that moved to a level that was not built wait for the next frame
+    for (int i = 0; i < pyramid_levels; i++) {
+        if (!(frame.pyramid_mask >> i & 1)) {
+            fft_power_quantized += (result_size >> i);
+            continue;
+        }
         // Iterate over each waterfall client and send each slice
-        std::scoped_lock lg(waterfall_slice_mtx[i]);
-        for (auto &[slice, data] : waterfall_slices[i]) {
+        std::scoped_lock lg(waterfall_slice_mtx[first_level + i]);
+        for (auto &[slice, data] : waterfall_slices[first_level + i]) {
             auto &[l_idx, r_idx] = slice;
             // If the client is slow, avoid unnecessary buffering and
             // drop the packet
-            auto con = m_server.get_con_from_hdl(data->hdl);
-            if (con->get_buffered_amount() > 50000) {
+            if (!data->con || data->con->get_buffered_amount() > 50000) {
                 continue;
             }
-            // Equivalent to
-            // data->send_waterfall(&fft_power_quantized[l_idx],frame_num);
-            futures.emplace_back(io_service.post(boost::asio::use_future(
-                std::bind(&WaterfallClient::send_waterfall, data,
-                          &fft_power_quantized[l_idx], frame_num))));
+            // Still sending an older frame, skip this one
+            if (data->busy.exchange(true)) {
+                continue;
+            }
+            waterfall_work.emplace_back(data, &fft_power_quantized[l_idx]);
+            if (data->tiled) {
+                tiles.request(i, l_idx, r_idx);
+            }
         }
 
         // Prevent overwrite of previous level's quantized waterfall
-        fft_power_quantized += (fft_result_size >> i);
+        fft_power_quantized += (result_size >> i);
+    }
+    // The main tier's history keeps every tile of its levels while anyone
+    // reads it
+    bool history = waterfall_history && first_level == 0 &&
+                   waterfall_history->has_subscribers();
+    if (history) {
+        waterfall_history->request(tiles);
     }
-    return futures;
-}
\ No newline at end of file
+    if (waterfall_work.empty() && !history) {
+        return;
+    }
+
+    // Compressing the tiles is left to the pool like the other stages, the
+    // FFT thread goes on with the next frame
+    frame.done.add(1);
+    dsp_pool()->post([this, &frame, history]() {
+        auto &tiles = frame.tiles;
+        // Each tile in view is compressed once however many clients see it,
+        // the views with a tile that failed fall back to their own rows
+        if (int failed = tiles.compress()) {
+            std::cout << "Waterfall tiles failed to compress: " << failed
+                      << std::endl;
+        }
+        try {
+            if (history) {
+                waterfall_history->add(frame.frame_num, tiles);
+            }
+        } catch (const std::exception &e) {
+            std::cout << "Waterfall history failed: " << e.what()
+                      << std::endl;
+        }
+        dispatch_chunks(
+            *dsp_pool(), frame.waterfall_work, frame.done,
+            [frame_num = frame.frame_num, &tiles](
+                std::span<std::pair<std::shared_ptr<WaterfallClient>, int8_t *>>
+                    chunk) {
+                for (auto &[client, buf] : chunk) {
+                    client->send_waterfall(buf, frame_num, tiles);
+                    client->busy.store(false);
+                }
+            });
+        frame.done.count_down();
+    });
+}
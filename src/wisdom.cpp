@@ -0,0 +1,155 @@
+#include "wisdom.h"
+
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+static std::string wisdom_directory;
+
+// Wisdom is only valid on the CPU it was measured on
+static std::string cpu_name() {
+    std::string name;
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int brand[12];
+    if (__get_cpuid_max(0x80000000, nullptr) >= 0x80000004) {
+        for (unsigned int i = 0; i < 3; i++) {
+            __get_cpuid(0x80000002 + i, &brand[i * 4], &brand[i * 4 + 1],
+                        &brand[i * 4 + 2], &brand[i * 4 + 3]);
+        }
+        name.assign((char *)brand, strnlen((char *)brand, sizeof(brand)));
+    }
+#endif
+    if (name.empty()) {
+        name = "generic";
+    }
+
+    // Keep it safe to use as a filename
+    std::string sanitized;
+    for (char c : name) {
+        if (isalnum((unsigned char)c) || c == '-' || c == '.') {
+            sanitized += c;
+        } else if (sanitized.size() && sanitized.back() != '_') {
+            sanitized += '_';
+        }
+    }
+    while (sanitized.size() && sanitized.back() == '_') {
+        sanitized.pop_back();
+    }
+    return sanitized;
+}
+
+static const char *plan_kind_name(fftw_plan_kind kind) {
+    switch (kind) {
+    case PLAN_C2C_FORWARD:
+        return "c2c_fwd";
+    case PLAN_C2C_BACKWARD:
+        return "c2c_bwd";
+    case PLAN_R2C:
+        return "r2c";
+    case PLAN_C2R:
+        return "c2r";
+    default:
+        return "unknown";
+    }
+}
+
+void fftw_wisdom_set_directory(const std::string &directory) {
+    wisdom_directory = directory;
+    if (wisdom_directory.empty()) {
+        return;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(wisdom_directory, ec);
+    if (ec) {
+        std::cout << "Cannot create FFTW wisdom directory " << wisdom_directory
+                  << ": " << ec.message() << std::endl;
+        wisdom_directory.clear();
+    }
+}
+
+std::string fftw_wisdom_filename(fftw_plan_kind kind, int size, int nthreads) {
+    static const std::string cpu = cpu_name();
+    std::string filename = cpu + "_" + plan_kind_name(kind) + "_" +
+                           std::to_string(size) + "_" +
+                           std::to_string(nthreads) + "t.wisdom";
+    return (std::filesystem::path(wisdom_directory) / filename).string();
+}
+
+bool fftw_wisdom_import(fftw_plan_kind kind, int size, int nthreads) {
+    if (wisdom_directory.empty()) {
+        return false;
+    }
+    // Whatever other transforms left behind would end up in this file
+    fftwf_forget_wisdom();
+    std::string filename = fftw_wisdom_filename(kind, size, nthreads);
+    if (!std::filesystem::exists(filename)) {
+        return false;
+    }
+    if (!fftwf_import_wisdom_from_filename(filename.c_str())) {
+        std::cout << "Ignoring unreadable FFTW wisdom " << filename
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void fftw_wisdom_export(fftw_plan_kind kind, int size, int nthreads) {
+    if (wisdom_directory.empty()) {
+        return;
+    }
+    std::string filename = fftw_wisdom_filename(kind, size, nthreads);
+    // Write to a temporary file first so a crash never leaves a partial file
+    std::string tmp_filename = filename + ".tmp";
+    if (!fftwf_export_wisdom_to_filename(tmp_filename.c_str())) {
+        std::cout << "Cannot write FFTW wisdom " << filename << std::endl;
+        return;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_filename, filename, ec);
+}
+
+fftwf_plan fftw_wisdom_plan_rows(fftw_plan_kind kind, int size, int howmany,
+                                 void *in, void *out, unsigned flags) {
+    fftw_wisdom_import(kind, size, 1);
+    fftwf_plan_with_nthreads(1);
+    fftwf_plan p = nullptr;
+    switch (kind) {
+    case PLAN_C2C_FORWARD:
+    case PLAN_C2C_BACKWARD:
+        p = fftwf_plan_many_dft(
+            1, &size, howmany, (fftwf_complex *)in, nullptr, 1, size,
+            (fftwf_complex *)out, nullptr, 1, size,
+            kind == PLAN_C2C_FORWARD ? FFTW_FORWARD : FFTW_BACKWARD, flags);
+        break;
+    case PLAN_R2C:
+        p = fftwf_plan_many_dft_r2c(1, &size, howmany, (float *)in, nullptr, 1,
+                                    size, (fftwf_complex *)out, nullptr, 1,
+                                    size, flags);
+        break;
+    case PLAN_C2R:
+        p = fftwf_plan_many_dft_c2r(1, &size, howmany, (fftwf_complex *)in,
+                                    nullptr, 1, size, (float *)out, nullptr, 1,
+                                    size, flags);
+        break;
+    }
+    fftw_wisdom_export(kind, size, 1);
+    return p;
+}
+
+void fftw_wisdom_tune(fftw_plan_kind kind, int size, int howmany,
+                      unsigned flags) {
+    fftwf_complex *in =
+        (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * size * howmany);
+    fftwf_complex *out =
+        (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * size * howmany);
+    fftwf_plan p = fftw_wisdom_plan_rows(kind, size, howmany, in, out, flags);
+    if (p) {
+        fftwf_destroy_plan(p);
+    }
+    fftwf_free(in);
+    fftwf_free(out);
+}
@@ -0,0 +1,42 @@
+#ifndef WISDOM_H
+#define WISDOM_H
+
+#include <string>
+
+#include <fftw3.h>
+
+// On disk FFTW wisdom, one file per transform so the expensive planning only
+// happens once per machine. FFTW only has one global store of wisdom, so it
+// is forgotten on every import and each file only ever holds the wisdom of
+// its own transform. All functions expect fftwf_planner_mutex to be held
+// since FFTW wisdom is global state.
+enum fftw_plan_kind {
+    PLAN_C2C_FORWARD,
+    PLAN_C2C_BACKWARD,
+    PLAN_R2C,
+    PLAN_C2R,
+};
+
+// Empty directory disables the wisdom store
+void fftw_wisdom_set_directory(const std::string &directory);
+
+// File the wisdom is stored in, keyed by CPU, transform kind, size and threads
+std::string fftw_wisdom_filename(fftw_plan_kind kind, int size, int nthreads);
+
+// Forgets the wisdom gathered so far, returns true if wisdom for the
+// transform was found and imported. Planning between an import and the
+// export of the same transform stores only that transform's wisdom
+bool fftw_wisdom_import(fftw_plan_kind kind, int size, int nthreads);
+void fftw_wisdom_export(fftw_plan_kind kind, int size, int nthreads);
+
+// Plans a single threaded transform over howmany contiguous rows of size
+// elements, real rows included, on in and out and stores the wisdom
+fftwf_plan fftw_wisdom_plan_rows(fftw_plan_kind kind, int size, int howmany,
+                                 void *in, void *out, unsigned flags);
+
+// Plans the transform on buffers of its own with the given planner flags
+// and stores the result, used by --tune
+void fftw_wisdom_tune(fftw_plan_kind kind, int size, int howmany,
+                      unsigned flags);
+
+#endif